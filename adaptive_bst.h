@@ -0,0 +1,445 @@
+#ifndef ADAPTIVE_BST_H
+#define ADAPTIVE_BST_H
+
+#include "bst.h"
+#include <chrono>
+
+/**
+ * Tree which keeps its keys either in a CoarseGrainedBST, which is the
+ * fastest with one thread at a time, or in a LockFreeBST, which scales
+ * with many threads, and moves them over online.
+ *
+ * The contention signal is the overlap of operations: every operation
+ * notes whether another one was running when it started. Each thread
+ * folds this into a window of WINDOW operations, and a window with more
+ * than 1/HIGH_SHARE overlapped operations moves the keys to LockFreeBST,
+ * one with less than 1/LOW_SHARE moves them back. The gap between the two
+ * thresholds and a minimum time between switches keep it from flapping.
+ *
+ * A switch copies the keys while operations keep running on the active
+ * tree. It first turns on mirroring: from then on every update runs on
+ * both trees, under a striped lock of its key so that both trees see the
+ * updates of a key in the same order. The keys are then collected by
+ * walking successors, which sees every key that stayed in the tree, and
+ * copied in median-first order. Each key is copied under its stripe and
+ * only if the active tree still holds it. Finally the other tree is made
+ * active. Turning mirroring on and flipping the active tree stop new
+ * operations and wait for running ones like gc() does, but they copy
+ * nothing, so neither pause depends on n. During the copy, updates cost
+ * twice as much. The old tree is cleared after the flip, while operations
+ * run on the new one.
+ */
+template<typename T>
+class AdaptiveBST : public BST<T> {
+    // Contention seen by one thread since its last decision
+    struct window_t {
+        const void* owner; // Tree the counts belong to
+        size_t ops;
+        size_t overlapped; // Operations which started while another one was running
+    };
+    static thread_local window_t window;
+
+    CoarseGrainedBST<T> coarse;
+    LockFreeBST<T> lock_free;
+    std::atomic<bool> use_lock_free; // Which tree holds the keys
+    std::atomic<bool> migrating;     // Updates also run on the inactive tree
+    std::mutex migrate_mtx;          // Held by the switch in progress
+
+    // Orders the updates of a key on both trees while migrating
+    struct stripe_t {
+        std::mutex mtx;
+        char pad[64]; // Keep stripes on different cache lines
+    };
+    static const size_t STRIPES = 32;
+    stripe_t stripes[STRIPES];
+
+    std::mutex& stripe_of(const T& key) {
+        return stripes[std::hash<T>()(key) % STRIPES].mtx;
+    }
+
+    /**
+     * Atomic variables and locks for GC purpose, which also stop operations during a switch
+     */
+    std::atomic<int> rw_count;
+    std::mutex mtx;
+    std::atomic<bool> switching;
+
+    size_t min_switch_ms;
+    std::atomic<size_t> last_switch;  // Time of the last switch in ns
+    std::atomic<size_t> switch_count;
+
+    BST<T>& active() {
+        if (use_lock_free.load()) {
+            return lock_free;
+        }
+        return coarse;
+    }
+
+    BST<T>& inactive() {
+        if (use_lock_free.load()) {
+            return coarse;
+        }
+        return lock_free;
+    }
+
+    /**
+     * Wait until no switch is running and register the operation
+     *
+     * @return whether another operation was running
+     */
+    bool enter();
+
+    // Unregister the operation and account it in the window of the thread
+    void leave(bool overlapped);
+
+    /**
+     * Call f on sorted keys so that every subtree gets its median first.
+     * Inserting in this order keeps the unbalanced trees at O(log n) depth.
+     */
+    template<typename F>
+    static void median_first(const std::vector<T>& keys, F f);
+
+    // Stop new operations and wait for running ones, like gc()
+    void stop_world();
+    void resume_world();
+
+    // Switch with migrate_mtx held
+    void run_migration(bool to_lock_free);
+
+    static size_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    static const size_t WINDOW = 1024;
+    static const size_t HIGH_SHARE = 4;
+    static const size_t LOW_SHARE = 32;
+
+    /**
+     * @param _min_switch_ms minimum time between two automatic switches in milliseconds
+     */
+    AdaptiveBST(size_t _min_switch_ms=100);
+    AdaptiveBST(AdaptiveBST& other)=delete;
+    AdaptiveBST& operator=(const AdaptiveBST& other)=delete;
+
+    /**
+     * Move the keys to the given tree now, if they are not there yet.
+     * Operations of other threads keep running during the copy.
+     *
+     * @param to_lock_free true for LockFreeBST; false for CoarseGrainedBST
+     */
+    void migrate(bool to_lock_free);
+
+    bool is_lock_free() { return use_lock_free.load(); }
+    size_t switches() { return switch_count.load(); }
+
+    virtual bool insert(const T& t);
+    virtual void erase(const T& t);
+    virtual bool find(const T& t);
+    virtual size_t size();
+    virtual void clear();
+    virtual shape_stats_t shape_stats() { return active().shape_stats(); }
+    virtual void set_N(size_t _N);
+    virtual void set_R(size_t _R);
+    virtual void set_fingers(bool enabled);
+    virtual const ReclaimStats* reclaim_stats() { return lock_free.reclaim_stats(); }
+    virtual void register_thread(size_t tid);
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void split_keys(size_t count, std::vector<T>& keys) { active().split_keys(count, keys); }
+
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+        active().walk_range(lo, hi, f);
+    }
+
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results);
+};
+
+template<typename T>
+thread_local typename AdaptiveBST<T>::window_t AdaptiveBST<T>::window;
+
+template<typename T>
+AdaptiveBST<T>::AdaptiveBST(size_t _min_switch_ms):
+    use_lock_free(false), migrating(false), rw_count(0), switching(false), min_switch_ms(_min_switch_ms),
+    last_switch(now()), switch_count(0) {}
+
+template<typename T>
+bool AdaptiveBST<T>::enter() {
+    while (true) {
+        {
+            BST_TRACE_SCOPE("gc_barrier");
+            mtx.lock();
+            mtx.unlock();
+        }
+        int running = rw_count++;
+        // A switch which started after the barrier has not seen this operation yet
+        if (!switching.load()) {
+            return running > 0;
+        }
+        rw_count--;
+    }
+}
+
+template<typename T>
+void AdaptiveBST<T>::leave(bool overlapped) {
+    rw_count--;
+    window_t& w = window;
+    if (w.owner != this) {
+        w.owner = this;
+        w.ops = 0;
+        w.overlapped = 0;
+    }
+    w.ops++;
+    if (overlapped) {
+        w.overlapped++;
+    }
+    if (w.ops < WINDOW) {
+        return;
+    }
+    bool to_lock_free = w.overlapped * HIGH_SHARE > w.ops;
+    bool to_coarse = w.overlapped * LOW_SHARE < w.ops;
+    w.ops = 0;
+    w.overlapped = 0;
+    if (now() - last_switch.load() < min_switch_ms * 1000000) {
+        return;
+    }
+    if (!(to_lock_free && !use_lock_free.load()) && !(to_coarse && use_lock_free.load())) {
+        return;
+    }
+    // Another thread is switching already
+    std::unique_lock<std::mutex> lock(migrate_mtx, std::try_to_lock);
+    if (lock.owns_lock()) {
+        run_migration(to_lock_free);
+    }
+}
+
+template<typename T>
+template<typename F>
+void AdaptiveBST<T>::median_first(const std::vector<T>& keys, F f) {
+    std::vector<std::pair<size_t, size_t>> queue;
+    queue.push_back(std::make_pair(0, keys.size()));
+    for (size_t head = 0; head < queue.size(); head++) {
+        size_t lo = queue[head].first;
+        size_t hi = queue[head].second;
+        if (lo >= hi) {
+            continue;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        f(keys[mid]);
+        queue.push_back(std::make_pair(lo, mid));
+        queue.push_back(std::make_pair(mid + 1, hi));
+    }
+}
+
+template<typename T>
+void AdaptiveBST<T>::stop_world() {
+    mtx.lock();
+    switching.store(true);
+    BST_TRACE_SCOPE("gc_wait");
+    while (rw_count > 0);
+}
+
+template<typename T>
+void AdaptiveBST<T>::resume_world() {
+    switching.store(false);
+    mtx.unlock();
+}
+
+template<typename T>
+void AdaptiveBST<T>::migrate(bool to_lock_free) {
+    std::lock_guard<std::mutex> lock(migrate_mtx);
+    run_migration(to_lock_free);
+}
+
+template<typename T>
+void AdaptiveBST<T>::run_migration(bool to_lock_free) {
+    if (use_lock_free.load() == to_lock_free) {
+        return;
+    }
+    BST_TRACE_SCOPE("switch");
+    BST<T>& from = active();
+    BST<T>& to = inactive();
+    // Updates which started before mirroring only ran on from, wait for them
+    stop_world();
+    migrating.store(true);
+    resume_world();
+
+    // A key which stays in from all along is seen by the walk, any other
+    // key was updated on both trees since mirroring started
+    std::vector<T> keys;
+    T key;
+    bool found = from.nearest(T(), false, true, true, key);
+    while (found) {
+        keys.push_back(key);
+        T next;
+        found = from.nearest(key, true, false, true, next);
+        key = next;
+    }
+    median_first(keys, [&](const T& k) {
+        std::lock_guard<std::mutex> lock(stripe_of(k));
+        if (from.find(k)) {
+            to.insert(k);
+        }
+    });
+
+    stop_world();
+    use_lock_free.store(to_lock_free);
+    migrating.store(false);
+    last_switch.store(now());
+    switch_count++;
+    resume_world();
+    // No operation reaches from any more
+    from.clear();
+}
+
+template<typename T>
+bool AdaptiveBST<T>::insert(const T& t) {
+    bool overlapped = enter();
+    bool result;
+    if (migrating.load()) {
+        std::lock_guard<std::mutex> lock(stripe_of(t));
+        result = active().insert(t);
+        if (result) {
+            inactive().insert(t);
+        }
+    } else {
+        result = active().insert(t);
+    }
+    leave(overlapped);
+    return result;
+}
+
+template<typename T>
+void AdaptiveBST<T>::erase(const T& t) {
+    bool overlapped = enter();
+    if (migrating.load()) {
+        std::lock_guard<std::mutex> lock(stripe_of(t));
+        active().erase(t);
+        inactive().erase(t);
+    } else {
+        active().erase(t);
+    }
+    leave(overlapped);
+}
+
+template<typename T>
+bool AdaptiveBST<T>::find(const T& t) {
+    bool overlapped = enter();
+    bool result = active().find(t);
+    leave(overlapped);
+    return result;
+}
+
+template<typename T>
+size_t AdaptiveBST<T>::size() {
+    enter();
+    size_t result = active().size();
+    rw_count--;
+    return result;
+}
+
+template<typename T>
+void AdaptiveBST<T>::clear() {
+    coarse.clear();
+    lock_free.clear();
+}
+
+template<typename T>
+void AdaptiveBST<T>::set_N(size_t _N) {
+    BST<T>::set_N(_N);
+    coarse.set_N(_N);
+    lock_free.set_N(_N);
+}
+
+template<typename T>
+void AdaptiveBST<T>::set_R(size_t _R) {
+    BST<T>::set_R(_R);
+    coarse.set_R(_R);
+    lock_free.set_R(_R);
+}
+
+template<typename T>
+void AdaptiveBST<T>::set_fingers(bool enabled) {
+    coarse.set_fingers(enabled);
+    lock_free.set_fingers(enabled);
+}
+
+template<typename T>
+void AdaptiveBST<T>::register_thread(size_t tid) {
+    coarse.register_thread(tid);
+    lock_free.register_thread(tid);
+}
+
+template<typename T>
+void AdaptiveBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    bool overlapped = enter();
+    active().range_query(lo, hi, out);
+    leave(overlapped);
+}
+
+template<typename T>
+bool AdaptiveBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    bool overlapped = enter();
+    bool found = active().nearest(t, bounded, inclusive, ascending, result);
+    leave(overlapped);
+    return found;
+}
+
+template<typename T>
+size_t AdaptiveBST<T>::rank(const T& t) {
+    bool overlapped = enter();
+    size_t result = active().rank(t);
+    leave(overlapped);
+    return result;
+}
+
+template<typename T>
+bool AdaptiveBST<T>::select(size_t k, T& result) {
+    bool overlapped = enter();
+    bool found = active().select(k, result);
+    leave(overlapped);
+    return found;
+}
+
+template<typename T>
+size_t AdaptiveBST<T>::range_count(const T& lo, const T& hi) {
+    bool overlapped = enter();
+    size_t result = active().range_count(lo, hi);
+    leave(overlapped);
+    return result;
+}
+
+template<typename T>
+size_t AdaptiveBST<T>::erase_range(const T& lo, const T& hi) {
+    bool overlapped = enter();
+    size_t result;
+    if (migrating.load()) {
+        // Keys of the range may be in any stripe
+        for (stripe_t& stripe : stripes) {
+            stripe.mtx.lock();
+        }
+        result = active().erase_range(lo, hi);
+        inactive().erase_range(lo, hi);
+        for (stripe_t& stripe : stripes) {
+            stripe.mtx.unlock();
+        }
+    } else {
+        result = active().erase_range(lo, hi);
+    }
+    leave(overlapped);
+    return result;
+}
+
+template<typename T>
+void AdaptiveBST<T>::find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+    bool overlapped = enter();
+    active().find_many(keys, results);
+    leave(overlapped);
+}
+
+#endif
@@ -10,6 +10,18 @@
 #include <unordered_set>
 #include <condition_variable>
 #include <climits>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <pthread.h>
+#include "stats.h"
+#include "reclaim_stats.h"
+#include "trace.h"
+#include "thread_pool.h"
+#include "shape_stats.h"
+#include "contention.h"
+#include "update_seq.h"
+#include "export.h"
 
 /**
  * The interface for binary search tree definition
@@ -18,8 +30,9 @@ template<typename T>
 class BST {
 protected:
     size_t N; // Thread number for using the bst
-    static const size_t R; // Retire list length for each thread
+    size_t R; // Retire list length for each thread
 public:
+    BST(): N(0), R(100) {}
     virtual ~BST() {}
     // Insert element
     virtual bool insert(const T& t)=0;
@@ -31,41 +44,689 @@ public:
     virtual size_t size()=0;
     // Clear the content of the tree
     virtual void clear()=0;
+    // Height, depth histogram and node counts of the tree
+    virtual shape_stats_t shape_stats()=0;
     // Set the number of thread using the tree
     virtual void set_N(size_t _N) { N = _N; }
+    // Set the retire list length which triggers garbage collection
+    virtual void set_R(size_t _R) { R = _R; }
+    size_t get_R() const { return R; }
+    // Let traversals start from the calling thread's last position, in trees which support it
+    virtual void set_fingers(bool enabled) {}
+    // Reclamation telemetry, nullptr if the tree frees nodes immediately
+    virtual const ReclaimStats* reclaim_stats() { return nullptr; }
     // Register the thread id for the current thread
     virtual void register_thread(size_t tid)=0;
+    // Store all keys in [lo, hi) to out in ascending order
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out)=0;
+
+    /**
+     * Call f on all keys in [lo, hi) in ascending order. Keys are collected
+     * by range_query first, so f never runs inside the tree.
+     */
+    void for_each_in_range(const T& lo, const T& hi, const std::function<void(const T&)>& f) {
+        std::vector<T> keys;
+        range_query(lo, hi, keys);
+        for (const T& key : keys) {
+            f(key);
+        }
+    }
+
+    /**
+     * Find the key closest to t in one direction. lower_bound, successor,
+     * predecessor, min and max below are shorthands for it.
+     *
+     * @param t the bound, ignored if bounded is false
+     * @param bounded false to look for the minimum or the maximum key
+     * @param inclusive whether t itself may be the result
+     * @param ascending true for the smallest key after t; false for the largest key before t
+     * @param result where the key is stored to
+     * @return true if such key exists; false otherwise
+     */
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result)=0;
+    // Smallest key not less than t
+    bool lower_bound(const T& t, T& result) { return nearest(t, true, true, true, result); }
+    // Smallest key greater than t, the upper_bound of std::set
+    bool successor(const T& t, T& result) { return nearest(t, true, false, true, result); }
+    // Largest key less than t
+    bool predecessor(const T& t, T& result) { return nearest(t, true, false, false, result); }
+    // Smallest key in the tree
+    bool min(T& result) { return nearest(T(), false, true, true, result); }
+    // Largest key in the tree
+    bool max(T& result) { return nearest(T(), false, true, false, result); }
+    // Number of keys smaller than t
+    virtual size_t rank(const T& t)=0;
+    // The k-th smallest key, counting from 0
+    virtual bool select(size_t k, T& result)=0;
+    // Number of keys in [lo, hi)
+    virtual size_t range_count(const T& lo, const T& hi)=0;
+
+    /**
+     * Erase all keys in [lo, hi). Trees detach subtrees which lie inside of
+     * the range as a whole, or reach each key from the previous one, so it
+     * takes about O(depth + removed) instead of one erase per key.
+     *
+     * @return number of keys erased
+     */
+    virtual size_t erase_range(const T& lo, const T& hi)=0;
+
+    /**
+     * At most count keys in ascending order which split the keys into
+     * ranges of about equal size, also in a degenerate tree. The default
+     * samples them by one in-order walk of all keys. Trees with subtree
+     * counts override it with select(), and trees without them sample
+     * the top of the tree with split_from_top() and only walk when it is
+     * too skewed. The tree must be quiescent.
+     */
+    virtual void split_keys(size_t count, std::vector<T>& keys) {
+        keys.clear();
+        size_t n = size();
+        size_t seen = 0;
+        size_t next = 1; // The next split key is the one at rank next * n / (count + 1)
+        walk_range(nullptr, nullptr, [&](const T& key) {
+            if (next <= count && seen == next * n / (count + 1)) {
+                keys.push_back(key);
+                while (next <= count && next * n / (count + 1) <= seen) {
+                    next++;
+                }
+            }
+            seen++;
+        });
+    }
+
+    /**
+     * In-order walk over keys in [*lo, *hi) with an explicit stack, without
+     * locks and without validation, so the tree must be quiescent.
+     * nullptr bounds are unbounded.
+     */
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f)=0;
+
+    /**
+     * Call f on every key, from the threads of the pool. The tree is split
+     * into SPLIT_FACTOR ranges per thread which are walked independently.
+     * Keys of one range are visited in ascending order. The tree must be
+     * quiescent.
+     */
+    template<typename F>
+    void parallel_for_each(F f, ThreadPool& pool) {
+        std::vector<T> bounds;
+        split_keys(pool.size() * SPLIT_FACTOR, bounds);
+        pool.run(bounds.size() + 1, [&](size_t part) {
+            walk_range(part == 0 ? nullptr : &bounds[part - 1],
+                part == bounds.size() ? nullptr : &bounds[part], f);
+        });
+    }
+
+    /**
+     * Fold all keys into a value on the threads of the pool. Every range
+     * folds its keys in ascending order starting from identity with op,
+     * and the results of the ranges are folded in ascending order with
+     * combine, so combine only needs to be associative.
+     *
+     * @param identity neutral value of combine
+     * @param op (R, const T&) -> R
+     * @param combine (R, R) -> R
+     */
+    template<typename R, typename Op, typename Combine>
+    R parallel_reduce(const R& identity, Op op, Combine combine, ThreadPool& pool) {
+        std::vector<T> bounds;
+        split_keys(pool.size() * SPLIT_FACTOR, bounds);
+        std::vector<R> partial(bounds.size() + 1, identity);
+        pool.run(partial.size(), [&](size_t part) {
+            R acc = identity;
+            walk_range(part == 0 ? nullptr : &bounds[part - 1],
+                part == bounds.size() ? nullptr : &bounds[part], [&](const T& key) {
+                acc = op(acc, key);
+            });
+            partial[part] = acc;
+        });
+        R result = identity;
+        for (const R& value : partial) {
+            result = combine(result, value);
+        }
+        return result;
+    }
+
+    // parallel_reduce where keys and results fold with the same op, e.g. a sum
+    template<typename R, typename Op>
+    R parallel_reduce(const R& identity, Op op, ThreadPool& pool) {
+        return parallel_reduce(identity, op, op, pool);
+    }
+
+    static const size_t SPLIT_FACTOR = 8;
+
+    /**
+     * Look up a batch of keys. Trees which override it interleave
+     * FIND_LANES traversals and prefetch the next node of each, so that
+     * several independent cache misses are in flight at once (AMAC).
+     *
+     * @param results results[i] is true if keys[i] is in the tree
+     */
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+        results.assign(keys.size(), false);
+        for (size_t i = 0; i < keys.size(); i++) {
+            results[i] = find(keys[i]);
+        }
+    }
+
+    static const size_t FIND_LANES = 8;
 };
 
+/**
+ * Whether key is on the requested side of the bound, see BST::nearest
+ */
+template<typename T>
+bool within_bound(const T& key, const T& t, bool bounded, bool inclusive, bool ascending) {
+    if (!bounded) {
+        return true;
+    }
+    if (ascending) {
+        return inclusive ? !(key < t) : t < key;
+    }
+    return inclusive ? !(t < key) : key < t;
+}
+
+/**
+ * Sample split keys (see BST::split_keys) from the top of a tree instead
+ * of walking all of its keys. The frontier subtree with the most keys is
+ * expanded until none of them holds more than half a range, or until
+ * count * SPLIT_SAMPLE nodes are expanded, after which it may hold at
+ * most SPLIT_SAMPLE ranges. The keys of a subtree are
+ * estimated by SPLIT_PROBES random descents (Knuth's estimator), each of
+ * which adds the keys of a node times the branching above it. The split
+ * keys are then the keys of expanded nodes at about even estimated ranks.
+ *
+ * @param root node the sample starts from
+ * @param n number of keys in the tree, which bounds the probe depth
+ * @param expand expand(node, left, right, key, weight) stores the children
+ *        of node (nullptr for none), a pointer to its key if the key may
+ *        bound a range (nullptr otherwise), and the number of keys the node
+ *        holds itself, 0 for routing nodes and sentinels
+ * @return false if a probe or an expanded node went deeper than a tree of
+ *         n keys should be, or if a frontier subtree was still too large
+ *         when the budget ran out; keys is not set then
+ */
+template<typename T, typename Node, typename Expand>
+bool split_from_top(Node* root, size_t n, size_t count, std::vector<T>& keys, Expand expand) {
+    static const size_t SPLIT_SAMPLE = 8;
+    static const size_t SPLIT_PROBES = 4;
+    struct item_t {
+        Node* node;
+        double estimate;   // Keys of the subtree, while it is on the frontier
+        bool expanded;
+        size_t child[2];   // Items of the children once expanded, SIZE_MAX for none
+        const T* key;
+        size_t weight;
+        size_t depth;
+    };
+    keys.clear();
+    if (root == nullptr || count == 0) {
+        return true;
+    }
+    size_t max_depth = 16;
+    for (size_t m = n; m > 0; m >>= 1) {
+        max_depth += 4;
+    }
+    size_t seed = 0x9e3779b97f4a7c15ull;
+    bool deep = false;
+    auto estimate = [&](Node* node) {
+        double sum = 0;
+        for (size_t probe = 0; probe < SPLIT_PROBES && !deep; probe++) {
+            double scale = 1;
+            Node* current = node;
+            for (size_t depth = 0; current != nullptr; depth++) {
+                if (depth > max_depth) {
+                    deep = true;
+                    break;
+                }
+                Node* children[2];
+                const T* key;
+                size_t weight;
+                expand(current, children[0], children[1], key, weight);
+                sum += scale * weight;
+                size_t branches = (children[0] != nullptr) + (children[1] != nullptr);
+                if (branches == 0) {
+                    break;
+                }
+                scale *= branches;
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                current = branches == 1 ? (children[0] != nullptr ? children[0] : children[1]) : children[seed & 1];
+            }
+        }
+        return sum / SPLIT_PROBES;
+    };
+    std::vector<item_t> items;
+    item_t top = { root, estimate(root), false, { SIZE_MAX, SIZE_MAX }, nullptr, 0, 0 };
+    items.push_back(top);
+    double range = top.estimate / (count + 1);
+    // Frontier items, the one with the largest estimate first
+    auto smaller = [&items](size_t a, size_t b) { return items[a].estimate < items[b].estimate; };
+    std::vector<size_t> frontier(1, 0);
+    size_t expanded = 0;
+    while (!deep && !frontier.empty() && items[frontier.front()].estimate > range / 2) {
+        if (expanded == count * SPLIT_SAMPLE) {
+            // Ranges are taken from a shared counter, so a few larger ones
+            // still balance out, but not one which holds many ranges
+            if (items[frontier.front()].estimate > SPLIT_SAMPLE * range) {
+                return false;
+            }
+            break;
+        }
+        std::pop_heap(frontier.begin(), frontier.end(), smaller);
+        size_t i = frontier.back();
+        frontier.pop_back();
+        Node* children[2];
+        expand(items[i].node, children[0], children[1], items[i].key, items[i].weight);
+        items[i].expanded = true;
+        expanded++;
+        if (items[i].depth > max_depth) {
+            // A path of expanded nodes, probes may miss it in a tree with leaves on every level
+            deep = true;
+            break;
+        }
+        for (int side = 0; side < 2; side++) {
+            if (children[side] != nullptr) {
+                item_t child = { children[side], estimate(children[side]), false, { SIZE_MAX, SIZE_MAX }, nullptr, 0,
+                    items[i].depth + 1 };
+                items[i].child[side] = items.size();
+                items.push_back(child);
+                frontier.push_back(items[i].child[side]);
+                std::push_heap(frontier.begin(), frontier.end(), smaller);
+            }
+        }
+    }
+    if (deep) {
+        return false;
+    }
+    // In-order over the expanded top: a frontier subtree counts with its
+    // estimate, and an expanded node may split right before itself
+    double total = 0;
+    for (const item_t& item : items) {
+        total += item.expanded ? item.weight : item.estimate;
+    }
+    double seen = 0;
+    size_t next = 1;
+    std::vector<std::pair<size_t, bool>> stack(1, std::make_pair(static_cast<size_t>(0), false));
+    while (!stack.empty() && next <= count) {
+        size_t i = stack.back().first;
+        bool visited = stack.back().second;
+        stack.pop_back();
+        const item_t& item = items[i];
+        if (!item.expanded) {
+            seen += item.estimate;
+            continue;
+        }
+        if (!visited) {
+            if (item.child[1] != SIZE_MAX) {
+                stack.push_back(std::make_pair(item.child[1], false));
+            }
+            stack.push_back(std::make_pair(i, true));
+            if (item.child[0] != SIZE_MAX) {
+                stack.push_back(std::make_pair(item.child[0], false));
+            }
+            continue;
+        }
+        if (item.key != nullptr && seen >= next * total / (count + 1)
+                && (keys.empty() || keys.back() < *item.key)) {
+            keys.push_back(*item.key);
+            while (next <= count && next * total / (count + 1) <= seen) {
+                next++;
+            }
+        }
+        seen += item.weight;
+    }
+    return true;
+}
+
+/**
+ * BST::nearest over keys in ascending order
+ */
 template<typename T>
-const size_t BST<T>::R = 100;
+bool nearest_in(const std::vector<T>& keys, const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    typename std::vector<T>::const_iterator it;
+    if (ascending) {
+        it = !bounded ? keys.begin() : inclusive ? std::lower_bound(keys.begin(), keys.end(), t)
+            : std::upper_bound(keys.begin(), keys.end(), t);
+        if (it == keys.end()) {
+            return false;
+        }
+        result = *it;
+        return true;
+    }
+    it = !bounded ? keys.end() : inclusive ? std::upper_bound(keys.begin(), keys.end(), t)
+        : std::lower_bound(keys.begin(), keys.end(), t);
+    if (it == keys.begin()) {
+        return false;
+    }
+    result = *(it - 1);
+    return true;
+}
+
+/**
+ * Next value of the process-wide finger generation. Trees take their
+ * finger epochs from it instead of counting from 0, so a tree built at
+ * the address of a destroyed one never accepts a finger into the old one.
+ */
+inline size_t next_finger_epoch() {
+    static std::atomic<size_t> generation(0);
+    return ++generation;
+}
+
+/**
+ * How CoarseGrainedBST synchronizes read-only operations with updates
+ */
+enum class ReadMode {
+    Lock=0,     // Readers take the mutex like updates
+    Shared,     // Readers share a reader-writer lock, updates take it exclusively
+    Optimistic, // find() runs without a lock and validates against removals
+    Unknown
+};
 
 /**
  * Coarse Grained BST uses the single global mutex to synchronize
  * operations. Concurrent operation is not allowed in this structure.
- * Only one operation can be performed at a time.
+ * Only one operation can be performed at a time, unless a read mode
+ * other than ReadMode::Lock lets reads overlap.
  */
 template<typename T>
 class CoarseGrainedBST : public BST<T> {
+    /**
+     * Child pointers are atomic since optimistic finds load them while
+     * writers relink. val never changes once the node is published.
+     */
     struct node_t {
-        node_t* left;
-        node_t* right;
+        std::atomic<node_t*> left;
+        std::atomic<node_t*> right;
         T val;
-        node_t(const T& _val) {
-            left = nullptr;
-            right = nullptr;
-            val = _val;
-        }
+        node_t(const T& _val): left(nullptr), right(nullptr), val(_val) {}
     };
-    node_t* root;
+
+    /**
+     * Node of an augmented tree. Only augmented trees allocate it, so the
+     * others do not pay 8 B per node for a count they never read.
+     */
+    struct counted_node_t : node_t {
+        size_t count; // Number of nodes in the subtree
+        counted_node_t(const T& _val): node_t(_val), count(1) {}
+    };
+    std::atomic<node_t*> root;
     size_t _size;
     std::mutex mtx;
+    const bool augmented; // Whether subtree counts are maintained
+
+    /**
+     * Last node a thread visited with the open key interval (lo, hi) of its
+     * subtree. Inserts only add leaves, so the interval of a node stays
+     * valid until a node is deleted, which moves epoch on.
+     */
+    struct finger_t {
+        const void* owner; // Tree the finger points into
+        size_t epoch;      // epoch when the finger was taken
+        node_t* node;
+        T lo;
+        T hi;
+        bool has_lo;
+        bool has_hi;
+    };
+    static thread_local finger_t finger;
+    bool fingers;  // Whether find and insert use fingers
+    size_t epoch;  // Changed whenever nodes are deleted, guarded by mtx
+
+    ReadMode read_mode;
+    pthread_rwlock_t rwlock; // Used instead of mtx in ReadMode::Shared
+
+    /**
+     * Seqlock of ReadMode::Optimistic. Removals bracket their pointer
+     * changes with useq, so an optimistic find which validates saw no
+     * half-done removal. Inserts only link a new leaf with one store and
+     * need no bracket.
+     */
+    update_seq_t<1> useq;
+
+    /**
+     * Optimistic finds in flight. Removed nodes are retired to rlist and
+     * only freed after reclaiming turned new finds away to the lock and
+     * rw_count dropped to 0, so a find never touches freed memory.
+     */
+    std::atomic<int> rw_count;
+    std::atomic<bool> reclaiming;
+    std::vector<node_t*> rlist; // Guarded by the write lock
+
+    static const int OPTIMISTIC_RETRIES = 16;
+    // Steps of an optimistic descent between two validations
+    static const size_t VALIDATE_STEPS = 64;
+
+    void lock_write() {
+        if (read_mode == ReadMode::Shared) {
+            pthread_rwlock_wrlock(&rwlock);
+        } else {
+            mtx.lock();
+        }
+    }
+
+    void unlock_write() {
+        if (read_mode == ReadMode::Shared) {
+            pthread_rwlock_unlock(&rwlock);
+        } else {
+            mtx.unlock();
+        }
+    }
+
+    void lock_read() {
+        if (read_mode == ReadMode::Shared) {
+            pthread_rwlock_rdlock(&rwlock);
+        } else {
+            mtx.lock();
+        }
+    }
+
+    void unlock_read() {
+        if (read_mode == ReadMode::Shared) {
+            pthread_rwlock_unlock(&rwlock);
+        } else {
+            mtx.unlock();
+        }
+    }
+
+    /**
+     * Link a new node into slot. The release store makes the fields of
+     * node visible before an optimistic find can reach it.
+     */
+    void publish(std::atomic<node_t*>& slot, node_t* node) {
+        slot.store(node, std::memory_order_release);
+    }
+
+    // Allocate a node of the type of this tree, counted_node_t if augmented
+    node_t* new_node(const T& val) const {
+        return augmented ? new counted_node_t(val) : new node_t(val);
+    }
+
+    // Free a node allocated by new_node
+    void free_node(node_t* node) const {
+        if (augmented) {
+            delete static_cast<counted_node_t*>(node);
+        } else {
+            delete node;
+        }
+    }
+
+    // Subtree count of a node of an augmented tree
+    static size_t& count_of(node_t* node) {
+        return static_cast<counted_node_t*>(node)->count;
+    }
+
+    // Free or retire a removed node, the caller must hold the write lock
+    void retire(node_t* node);
+
+    /**
+     * Turn new optimistic finds away to the lock and wait for running
+     * ones, so that nodes can be freed or relinked freely until
+     * release_readers(). The caller must hold the write lock.
+     */
+    void drain_readers();
+    void release_readers();
+
+    // Free the retired nodes, the caller must hold the write lock
+    void reclaim();
+
+    /**
+     * Lock-free descent which validates against removals.
+     *
+     * @param found set to whether t is in the tree
+     * @return false if the descent gave up after too many conflicts
+     */
+    bool optimistic_find(const T& t, bool& found);
+
+    /**
+     * Node where a descent for t starts, the finger if it is valid and its
+     * interval holds t, or root otherwise. The caller must hold the lock.
+     *
+     * @param lo where the lower bound of the start node is stored to, nullptr if none
+     * @param hi where the upper bound of the start node is stored to, nullptr if none
+     */
+    node_t* finger_start(const T& t, const T*& lo, const T*& hi);
+
+    // Iterative find and insert which start at finger_start and move the finger
+    bool finger_find(const T& t);
+    bool finger_insert(const T& t);
+    void set_finger(node_t* node, const T* lo, const T* hi);
     bool insert_helper(node_t* node, const T& elemnt);
     bool find_helper(const node_t* node, const T& element) const;
-    void erase_helper(node_t* parent, node_t* node, const T& element);
-    void clear(node_t* node);
+    bool erase_helper(node_t* parent, node_t* node, const T& element);
+    size_t clear(node_t* node);
+
+    /**
+     * Descend to the topmost node inside [lo, hi), the only node whose both
+     * subtrees overlap with the range, and remove the range below it.
+     *
+     * @return the subtree which replaces node
+     */
+    node_t* erase_range_helper(node_t* node, const T& lo, const T& hi, size_t& removed);
+
+    /**
+     * Remove keys not smaller than bound (keep_less) or keys smaller than
+     * bound (!keep_less). Every node which goes takes its whole subtree on
+     * the far side of bound with it, so only one path is walked.
+     *
+     * @return the subtree which replaces node
+     */
+    node_t* trim(node_t* node, const T& bound, bool keep_less, size_t& removed);
+
+    // Recompute the subtree counts of a path from its bottom, if augmented
+    void fix_counts(const std::vector<node_t*>& path);
+
+    /**
+     * Join two subtrees where all keys of left are smaller than all keys of
+     * right. The largest node of left becomes the root of both, so the
+     * height grows by at most one.
+     */
+    node_t* join(node_t* left, node_t* right);
+
+    /**
+     * Detach the largest node of a non-empty subtree, walking the right
+     * spine without recursion.
+     *
+     * @param last where the detached node is stored to
+     * @return the subtree without last
+     */
+    node_t* split_last(node_t* node, node_t*& last);
+
+    /**
+     * Make node the root of left and right, all keys of left are smaller and
+     * all keys of right larger than node. Updates the subtree count of node
+     * if augmented.
+     */
+    node_t* link(node_t* left, node_t* node, node_t* right) const;
+
+    /**
+     * Split a subtree into keys smaller and keys larger than key in one
+     * descent, the counts on the path are fixed bottom up afterwards.
+     *
+     * @return the detached node holding key, nullptr if there is none
+     */
+    node_t* split(node_t* node, const T& key, node_t*& left, node_t*& right) const;
+
+    /**
+     * Copy a subtree, the two children are copied in parallel. Below
+     * FORK_DEPTH levels the rest is copied by copy(node).
+     */
+    node_t* copy(const node_t* node, ThreadPool& pool, size_t depth) const;
+
+    // Copy a subtree with an explicit stack, a degenerate tree is as deep as it is large
+    node_t* copy(const node_t* node) const;
+
+    /**
+     * Fork a and b through the pool near the root, and run them in place
+     * below FORK_DEPTH levels, where subtrees are too small to pay off.
+     */
+    template<typename A, typename B>
+    static void fork(ThreadPool& pool, size_t depth, A a, B b);
+
+    static const size_t FORK_DEPTH = 12;
+
+    enum class SetOp {
+        Union, Intersection, Difference
+    };
+
+    /**
+     * Join-based set operations (Blelloch et al., "Just Join for Parallel
+     * Ordered Sets"). They consume both subtrees: the root of a splits b,
+     * the two halves recurse in parallel, and link or join assembles the
+     * result. Nodes which drop out are freed. Below FORK_DEPTH levels the
+     * rest runs in set_sequential(), so the call stack stays FORK_DEPTH
+     * deep however deep a is.
+     */
+    node_t* set_helper(SetOp op, node_t* a, node_t* b, ThreadPool& pool, size_t depth);
+
+    // set_helper without recursion, an explicit stack holds one frame per pending split
+    node_t* set_sequential(SetOp op, node_t* a, node_t* b);
+
+    // Result of op when a or b is empty
+    node_t* set_base(SetOp op, node_t* a, node_t* b);
+
+    /**
+     * Assemble the result of op from the root of a and the results for the
+     * two halves.
+     *
+     * @param found the node of b holding the key of a, nullptr if there is none
+     */
+    node_t* set_combine(SetOp op, node_t* a, node_t* found, node_t* left, node_t* right);
+
+    /**
+     * Replace the content of this tree by op applied to copies of a and b.
+     */
+    void set_operation(SetOp op, CoarseGrainedBST& a, CoarseGrainedBST& b, ThreadPool& pool);
+
+    /**
+     * In-order walk with an explicit stack which skips subtrees outside of
+     * [lo, hi). The caller must hold the lock.
+     *
+     * @param lo inclusive lower bound, nullptr for no bound
+     * @param hi exclusive upper bound, nullptr for no bound
+     * @param visit called on every key in range, the walk stops once it returns false
+     */
+    template<typename F>
+    void walk(const T* lo, const T* hi, F visit) const;
+
+    // Subtree count, only maintained if augmented
+    static size_t count(const node_t* node) {
+        return node == nullptr ? 0 : static_cast<const counted_node_t*>(node)->count;
+    }
+
+    // Number of nodes of a subtree, from its count if augmented and by a walk otherwise
+    size_t subtree_size(const node_t* node) const;
+
+    // Number of keys smaller than t, the caller must hold the lock
+    size_t rank_helper(const T& t) const;
 public:
-    CoarseGrainedBST();
+    /**
+     * @param augmented maintain subtree counts, so that rank, select and
+     *        range_count take O(depth) instead of walking the keys, at 8 B
+     *        more per node
+     */
+    CoarseGrainedBST(bool augmented=false);
     virtual ~CoarseGrainedBST();
     // Delete some default contructors and operators which may affect tree structure
     CoarseGrainedBST(const CoarseGrainedBST& other)=delete;
@@ -77,47 +738,318 @@ public:
     virtual bool find(const T& t);
     virtual size_t size();
     virtual void clear();
+    virtual shape_stats_t shape_stats();
     virtual void register_thread(size_t tid) {};
+
+    /**
+     * Fingers are not used with subtree counts, since inserts have to
+     * update the counts on the whole path from the root.
+     */
+    virtual void set_fingers(bool enabled) { fingers = enabled && !augmented; }
+
+    /**
+     * Must be called while the tree is quiescent. Finds in
+     * ReadMode::Optimistic do not use fingers.
+     */
+    void set_read_mode(ReadMode mode);
+    ReadMode get_read_mode() const { return read_mode; }
+
+    /**
+     * The lock is taken once for the whole batch.
+     */
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results);
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+
+    /**
+     * Replace the content of this tree by a set operation on two other
+     * trees, which are copied first and left unchanged. a and b must be
+     * quiescent and differ from this tree. Work is spread over the pool by
+     * fork-join recursion, instead of one insert() per key on one thread.
+     */
+    void set_union(CoarseGrainedBST& a, CoarseGrainedBST& b, ThreadPool& pool) {
+        set_operation(SetOp::Union, a, b, pool);
+    }
+    void set_intersection(CoarseGrainedBST& a, CoarseGrainedBST& b, ThreadPool& pool) {
+        set_operation(SetOp::Intersection, a, b, pool);
+    }
+    // Keys of a which are not in b
+    void set_difference(CoarseGrainedBST& a, CoarseGrainedBST& b, ThreadPool& pool) {
+        set_operation(SetOp::Difference, a, b, pool);
+    }
 };
 
 template<typename T>
-CoarseGrainedBST<T>::CoarseGrainedBST(): root(nullptr), _size(0) {}
+CoarseGrainedBST<T>::CoarseGrainedBST(bool _augmented):
+    root(nullptr), _size(0), augmented(_augmented), fingers(false), epoch(next_finger_epoch()),
+    read_mode(ReadMode::Lock), rw_count(0), reclaiming(false) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    // The default lets a steady stream of readers starve updates
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::set_read_mode(ReadMode mode) {
+    mtx.lock();
+    reclaim();
+    read_mode = mode;
+    mtx.unlock();
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::retire(node_t* node) {
+    if (read_mode != ReadMode::Optimistic) {
+        free_node(node);
+        return;
+    }
+    rlist.push_back(node);
+    if (rlist.size() > this->R) {
+        reclaim();
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::drain_readers() {
+    if (read_mode != ReadMode::Optimistic) {
+        return;
+    }
+    BST_TRACE_SCOPE("gc_wait");
+    reclaiming.store(true);
+    // Finds are short, but one which was preempted holds up every update
+    while (rw_count > 0) {
+        std::this_thread::yield();
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::release_readers() {
+    if (read_mode == ReadMode::Optimistic) {
+        reclaiming.store(false);
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::reclaim() {
+    if (rlist.empty()) {
+        return;
+    }
+    drain_readers();
+    for (node_t* node : rlist) {
+        free_node(node);
+    }
+    rlist.clear();
+    release_readers();
+}
+
+template<typename T>
+thread_local typename CoarseGrainedBST<T>::finger_t CoarseGrainedBST<T>::finger;
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::finger_start(const T& t, const T*& lo, const T*& hi) {
+    lo = nullptr;
+    hi = nullptr;
+    if (finger.owner != this || finger.epoch != epoch) {
+        return root;
+    }
+    if ((finger.has_lo && !(finger.lo < t)) || (finger.has_hi && !(t < finger.hi))) {
+        return root;
+    }
+    lo = finger.has_lo ? &finger.lo : nullptr;
+    hi = finger.has_hi ? &finger.hi : nullptr;
+    return finger.node;
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::set_finger(node_t* node, const T* lo, const T* hi) {
+    // Bounds are copied first, they may point into the old finger
+    finger.has_lo = lo != nullptr;
+    finger.has_hi = hi != nullptr;
+    if (lo != nullptr) {
+        finger.lo = *lo;
+    }
+    if (hi != nullptr) {
+        finger.hi = *hi;
+    }
+    finger.owner = this;
+    finger.epoch = epoch;
+    finger.node = node;
+}
+
+template<typename T>
+bool CoarseGrainedBST<T>::finger_find(const T& t) {
+    const T* lo;
+    const T* hi;
+    node_t* node = finger_start(t, lo, hi);
+    node_t* last = nullptr;
+    const T* last_lo = nullptr;
+    const T* last_hi = nullptr;
+    while (node != nullptr && !(t == node->val)) {
+        last = node;
+        last_lo = lo;
+        last_hi = hi;
+        if (t < node->val) {
+            hi = &node->val;
+            node = node->left;
+        } else {
+            lo = &node->val;
+            node = node->right;
+        }
+    }
+    if (node != nullptr) {
+        set_finger(node, lo, hi);
+        return true;
+    }
+    if (last != nullptr) {
+        set_finger(last, last_lo, last_hi);
+    }
+    return false;
+}
+
+template<typename T>
+bool CoarseGrainedBST<T>::finger_insert(const T& t) {
+    const T* lo;
+    const T* hi;
+    node_t* node = finger_start(t, lo, hi);
+    if (node == nullptr) {
+        publish(root, new_node(t));
+        set_finger(root, nullptr, nullptr);
+        return true;
+    }
+    while (true) {
+        if (t == node->val) {
+            set_finger(node, lo, hi);
+            return false;
+        }
+        std::atomic<node_t*>& child = t < node->val ? node->left : node->right;
+        if (t < node->val) {
+            hi = &node->val;
+        } else {
+            lo = &node->val;
+        }
+        if (child == nullptr) {
+            publish(child, new_node(t));
+            set_finger(child, lo, hi);
+            return true;
+        }
+        node = child;
+    }
+}
 
 template<typename T>
 CoarseGrainedBST<T>::~CoarseGrainedBST() {
     clear();
+    pthread_rwlock_destroy(&rwlock);
 }
 
 template<typename T>
 void CoarseGrainedBST<T>::clear() {
+    lock_write();
+    reclaim();
+    // Like erase_range, optimistic finds may still walk the nodes
+    drain_readers();
     clear(root);
     root = nullptr;
+    _size = 0;
+    epoch = next_finger_epoch();
+    release_readers();
+    unlock_write();
 }
 
+/**
+ * Free a subtree with an explicit stack, a degenerate tree is as deep as it is large.
+ *
+ * @return number of nodes freed
+ */
 template<typename T>
-void CoarseGrainedBST<T>::clear(node_t* node) {
-    if (node == nullptr) {
+size_t CoarseGrainedBST<T>::clear(node_t* node) {
+    size_t freed = 0;
+    std::vector<node_t*> stack;
+    if (node != nullptr) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        if (node->left != nullptr) {
+            stack.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+            stack.push_back(node->right);
+        }
+        free_node(node);
+        freed++;
+    }
+    return freed;
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::split_keys(size_t count, std::vector<T>& keys) {
+    if (!augmented) {
+        bool sampled = split_from_top(root.load(), _size, count, keys,
+            [](node_t* node, node_t*& left, node_t*& right, const T*& key, size_t& weight) {
+                left = node->left.load();
+                right = node->right.load();
+                key = &node->val;
+                weight = 1;
+            });
+        if (!sampled) {
+            BST<T>::split_keys(count, keys);
+        }
         return;
     }
-    clear(node->left);
-    clear(node->right);
-    delete node;
+    // Evenly spaced ranks, O(depth) each
+    keys.clear();
+    size_t n = _size;
+    for (size_t i = 1; i <= count; i++) {
+        T key;
+        if (select(i * n / (count + 1), key) && (keys.empty() || keys.back() < key)) {
+            keys.push_back(key);
+        }
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    walk(lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
 }
 
 template<typename T>
 bool CoarseGrainedBST<T>::insert(const T& t) {
-    mtx.lock();
+    BST_TRACE_SCOPE("insert");
+    lock_write();
+    if (fingers) {
+        bool inserted = finger_insert(t);
+        if (inserted) {
+            _size++;
+        }
+        unlock_write();
+        return inserted;
+    }
     if (root == nullptr) {
-        root = new node_t(t);
+        publish(root, new_node(t));
         _size++;
-        mtx.unlock();
+        unlock_write();
         return true;
     }
     bool inserted = insert_helper(root, t);
     if (inserted) {
         _size++;
     }
-    mtx.unlock();
+    unlock_write();
     return inserted;
 }
 
@@ -140,29 +1072,36 @@ bool CoarseGrainedBST<T>::insert_helper(node_t* node, const T& element) {
         inserted = false;
     } else if (element < node_val) {
         if (left == nullptr) {
-            node_t* new_node = new node_t(element);
-            node->left = new_node;
+            publish(node->left, new_node(element));
             inserted = true;
         } else {
             inserted = insert_helper(left, element);
         }
     } else {
         if (right == nullptr) {
-            node_t* new_node = new node_t(element);
-            node->right = new_node;
+            publish(node->right, new_node(element));
             inserted = true;
         } else {
             inserted = insert_helper(right, element);
         }
     }
+    if (augmented && inserted) {
+        count_of(node)++;
+    }
     return inserted;
 }
 
 template<typename T>
 void CoarseGrainedBST<T>::erase(const T& t) {
-    mtx.lock();
-    erase_helper(root, root, t);
-    mtx.unlock();
+    BST_TRACE_SCOPE("erase");
+    lock_write();
+    if (erase_helper(root, root, t)) {
+        epoch = next_finger_epoch();
+        if (read_mode == ReadMode::Optimistic) {
+            useq.end(0);
+        }
+    }
+    unlock_write();
 }
 
 /**
@@ -171,11 +1110,12 @@ void CoarseGrainedBST<T>::erase(const T& t) {
  * @param parent current node parent
  * @param node current node
  * @param element data needs to be inserted
+ * @return true if the element is erased; false otherwise
  */
 template<typename T>
-void CoarseGrainedBST<T>::erase_helper(node_t* parent, node_t* node, const T& element) {
+bool CoarseGrainedBST<T>::erase_helper(node_t* parent, node_t* node, const T& element) {
     if (node == nullptr) {
-        return;
+        return false;
     }
     const T& val = node->val;
     node_t* left = node->left;
@@ -183,6 +1123,10 @@ void CoarseGrainedBST<T>::erase_helper(node_t* parent, node_t* node, const T& el
     node_t* parent_left = parent->left;
     node_t* parent_right = parent->right;
     if (element == val) {
+        if (read_mode == ReadMode::Optimistic) {
+            // Ended by erase(), the counts fixed on the way up are not read by finds
+            useq.begin(0);
+        }
         node_t* neighbor = node->left;
         node_t* neighbor_parent = node;
         node_t* neighbor_left = nullptr;
@@ -202,6 +1146,15 @@ void CoarseGrainedBST<T>::erase_helper(node_t* parent, node_t* node, const T& el
         if (neighbor != nullptr) {
             neighbor_left = neighbor->left;
             neighbor_right = neighbor->right;
+            if (augmented) {
+                // Neighbor leaves every subtree between node and itself, and takes the place of node
+                bool from_left = node->left != nullptr;
+                for (node_t* path = from_left ? node->left : node->right; path != neighbor;
+                    path = from_left ? path->right : path->left) {
+                    count_of(path)--;
+                }
+                count_of(neighbor) = count_of(node) - 1;
+            }
         }
         node_t* neighbor_parent_left = neighbor_parent->left;
         node_t* neighnor_parent_right = neighbor_parent->right;
@@ -230,22 +1183,149 @@ void CoarseGrainedBST<T>::erase_helper(node_t* parent, node_t* node, const T& el
             root = neighbor;
         }
         _size--;
-        delete node;
-    } else if (element < val) {
-        erase_helper(node, node->left, element);
+        retire(node);
+        return true;
+    }
+    bool erased;
+    if (element < val) {
+        erased = erase_helper(node, node->left, element);
     } else {
-        erase_helper(node, node->right, element);
+        erased = erase_helper(node, node->right, element);
     }
+    if (augmented && erased) {
+        count_of(node)--;
+    }
+    return erased;
 }
 
 template<typename T>
 bool CoarseGrainedBST<T>::find(const T& t) {
-    mtx.lock();
-    bool found = find_helper(root, t);
-    mtx.unlock();
+    BST_TRACE_SCOPE("find");
+    bool found;
+    if (read_mode == ReadMode::Optimistic && optimistic_find(t, found)) {
+        return found;
+    }
+    lock_read();
+    // Fingers are thread local, so readers which share the lock may move their own
+    found = fingers ? finger_find(t) : find_helper(root, t);
+    unlock_read();
     return found;
 }
 
+/**
+ * Seqlock read: a removal relinks several pointers, so a descent which
+ * overlaps one may miss its key or even run into a transient cycle
+ * below the moved neighbor. The descent therefore validates every
+ * VALIDATE_STEPS steps and at its end, and retries on a conflict.
+ */
+template<typename T>
+bool CoarseGrainedBST<T>::optimistic_find(const T& t, bool& found) {
+    rw_count++;
+    if (reclaiming.load()) {
+        rw_count--;
+        BST_STAT_INC(CG_Read_Fallback);
+        return false;
+    }
+    for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+        // Wait for the removal in flight, but only like update_seq_t::wait_stable
+        // does, and count a wait which gave up as a failed attempt. A removal
+        // which reclaims waits for this find, so give up once it does.
+        size_t version;
+        bool stable = true;
+        for (size_t spins = 0; !useq.stable(version); spins++) {
+            if (reclaiming.load()) {
+                rw_count--;
+                BST_STAT_INC(CG_Read_Fallback);
+                return false;
+            }
+            if (spins >= update_seq_t<1>::STABLE_SPINS + update_seq_t<1>::STABLE_YIELDS) {
+                stable = false;
+                break;
+            }
+            if (spins >= update_seq_t<1>::STABLE_SPINS) {
+                std::this_thread::yield();
+            }
+        }
+        if (!stable) {
+            BST_STAT_INC(CG_Optimistic_Retry);
+            continue;
+        }
+        // Relaxed loads, the validation orders the descent after the stable version
+        const node_t* node = root.load(std::memory_order_relaxed);
+        size_t steps = 0;
+        bool valid = true;
+        while (node != nullptr && !(t == node->val)) {
+            node = (t < node->val ? node->left : node->right).load(std::memory_order_relaxed);
+            if (++steps % VALIDATE_STEPS == 0 && !useq.validate(version)) {
+                valid = false;
+                break;
+            }
+        }
+        bool hit = node != nullptr;
+        // Keep the reads of the descent before the validation
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (valid && useq.validate(version)) {
+            rw_count--;
+            found = hit;
+            return true;
+        }
+        BST_STAT_INC(CG_Optimistic_Retry);
+    }
+    rw_count--;
+    BST_STAT_INC(CG_Read_Fallback);
+    return false;
+}
+
+/**
+ * Every lane is one lookup in a state machine: a step compares the key of
+ * its current node and moves it one level down. Lanes are stepped round
+ * robin, so the prefetch of a lane's next node has FIND_LANES - 1 other
+ * steps to complete. A finished lane takes the next key of the batch.
+ */
+template<typename T>
+void CoarseGrainedBST<T>::find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+    BST_TRACE_SCOPE("find_many");
+    struct lane_t {
+        size_t index;       // Index of the key in the batch
+        const node_t* node; // Next node to compare with
+    };
+    results.assign(keys.size(), false);
+    lane_t lanes[BST<T>::FIND_LANES];
+    size_t active = 0;
+    size_t next = 0;
+    lock_read();
+    while (active < BST<T>::FIND_LANES && next < keys.size()) {
+        lanes[active].index = next++;
+        lanes[active].node = root;
+        active++;
+    }
+    while (active > 0) {
+        size_t i = 0;
+        while (i < active) {
+            lane_t& lane = lanes[i];
+            const node_t* node = lane.node;
+            const T& key = keys[lane.index];
+            if (node != nullptr && !(key == node->val)) {
+                node = key < node->val ? node->left : node->right;
+                __builtin_prefetch(node);
+                lane.node = node;
+                i++;
+                continue;
+            }
+            results[lane.index] = node != nullptr;
+            if (next < keys.size()) {
+                lane.index = next++;
+                lane.node = root;
+                i++;
+            } else {
+                // Close the gap with the last lane, which is stepped next
+                lane = lanes[--active];
+            }
+        }
+    }
+    unlock_read();
+}
+
 template<typename T>
 bool CoarseGrainedBST<T>::find_helper(const node_t* node, const T& element) const {
     if (node == nullptr) {
@@ -268,6 +1348,559 @@ size_t CoarseGrainedBST<T>::size() {
     return _size;
 }
 
+template<typename T>
+template<typename F>
+void CoarseGrainedBST<T>::walk(const T* lo, const T* hi, F visit) const {
+    std::vector<const node_t*> stack;
+    const node_t* node = root;
+    while (node != nullptr || !stack.empty()) {
+        while (node != nullptr) {
+            stack.push_back(node);
+            // Left subtree only holds keys smaller than node
+            node = lo == nullptr || *lo < node->val ? node->left.load() : nullptr;
+        }
+        node = stack.back();
+        stack.pop_back();
+        if ((lo == nullptr || !(node->val < *lo)) && (hi == nullptr || node->val < *hi)) {
+            if (!visit(node->val)) {
+                return;
+            }
+        }
+        // Right subtree only holds keys larger than node
+        node = hi == nullptr || node->val < *hi ? node->right.load() : nullptr;
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    out.clear();
+    lock_read();
+    walk(&lo, &hi, [&out](const T& key) {
+        out.push_back(key);
+        return true;
+    });
+    unlock_read();
+}
+
+template<typename T>
+size_t CoarseGrainedBST<T>::rank_helper(const T& t) const {
+    size_t rank = 0;
+    if (!augmented) {
+        walk(nullptr, &t, [&rank](const T&) {
+            rank++;
+            return true;
+        });
+        return rank;
+    }
+    const node_t* node = root;
+    while (node != nullptr) {
+        if (node->val < t) {
+            // Node and its left subtree are smaller than t
+            rank += count(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return rank;
+}
+
+template<typename T>
+size_t CoarseGrainedBST<T>::rank(const T& t) {
+    lock_read();
+    size_t rank = rank_helper(t);
+    unlock_read();
+    return rank;
+}
+
+template<typename T>
+bool CoarseGrainedBST<T>::select(size_t k, T& result) {
+    bool found = false;
+    lock_read();
+    if (!augmented) {
+        walk(nullptr, nullptr, [&](const T& key) {
+            if (k == 0) {
+                result = key;
+                found = true;
+                return false;
+            }
+            k--;
+            return true;
+        });
+        unlock_read();
+        return found;
+    }
+    const node_t* node = root;
+    while (node != nullptr) {
+        size_t left_count = count(node->left);
+        if (k < left_count) {
+            node = node->left;
+        } else if (k == left_count) {
+            result = node->val;
+            found = true;
+            break;
+        } else {
+            k -= left_count + 1;
+            node = node->right;
+        }
+    }
+    unlock_read();
+    return found;
+}
+
+template<typename T>
+size_t CoarseGrainedBST<T>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    size_t removed = 0;
+    lock_write();
+    // Nodes are relinked and freed all over the range
+    drain_readers();
+    root = erase_range_helper(root, lo, hi, removed);
+    _size -= removed;
+    epoch = next_finger_epoch();
+    release_readers();
+    unlock_write();
+    return removed;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::erase_range_helper(node_t* node,
+    const T& lo, const T& hi, size_t& removed) {
+    // A loop instead of recursion, a degenerate tree is as deep as it is large
+    std::vector<node_t*> path;
+    // Edge into the subtree root, child edges are atomic for optimistic finds
+    std::atomic<node_t*> top(node);
+    std::atomic<node_t*>* edge = &top;
+    while (*edge != nullptr) {
+        node_t* cur = *edge;
+        if (cur->val < lo) {
+            path.push_back(cur);
+            edge = &cur->right;
+        } else if (!(cur->val < hi)) {
+            path.push_back(cur);
+            edge = &cur->left;
+        } else {
+            node_t* left = trim(cur->left, lo, true, removed);
+            node_t* right = trim(cur->right, hi, false, removed);
+            free_node(cur);
+            removed++;
+            *edge = join(left, right);
+            break;
+        }
+    }
+    fix_counts(path);
+    return top;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::trim(node_t* node,
+    const T& bound, bool keep_less, size_t& removed) {
+    std::vector<node_t*> path;
+    // Edge into the subtree root, child edges are atomic for optimistic finds
+    std::atomic<node_t*> top(node);
+    std::atomic<node_t*>* edge = &top;
+    while (true) {
+        node_t* cur = *edge;
+        while (cur != nullptr && (cur->val < bound) != keep_less) {
+            node_t* near = keep_less ? cur->left : cur->right;
+            removed += clear(keep_less ? cur->right : cur->left) + 1;
+            free_node(cur);
+            cur = near;
+        }
+        *edge = cur;
+        if (cur == nullptr) {
+            break;
+        }
+        path.push_back(cur);
+        edge = keep_less ? &cur->right : &cur->left;
+    }
+    fix_counts(path);
+    return top;
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::fix_counts(const std::vector<node_t*>& path) {
+    if (!augmented) {
+        return;
+    }
+    for (size_t i = path.size(); i-- > 0;) {
+        count_of(path[i]) = count(path[i]->left) + count(path[i]->right) + 1;
+    }
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::join(node_t* left, node_t* right) {
+    if (left == nullptr) {
+        return right;
+    }
+    if (right == nullptr) {
+        return left;
+    }
+    node_t* last;
+    left = split_last(left, last);
+    return link(left, last, right);
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::split_last(node_t* node, node_t*& last) {
+    std::vector<node_t*> path;
+    // Edge into the subtree root, child edges are atomic for optimistic finds
+    std::atomic<node_t*> top(node);
+    std::atomic<node_t*>* edge = &top;
+    while ((*edge).load()->right != nullptr) {
+        path.push_back(*edge);
+        edge = &(*edge).load()->right;
+    }
+    last = *edge;
+    *edge = last->left.load();
+    for (size_t i = path.size(); i-- > 0;) {
+        link(path[i]->left, path[i], path[i]->right);
+    }
+    return top;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::link(node_t* left, node_t* node, node_t* right) const {
+    node->left = left;
+    node->right = right;
+    if (augmented) {
+        count_of(node) = count(left) + count(right) + 1;
+    }
+    return node;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::split(node_t* node, const T& key,
+    node_t*& left, node_t*& right) const {
+    // Nodes smaller than key are hung on the right spine of left, larger ones on the left spine of right
+    std::vector<node_t*> path;
+    std::atomic<node_t*> left_top(nullptr);
+    std::atomic<node_t*> right_top(nullptr);
+    std::atomic<node_t*>* left_edge = &left_top;
+    std::atomic<node_t*>* right_edge = &right_top;
+    node_t* found = nullptr;
+    while (node != nullptr) {
+        if (key < node->val) {
+            path.push_back(node);
+            *right_edge = node;
+            right_edge = &node->left;
+            node = node->left;
+        } else if (node->val < key) {
+            path.push_back(node);
+            *left_edge = node;
+            left_edge = &node->right;
+            node = node->right;
+        } else {
+            found = node;
+            break;
+        }
+    }
+    if (found != nullptr) {
+        *left_edge = found->left.load();
+        *right_edge = found->right.load();
+        link(nullptr, found, nullptr);
+    } else {
+        *left_edge = nullptr;
+        *right_edge = nullptr;
+    }
+    for (size_t i = path.size(); i-- > 0;) {
+        link(path[i]->left, path[i], path[i]->right);
+    }
+    left = left_top;
+    right = right_top;
+    return found;
+}
+
+template<typename T>
+template<typename A, typename B>
+void CoarseGrainedBST<T>::fork(ThreadPool& pool, size_t depth, A a, B b) {
+    if (depth < FORK_DEPTH) {
+        pool.invoke(a, b);
+    } else {
+        a();
+        b();
+    }
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::copy(const node_t* node,
+    ThreadPool& pool, size_t depth) const {
+    if (node == nullptr) {
+        return nullptr;
+    }
+    if (depth >= FORK_DEPTH) {
+        return copy(node);
+    }
+    node_t* left;
+    node_t* right;
+    fork(pool, depth, [&]() {
+        left = copy(node->left, pool, depth + 1);
+    }, [&]() {
+        right = copy(node->right, pool, depth + 1);
+    });
+    return link(left, new_node(node->val), right);
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::copy(const node_t* node) const {
+    std::atomic<node_t*> result(nullptr);
+    std::vector<std::pair<const node_t*, std::atomic<node_t*>*>> stack;
+    std::vector<node_t*> copies; // Preorder, so every node comes before its children
+    stack.push_back(std::make_pair(node, &result));
+    while (!stack.empty()) {
+        const node_t* from = stack.back().first;
+        std::atomic<node_t*>* to = stack.back().second;
+        stack.pop_back();
+        if (from == nullptr) {
+            continue;
+        }
+        node_t* node_copy = new_node(from->val);
+        *to = node_copy;
+        copies.push_back(node_copy);
+        stack.push_back(std::make_pair(from->right.load(), &node_copy->right));
+        stack.push_back(std::make_pair(from->left.load(), &node_copy->left));
+    }
+    for (size_t i = copies.size(); i-- > 0;) {
+        link(copies[i]->left, copies[i], copies[i]->right);
+    }
+    return result;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::set_helper(SetOp op, node_t* a, node_t* b,
+    ThreadPool& pool, size_t depth) {
+    if (a == nullptr || b == nullptr) {
+        return set_base(op, a, b);
+    }
+    if (depth >= FORK_DEPTH) {
+        return set_sequential(op, a, b);
+    }
+    node_t* b_left;
+    node_t* b_right;
+    node_t* found = split(b, a->val, b_left, b_right);
+    node_t* left;
+    node_t* right;
+    fork(pool, depth, [&]() {
+        left = set_helper(op, a->left, b_left, pool, depth + 1);
+    }, [&]() {
+        right = set_helper(op, a->right, b_right, pool, depth + 1);
+    });
+    return set_combine(op, a, found, left, right);
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::set_sequential(SetOp op, node_t* a, node_t* b) {
+    struct frame_t {
+        node_t* a;
+        node_t* b;
+        node_t* found;
+        node_t* halves[2]; // Results for the two halves, filled in by the child frames
+        size_t parent;
+        size_t side;
+        bool expanded;
+    };
+    node_t* result = nullptr;
+    std::vector<frame_t> stack;
+    stack.push_back(frame_t{a, b, nullptr, {nullptr, nullptr}, 0, 0, false});
+    while (!stack.empty()) {
+        frame_t& top = stack.back();
+        node_t* done;
+        if (top.expanded) {
+            // Both child frames were above this one, so they are finished
+            done = set_combine(op, top.a, top.found, top.halves[0], top.halves[1]);
+        } else if (top.a == nullptr || top.b == nullptr) {
+            done = set_base(op, top.a, top.b);
+        } else {
+            node_t* b_left;
+            node_t* b_right;
+            top.found = split(top.b, top.a->val, b_left, b_right);
+            top.expanded = true;
+            node_t* a_left = top.a->left;
+            node_t* a_right = top.a->right;
+            size_t index = stack.size() - 1;
+            // top dangles once the stack grows
+            stack.push_back(frame_t{a_right, b_right, nullptr, {nullptr, nullptr}, index, 1, false});
+            stack.push_back(frame_t{a_left, b_left, nullptr, {nullptr, nullptr}, index, 0, false});
+            continue;
+        }
+        size_t parent = top.parent;
+        size_t side = top.side;
+        stack.pop_back();
+        if (stack.empty()) {
+            result = done;
+        } else {
+            stack[parent].halves[side] = done;
+        }
+    }
+    return result;
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::set_base(SetOp op, node_t* a, node_t* b) {
+    switch (op) {
+        case SetOp::Union:
+            return a == nullptr ? b : a;
+        case SetOp::Intersection:
+            clear(a);
+            clear(b);
+            return nullptr;
+        default:
+            clear(b);
+            return a;
+    }
+}
+
+template<typename T>
+typename CoarseGrainedBST<T>::node_t* CoarseGrainedBST<T>::set_combine(SetOp op, node_t* a, node_t* found,
+    node_t* left, node_t* right) {
+    switch (op) {
+        case SetOp::Union:
+            free_node(found);
+            return link(left, a, right);
+        case SetOp::Intersection:
+            if (found == nullptr) {
+                free_node(a);
+                return join(left, right);
+            }
+            free_node(found);
+            return link(left, a, right);
+        default:
+            if (found == nullptr) {
+                return link(left, a, right);
+            }
+            free_node(found);
+            free_node(a);
+            return join(left, right);
+    }
+}
+
+template<typename T>
+void CoarseGrainedBST<T>::set_operation(SetOp op, CoarseGrainedBST& a, CoarseGrainedBST& b, ThreadPool& pool) {
+    BST_TRACE_SCOPE("set_operation");
+    node_t* a_copy;
+    node_t* b_copy;
+    // Locked in address order, so two set operations on the same pair cannot deadlock
+    CoarseGrainedBST* first = &a < &b ? &a : &b;
+    CoarseGrainedBST* second = &a < &b ? &b : &a;
+    first->lock_read();
+    if (first != second) {
+        second->lock_read();
+    }
+    pool.invoke([&]() {
+        a_copy = copy(a.root, pool, 0);
+    }, [&]() {
+        b_copy = copy(b.root, pool, 0);
+    });
+    if (first != second) {
+        second->unlock_read();
+    }
+    first->unlock_read();
+    node_t* result = set_helper(op, a_copy, b_copy, pool, 0);
+    lock_write();
+    drain_readers();
+    clear(root);
+    root = result;
+    _size = subtree_size(result);
+    epoch = next_finger_epoch();
+    release_readers();
+    unlock_write();
+}
+
+template<typename T>
+size_t CoarseGrainedBST<T>::subtree_size(const node_t* node) const {
+    if (augmented) {
+        return count(node);
+    }
+    size_t size = 0;
+    std::vector<const node_t*> stack;
+    if (node != nullptr) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        size++;
+        if (node->left != nullptr) {
+            stack.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+            stack.push_back(node->right);
+        }
+    }
+    return size;
+}
+
+template<typename T>
+size_t CoarseGrainedBST<T>::range_count(const T& lo, const T& hi) {
+    if (!(lo < hi)) {
+        return 0;
+    }
+    lock_read();
+    size_t count = rank_helper(hi) - rank_helper(lo);
+    unlock_read();
+    return count;
+}
+
+/**
+ * Single descent which remembers the last node on the requested side of t.
+ */
+template<typename T>
+bool CoarseGrainedBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    bool found = false;
+    lock_read();
+    const node_t* node = root;
+    while (node != nullptr) {
+        if (within_bound(node->val, t, bounded, inclusive, ascending)) {
+            result = node->val;
+            found = true;
+            // Look for a closer key
+            node = ascending ? node->left : node->right;
+        } else {
+            node = ascending ? node->right : node->left;
+        }
+    }
+    unlock_read();
+    return found;
+}
+
+/**
+ * Walk the tree with an explicit stack, so that degenerated trees
+ * do not overflow the call stack.
+ */
+template<typename T>
+shape_stats_t CoarseGrainedBST<T>::shape_stats() {
+    shape_stats_t stats;
+    std::vector<std::pair<const node_t*, size_t>> stack;
+    lock_read();
+    if (root != nullptr) {
+        stack.push_back(std::make_pair(root.load(), 0));
+    }
+    while (!stack.empty()) {
+        const node_t* node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        bool leaf = node->left == nullptr && node->right == nullptr;
+        stats.visit(depth, leaf, true);
+        if (node->left != nullptr) {
+            stack.push_back(std::make_pair(node->left.load(), depth + 1));
+        }
+        if (node->right != nullptr) {
+            stack.push_back(std::make_pair(node->right.load(), depth + 1));
+        }
+    }
+    unlock_read();
+    return stats;
+}
+
+/**
+ * Number of failed attempts of a snapshot read before it collects keys
+ * with a journal of the updates
+ */
+static const int RANGE_RETRIES = 16;
+
 /**
  * Fine Grained BST uses node internal lock to sync node
  * edge modifications
@@ -305,6 +1938,7 @@ class FineGrainedBST : public BST<T> {
     };
     static thread_local size_t thread_id; // Local thread id
     std::vector<std::vector<node_t*>> rlist; // Retire list
+    ReclaimStats rstats;
     
     /**
      * Atomic variables and locks for GC purpose
@@ -314,6 +1948,51 @@ class FineGrainedBST : public BST<T> {
 
     node_t* root;
     std::atomic<size_t> _size;
+    update_seq_t<> useq; // Brackets insertions and removals for range queries
+    int range_retries;   // Failed attempts of snapshot_read before it collects with a journal
+    SnapshotExport<T> exporter; // Journals of updates for export_snapshot and snapshot_read
+
+    /**
+     * In-order walk over keys in [lo, hi) without taking any lock.
+     *
+     * @param lo inclusive lower bound, nullptr for no bound
+     * @param hi exclusive upper bound, nullptr for no bound
+     * @param visit called on every key in range, the walk stops once it returns false
+     */
+    template<typename F>
+    void walk(const T* lo, const T* hi, F visit);
+
+    /**
+     * Walk for snapshot_read: the keys of [lo, hi) in keys if it is not
+     * nullptr, otherwise the live tree.
+     */
+    template<typename F>
+    void walk(const std::vector<T>* keys, const T* lo, const T* hi, F visit);
+
+    /**
+     * Descent for BST::nearest without locks, which remembers the last
+     * node on the requested side of t like CoarseGrainedBST::nearest. The
+     * keys are split between the two subtrees of the dummy root, so the
+     * one closer to the requested end is descended first, and the other
+     * one only if it had no such key. It may see a half-done update, so
+     * it only runs in snapshot_read, which validates it.
+     */
+    bool nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * Run the read-only traversal until no insertion or removal happened
+     * during it. An attempt fails if its validation fails or if it finds
+     * no moment without an update in flight. After range_retries failed
+     * attempts the keys of [lo, hi) are collected by SnapshotExport::collect
+     * while updates keep running, and the traversal runs over them.
+     *
+     * @param lo inclusive lower bound of the keys read depends on, nullptr for no bound
+     * @param hi exclusive upper bound of the keys read depends on, nullptr for no bound
+     * @param read read(keys) walks keys with walk(keys, ...), which is
+     *        nullptr for the live tree; it does not take any lock
+     */
+    template<typename F>
+    void snapshot_read(const T* lo, const T* hi, F read);
     /**
      * Traverses the tree until it finds the target node.
      * Before the function gets returned, the edge between the 
@@ -340,7 +2019,27 @@ class FineGrainedBST : public BST<T> {
      * @return a, a->dir1, a->dir2 after the rotation
      */
     std::vector<node_t*> rotation(node_t* a, Dir dir1, Dir dir2);
-    void clear(node_t* node);
+    size_t clear(node_t* node);
+
+    /**
+     * Detach the subtree below parent->children[dir] for erase_range. Keys
+     * below the edge are greater than lower and smaller than upper, and the
+     * one of the two which is not parent is locked first: removing it is
+     * the only change which widens the key interval of the edge. Every node
+     * of the subtree is marked as erased under its lock, top-down, so that
+     * operations inside of it go back to parent, and the edge is cut once
+     * the subtree is sealed. The nodes are retired in bulk.
+     *
+     * @return number of keys detached, 0 if a bound node has been erased
+     */
+    size_t detach(node_t* parent, Dir dir, node_t* lower, node_t* upper);
+
+    /**
+     * Erase one key, the part of erase between the gc barrier and gc().
+     *
+     * @return true if the key was erased; false if it was not in the tree
+     */
+    bool erase_helper(const T& t);
     
     /**
      * Remove a->dir1 from the tree by reconnecting a->dir1 with a->dir1->dir2.
@@ -406,8 +2105,56 @@ public:
     virtual bool find(const T& t);
     virtual size_t size();
     virtual void clear();
+
+    /**
+     * Walk the tree below the dummy root. The tree must be quiescent.
+     */
+    virtual shape_stats_t shape_stats();
     virtual void set_N(size_t _N);
     virtual void register_thread(size_t tid);
+    virtual const ReclaimStats* reclaim_stats() { return &rstats; }
+
+    /**
+     * Collect keys optimistically and validate them (snapshot_read).
+     *
+     * @param lo inclusive lower bound
+     * @param hi exclusive upper bound
+     * @param out where keys are stored to in ascending order
+     */
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    // Failed attempts of a snapshot read before it collects with a journal, RANGE_RETRIES by default
+    void set_range_retries(int retries) { range_retries = retries; }
+
+    /**
+     * Order statistics are exact: they count keys of a validated walk like
+     * range_query does, so they take O(k) for k counted keys rather than
+     * O(depth). Subtree counts are not kept, since a rotation would have to
+     * update them atomically with the copy of the rotated nodes.
+     */
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+
+    /**
+     * Runs next to other operations. Edges whose keys all lie inside of
+     * the range are cut under the locks of their two bound nodes (detach),
+     * and the keys left on the two boundary paths are erased one by one.
+     * Each cut is one update and each boundary key one erase, so the range
+     * is not erased atomically. Detached nodes go to the retire list like
+     * the ones of erase.
+     */
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+    // Sampled from the top of the tree, see split_from_top
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+
+    /**
+     * Stream all keys as of one linearization point to fd, see
+     * LockFreeBST::export_snapshot.
+     */
+    bool export_snapshot(int fd);
 };
 
 template<typename T>
@@ -417,6 +2164,7 @@ template<typename T>
 void FineGrainedBST<T>::set_N(size_t _N) {
     BST<T>::set_N(_N);
     rlist.resize(_N);
+    rstats.resize(_N);
 }
 
 template<typename T>
@@ -427,26 +2175,34 @@ void FineGrainedBST<T>::register_thread(size_t tid) {
 template<typename T>
 void FineGrainedBST<T>::retire(node_t* ptr) {
     rlist[thread_id].push_back(ptr);
+    rstats.retire(thread_id);
 }
 
 template<typename T>
 void FineGrainedBST<T>::gc() {
     if (rlist[thread_id].size() > BST<T>::R) {
+        BST_TRACE_SCOPE("gc");
         mtx.lock();
-        while (rw_count > 0);
+        size_t pause_start = ReclaimStats::now();
+        {
+            BST_TRACE_SCOPE("gc_wait");
+            while (rw_count > 0);
+        }
         // Traverse the retire list and clear nodes
         for (node_t* node : rlist[thread_id]) {
             delete node;
         }
+        size_t freed = rlist[thread_id].size();
         rlist[thread_id].clear();
         mtx.unlock();
+        rstats.pause(thread_id, freed, ReclaimStats::now() - pause_start);
     }
 }
 
 template<typename T>
 FineGrainedBST<T>::FineGrainedBST(): 
     rw_count(0),
-    root(new node_t()), _size(0) {}
+    root(new node_t()), _size(0), range_retries(RANGE_RETRIES) {}
 
 template<typename T>
 FineGrainedBST<T>::~FineGrainedBST() {
@@ -458,29 +2214,180 @@ template<typename T>
 void FineGrainedBST<T>::clear() {
     clear(root);
     root = new node_t();
+    _size = 0;
     // Traver the retire list and clear nodes
     for (size_t thread_id = 0; thread_id < BST<T>::N; thread_id++) {
         for (node_t* node : rlist[thread_id]) {
             delete node;
         }
+        rstats.free(thread_id, rlist[thread_id].size());
         rlist[thread_id].clear();
     }
 }
 
+/**
+ * Free a subtree with an explicit stack.
+ *
+ * @return number of nodes freed
+ */
 template<typename T>
-void FineGrainedBST<T>::clear(node_t* node) {
-    if (node == nullptr) {
-        return;
+size_t FineGrainedBST<T>::clear(node_t* node) {
+    size_t freed = 0;
+    std::vector<node_t*> stack;
+    if (node != nullptr) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        for (node_t* child : node->children) {
+            if (child != nullptr) {
+                stack.push_back(child);
+            }
+        }
+        delete node;
+        freed++;
+    }
+    return freed;
+}
+
+template<typename T>
+void FineGrainedBST<T>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    walk(lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
+}
+
+template<typename T>
+void FineGrainedBST<T>::split_keys(size_t count, std::vector<T>& keys) {
+    // The dummy root holds no key, but keys smaller than its value are on its left
+    bool sampled = split_from_top(root, _size.load(), count, keys,
+        [this](node_t* node, node_t*& left, node_t*& right, const T*& key, size_t& weight) {
+            left = node->children[Dir::Left];
+            right = node->children[Dir::Right];
+            key = &node->val;
+            weight = node == root ? 0 : 1;
+        });
+    if (!sampled) {
+        BST<T>::split_keys(count, keys);
+    }
+}
+
+template<typename T>
+size_t FineGrainedBST<T>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    struct frame_t {
+        node_t* parent;
+        Dir dir;
+        node_t* lower; // Keys below the edge are greater than lower->val, nullptr for no bound
+        node_t* upper; // Keys below the edge are smaller than upper->val, nullptr for no bound
+    };
+    size_t removed = 0;
+    // Keys smaller than the dummy root are on its left, the others (also
+    // one equal to its value) on its right
+    std::vector<frame_t> stack;
+    stack.push_back(frame_t{root, Dir::Right, nullptr, nullptr});
+    stack.push_back(frame_t{root, Dir::Left, nullptr, root});
+    while (!stack.empty()) {
+        frame_t frame = stack.back();
+        stack.pop_back();
+        if ((frame.upper != nullptr && !(lo < frame.upper->val)) || (frame.lower != nullptr && !(frame.lower->val < hi))) {
+            continue;
+        }
+        if (frame.lower != nullptr && !(frame.lower->val < lo) && frame.upper != nullptr && !(hi < frame.upper->val)) {
+            removed += detach(frame.parent, frame.dir, frame.lower, frame.upper);
+            continue;
+        }
+        node_t* child = frame.parent->children[frame.dir];
+        if (child != nullptr) {
+            stack.push_back(frame_t{child, Dir::Right, child, frame.upper});
+            stack.push_back(frame_t{child, Dir::Left, frame.lower, child});
+        }
+    }
+
+    // Keys on the boundary paths, and the ones of subtrees which could not be cut
+    std::vector<T> keys;
+    walk(&lo, &hi, [&keys](const T& key) {
+        keys.push_back(key);
+        return true;
+    });
+    for (const T& key : keys) {
+        if (erase_helper(key)) {
+            removed++;
+        }
+    }
+
+    rw_count--;
+
+    gc();
+    return removed;
+}
+
+template<typename T>
+size_t FineGrainedBST<T>::detach(node_t* parent, Dir dir, node_t* lower, node_t* upper) {
+    node_t* bound = parent == lower ? upper : lower;
+    bound->mtx.lock();
+    parent->mtx.lock();
+    if (bound->color == Color::Blue || parent->color == Color::Blue) {
+        parent->mtx.unlock();
+        bound->mtx.unlock();
+        return 0;
+    }
+    std::vector<node_t*> nodes;
+    std::vector<node_t*> stack;
+    if (parent->children[dir] != nullptr) {
+        stack.push_back(parent->children[dir]);
     }
-    clear(node->children[Dir::Left]);
-    clear(node->children[Dir::Right]);
-    delete node;
+    while (!stack.empty()) {
+        node_t* node = stack.back();
+        stack.pop_back();
+        node->mtx.lock();
+        node->back = parent;
+        node->color = Color::Blue;
+        for (node_t* child : node->children) {
+            if (child != nullptr) {
+                stack.push_back(child);
+            }
+        }
+        node->mtx.unlock();
+        nodes.push_back(node);
+    }
+    if (!nodes.empty()) {
+        size_t ticket = useq.begin(thread_id);
+        parent->children[dir] = nullptr;
+        for (node_t* node : nodes) {
+            exporter.record(node->val, ticket, true);
+        }
+        useq.end(thread_id);
+        _size -= nodes.size();
+    }
+    parent->mtx.unlock();
+    bound->mtx.unlock();
+    rlist[thread_id].insert(rlist[thread_id].end(), nodes.begin(), nodes.end());
+    rstats.retire(thread_id, nodes.size());
+    return nodes.size();
 }
 
 template<typename T>
 bool FineGrainedBST<T>::insert(const T& t) {
-    mtx.lock();
-    mtx.unlock();
+    BST_TRACE_SCOPE("insert");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
 
     rw_count++;
 
@@ -491,7 +2398,11 @@ bool FineGrainedBST<T>::insert(const T& t) {
     bool inserted = false;
     if (child == nullptr) {
         // Append new child to the parent
-        parent->children[dir] = new node_t(t);
+        node_t* new_node = new node_t(t);
+        size_t ticket = useq.begin(thread_id);
+        parent->children[dir] = new_node;
+        exporter.record(t, ticket, false);
+        useq.end(thread_id);
         _size++;
         inserted = true;
     }
@@ -516,15 +2427,20 @@ std::pair<typename FineGrainedBST<T>::node_t*, typename FineGrainedBST<T>::Dir>
         return find_helper(child, element);
     }
     // Found or loop terminate
-    node->mtx.lock(); // Lock the parent node
+    {
+        BST_TRACE_SCOPE("lock");
+        node->mtx.lock(); // Lock the parent node
+    }
     if (node->color == Color::Blue) {
         // If node has been marked as erased
         node->mtx.unlock();
+        BST_STAT_INC(FG_Restart_Back);
         // Release lock and keep traversing from back node
         return find_helper(node->back, element);
     } else if (node->children[dir] != child) {
         // The node has been slipped away
         node->mtx.unlock();
+        BST_STAT_INC(FG_Restart_Slipped);
         // Keep traversing down
         return find_helper(node, element);
     }
@@ -534,11 +2450,24 @@ std::pair<typename FineGrainedBST<T>::node_t*, typename FineGrainedBST<T>::Dir>
 
 template<typename T>
 void FineGrainedBST<T>::erase(const T& t) {
-    mtx.lock();
-    mtx.unlock();
+    BST_TRACE_SCOPE("erase");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
 
     rw_count++;
 
+    erase_helper(t);
+
+    rw_count--;
+
+    gc();
+}
+
+template<typename T>
+bool FineGrainedBST<T>::erase_helper(const T& t) {
     std::pair<node_t*, Dir> fdir = find_helper(root, t);
 
     node_t* parent = fdir.first;
@@ -546,15 +2475,13 @@ void FineGrainedBST<T>::erase(const T& t) {
     node_t* child = parent->children[dir];
     if (child == nullptr) {
         parent->mtx.unlock();
-    } else {
-        child->mtx.lock();
-        deletion_by_rotation(parent, dir);
-        _size--;
+        return false;
     }
-
-    rw_count--;
-
-    gc();
+    child->mtx.lock();
+    BST_STAT_INC(FG_Erase);
+    deletion_by_rotation(parent, dir);
+    _size--;
+    return true;
 }
 
 template<typename T>
@@ -596,7 +2523,10 @@ template<typename T>
 void FineGrainedBST<T>::remove(typename FineGrainedBST<T>::node_t* a, Dir dir1, Dir dir2) {
     node_t* b = a->children[dir1];
     node_t* c = b->children[dir2];
+    size_t ticket = useq.begin(thread_id);
     a->children[dir1] = c;
+    exporter.record(b->val, ticket, true);
+    useq.end(thread_id);
     b->children[dir2] = c;
     b->back = a;
     b->color = Color::Blue;
@@ -607,6 +2537,8 @@ void FineGrainedBST<T>::remove(typename FineGrainedBST<T>::node_t* a, Dir dir1,
 
 template<typename T>
 std::vector<typename FineGrainedBST<T>::node_t*> FineGrainedBST<T>::rotation(node_t* a, Dir dir1, Dir dir2) {
+    BST_TRACE_SCOPE("rotation");
+    BST_STAT_INC(FG_Rotation);
     node_t* b = a->children[dir1];
     node_t* c = b->children[dir2];
     node_t* b_new = new node_t();
@@ -639,8 +2571,12 @@ std::vector<typename FineGrainedBST<T>::node_t*> FineGrainedBST<T>::rotation(nod
 
 template<typename T>
 bool FineGrainedBST<T>::find(const T& t) {
-    mtx.lock();
-    mtx.unlock();
+    BST_TRACE_SCOPE("find");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
 
     rw_count++;
 
@@ -661,6 +2597,228 @@ size_t FineGrainedBST<T>::size() {
     return _size.load();
 }
 
+template<typename T>
+template<typename F>
+void FineGrainedBST<T>::snapshot_read(const T* lo, const T* hi, F read) {
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    for (int attempt = 0; attempt < range_retries; attempt++) {
+        size_t version;
+        if (useq.wait_stable(version)) {
+            read(nullptr);
+            if (useq.validate(version)) {
+                rw_count--;
+                return;
+            }
+        }
+        BST_STAT_INC(SR_Retry);
+    }
+
+    // Too many conflicts, correct the keys with the updates since a version
+    std::vector<T> keys;
+    exporter.collect(useq, lo, hi, keys, [&](std::vector<T>& out) {
+        walk(lo, hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+    read(&keys);
+
+    rw_count--;
+}
+
+template<typename T>
+template<typename F>
+void FineGrainedBST<T>::walk(const std::vector<T>* keys, const T* lo, const T* hi, F visit) {
+    if (keys == nullptr) {
+        walk(lo, hi, visit);
+        return;
+    }
+    typename std::vector<T>::const_iterator it = lo == nullptr ? keys->begin()
+        : std::lower_bound(keys->begin(), keys->end(), *lo);
+    for (; it != keys->end() && (hi == nullptr || *it < *hi); ++it) {
+        if (!visit(*it)) {
+            return;
+        }
+    }
+}
+
+template<typename T>
+bool FineGrainedBST<T>::export_snapshot(int fd) {
+    BST_TRACE_SCOPE("export_snapshot");
+    return exporter.run(fd, useq, [&](const T* lo, size_t limit, std::vector<T>& out) {
+        snapshot_read(lo, nullptr, [&](const std::vector<T>* keys) {
+            out.clear();
+            walk(keys, lo, nullptr, [&](const T& key) {
+                out.push_back(key);
+                return out.size() < limit;
+            });
+        });
+    });
+}
+
+template<typename T>
+void FineGrainedBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    BST_TRACE_SCOPE("range_query");
+    snapshot_read(&lo, &hi, [&](const std::vector<T>* keys) {
+        out.clear();
+        walk(keys, &lo, &hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+}
+
+template<typename T>
+size_t FineGrainedBST<T>::rank(const T& t) {
+    BST_TRACE_SCOPE("rank");
+    size_t count = 0;
+    snapshot_read(nullptr, &t, [&](const std::vector<T>* keys) {
+        count = 0;
+        walk(keys, nullptr, &t, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T>
+bool FineGrainedBST<T>::select(size_t k, T& result) {
+    BST_TRACE_SCOPE("select");
+    bool found = false;
+    snapshot_read(nullptr, nullptr, [&](const std::vector<T>* keys) {
+        size_t left = k;
+        found = false;
+        walk(keys, nullptr, nullptr, [&](const T& key) {
+            if (left == 0) {
+                result = key;
+                found = true;
+                return false;
+            }
+            left--;
+            return true;
+        });
+    });
+    return found;
+}
+
+template<typename T>
+size_t FineGrainedBST<T>::range_count(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("range_count");
+    size_t count = 0;
+    snapshot_read(&lo, &hi, [&](const std::vector<T>* keys) {
+        count = 0;
+        walk(keys, &lo, &hi, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T>
+bool FineGrainedBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    BST_TRACE_SCOPE("nearest");
+    bool found = false;
+    // The keys a fallback collects: all keys on the requested side of t
+    const T* lo = bounded && ascending ? &t : nullptr;
+    const T* hi = bounded && !ascending && !inclusive ? &t : nullptr;
+    snapshot_read(lo, hi, [&](const std::vector<T>* keys) {
+        found = keys == nullptr ? nearest_helper(t, bounded, inclusive, ascending, result)
+            : nearest_in(*keys, t, bounded, inclusive, ascending, result);
+    });
+    return found;
+}
+
+template<typename T>
+bool FineGrainedBST<T>::nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    // Keys smaller than the dummy root are in its left subtree, so the
+    // subtree closer to the requested end is searched first
+    Dir first = ascending ? Dir::Left : Dir::Right;
+    for (int dir : { static_cast<int>(first), first ^ 1 }) {
+        bool found = false;
+        const node_t* node = root->children[dir];
+        while (node != nullptr) {
+            if (within_bound(node->val, t, bounded, inclusive, ascending)) {
+                result = node->val;
+                found = true;
+                node = node->children[ascending ? Dir::Left : Dir::Right];
+            } else {
+                node = node->children[ascending ? Dir::Right : Dir::Left];
+            }
+        }
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Rotations replace nodes by copies but never change edges of the old
+ * nodes, so a reader which stays on old nodes still sees every key once.
+ */
+template<typename T>
+template<typename F>
+void FineGrainedBST<T>::walk(const T* lo, const T* hi, F visit) {
+    std::vector<const node_t*> stack;
+    // Keys smaller than the dummy root are in its left subtree
+    for (Dir dir : { Dir::Left, Dir::Right }) {
+        const node_t* node = root->children[dir];
+        while (node != nullptr || !stack.empty()) {
+            while (node != nullptr) {
+                stack.push_back(node);
+                node = lo == nullptr || *lo < node->val ? node->children[Dir::Left] : nullptr;
+            }
+            node = stack.back();
+            stack.pop_back();
+            if ((lo == nullptr || !(node->val < *lo)) && (hi == nullptr || node->val < *hi)) {
+                if (!visit(node->val)) {
+                    return;
+                }
+            }
+            node = hi == nullptr || node->val < *hi ? node->children[Dir::Right] : nullptr;
+        }
+    }
+}
+
+template<typename T>
+shape_stats_t FineGrainedBST<T>::shape_stats() {
+    shape_stats_t stats;
+    std::vector<std::pair<const node_t*, size_t>> stack;
+    // Both children of the dummy root are subtree roots at depth 0
+    for (node_t* child : root->children) {
+        if (child != nullptr) {
+            stack.push_back(std::make_pair(child, 0));
+        }
+    }
+    while (!stack.empty()) {
+        const node_t* node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        const node_t* left = node->children[Dir::Left];
+        const node_t* right = node->children[Dir::Right];
+        stats.visit(depth, left == nullptr && right == nullptr, true);
+        if (left != nullptr) {
+            stack.push_back(std::make_pair(left, depth + 1));
+        }
+        if (right != nullptr) {
+            stack.push_back(std::make_pair(right, depth + 1));
+        }
+    }
+    for (const std::vector<node_t*>& list : rlist) {
+        stats.retired_nodes += list.size();
+    }
+    return stats;
+}
+
 /************************************
  * Macros for dummy nodes as the root
  ************************************/
@@ -711,15 +2869,39 @@ class LockFreeBST : public BST<T> {
     atomic_size_t S_root; // Dummy node
 
     atomic_size_t _size;
+    update_seq_t<> useq; // Brackets insert and flag CAS for range queries
+    int range_retries;   // Failed attempts of snapshot_read before it collects with a journal
+    SnapshotExport<T> exporter; // Journals of updates for export_snapshot and snapshot_read
 
     static thread_local size_t thread_id; // Local thread id
     std::vector<std::vector<node_t*>> rlist; // Retire list
+    ReclaimStats rstats;
     
     /**
      * Atomic variables and locks for GC purpose
      */
     std::atomic<int> rw_count;
     std::mutex mtx;
+    std::atomic<size_t> gc_epoch; // Changed before retired or detached nodes are freed
+
+    /**
+     * Parent of the leaf a thread's last find or insert ended at, with the
+     * key interval [lo, hi) of its subtree. Like CoarseGrainedBST::finger_t.
+     */
+    struct finger_t {
+        const void* owner; // Tree the finger points into
+        size_t epoch;      // gc_epoch when the finger was taken
+        node_t* node;
+        T lo;
+        T hi;
+        bool has_lo;
+        bool has_hi;
+    };
+    static thread_local finger_t finger;
+    bool fingers; // Whether find and insert use fingers
+
+    ContentionWait contention_wait; // What insert and erase do after a lost CAS
+    bool local_restart;             // Whether their retries seek from the last unmarked ancestor
 
     /**********************************************
      * Helper functions for tag/flag manipulation
@@ -732,17 +2914,63 @@ class LockFreeBST : public BST<T> {
 
     void clear(size_t node_addr);
 
+    /**
+     * Free the subtree below an edge.
+     *
+     * @param keys incremented by the number of unflagged leaves freed
+     * @return number of nodes freed
+     */
+    size_t clear(size_t node_addr, size_t& keys);
+
+    // A node on the path of the erase_range walk
+    struct path_frame_t {
+        node_t* node;
+        size_t edge; // The edge into node as it was read
+        bool left;   // Whether the walk went on to the left child
+    };
+
+    /**
+     * Erase the leaf at the end of path for erase_range: flag its edge like
+     * erase_helper does and clean it up with the seek record of the path,
+     * without a seek from the root. On success path ends at the ancestor
+     * of the cleanup, which stays in the tree; if the flag or the cleanup
+     * failed, erase_helper finishes the erase and path is cleared.
+     *
+     * @return true if the key was erased by this call
+     */
+    bool erase_leaf(std::vector<path_frame_t>& path);
+
+
     /**
      * Very similar to the basic BST traverse logic.
      * Instead, it returns the result in seekRecord format.
      *
      * @param key the key which needs to be searched
      * @param seekRecord where the result will be stored to
+     * @param use_finger whether to start at the thread's finger and move it
+     * @param from if not nullptr, start at this node, which must be on the path of key
+     * @return true if the seek started below the root, ancestor and successor
+     *         are then 0 if the leaf is a child of the start node
+     */
+    bool seek(const T& key, struct seekRecord_t *seekRecord, bool use_finger = false, node_t* from = nullptr);
+
+    /**
+     * Seek for the retry of an update after a lost CAS. With local_restart
+     * it starts at the ancestor of the previous seek, which still is on the
+     * path of key if neither of its edges is marked: only nodes with a
+     * marked edge are unlinked, and unlinking only widens the key interval
+     * of the subtree that is lifted. Otherwise it starts at the root.
+     *
+     * @param previous ancestor of the previous seek of this operation
      */
-    void seek(const T& key, struct seekRecord_t *seekRecord);
+    void reseek(const T& key, struct seekRecord_t *seekRecord, size_t previous);
     
     /**
      * Isolate node by reconnecting ancestor node with the sibling node.
+     * The successful CAS unlinks every node from successor down to parent,
+     * whose edges on the path of key are tagged, together with the flagged
+     * leaf hanging off each of them, and retires all of them; the tagged
+     * sibling of the flagged leaf below parent stays.
      *
      * @param key the key which needs to be cleaned
      * @param seekRecord nodes which need to be manipulated
@@ -770,9 +2998,11 @@ class LockFreeBST : public BST<T> {
      * node and the leaf is isolated from the tree.
      *
      * @param key the key which needs to be erased
-     * @return true if the key is inserted successfully; false otherwise
+     * @param flagged if not 0, the leaf holding key whose edge the caller
+     *        already flagged; only its cleanup is left to do
+     * @return true if the key is erased successfully; false otherwise
      */
-    bool erase_helper(const T& key);
+    bool erase_helper(const T& key, size_t flagged = 0);
 
     /**
      * Relies on seek to retrieve record and compare whether the retrieved record
@@ -782,39 +3012,223 @@ class LockFreeBST : public BST<T> {
      * @return true if the key is found successfully; false otherwise
      */
     bool find_helper(const T& key);
+
+    /**
+     * In-order walk over keys of unflagged leaves in [lo, hi), which only
+     * descends into subtrees overlapping with the range.
+     *
+     * @param lo inclusive lower bound, nullptr for no bound
+     * @param hi exclusive upper bound, nullptr for no bound
+     * @param visit called on every key in range, the walk stops once it returns false
+     */
+    template<typename F>
+    void walk(const T* lo, const T* hi, F visit);
+
+    /**
+     * Walk for snapshot_read: the keys of [lo, hi) in keys if it is not
+     * nullptr, otherwise the live tree.
+     */
+    template<typename F>
+    void walk(const std::vector<T>* keys, const T* lo, const T* hi, F visit);
+
+    /**
+     * Walk for BST::nearest. seek() follows a single path and cannot step
+     * back over flagged leaves, so this is a depth-first walk of its own
+     * which keeps the sibling subtrees on the requested side in a stack.
+     * Every frame carries the seekRecord_t fields seek() would hold at its
+     * edge, so the leaf which is found comes with a seek record. The walk
+     * ends at the first unflagged leaf within the bound after skip ones.
+     *
+     * @param skip number of unflagged leaves within the bound to pass over;
+     *        the last one found is returned if there are not enough of them
+     * @param record if not nullptr, the seek record of the leaf holding the
+     *        result is stored to it
+     */
+    bool nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result,
+        size_t skip = 0, seekRecord_t* record = nullptr);
+
+    /**
+     * Shared by pop_min and pop_max. The flag CAS goes to the very edge
+     * between the parent and the leaf which nearest_helper saw, expecting it
+     * unmarked, and the pop starts over if that edge changed meanwhile.
+     * erase_helper then finishes the cleanup.
+     */
+    bool pop_helper(bool ascending, T& result);
+
+    size_t pop_spray; // Number of extreme leaves pop_min/pop_max choose from
+
+    /**
+     * Run the read-only traversal until no insert or flag CAS happened
+     * during it, see FineGrainedBST::snapshot_read.
+     */
+    template<typename F>
+    void snapshot_read(const T* lo, const T* hi, F read);
     
     /**
      * Check the retire list and free nodes if necessary.
      */
-    void gc();
+    void gc();
+
+    /**
+     * Push the node to the retire list.
+     *
+     * @param ptr the node which needs to be retired
+     */
+    void retire(node_t* ptr);
+
+    void init();
+public:
+    LockFreeBST();
+    virtual ~LockFreeBST();
+    virtual bool insert(const T& t);
+    virtual void erase(const T& t);
+
+    /**
+     * erase() which tells whether the key was in the tree, for callers
+     * which build one update out of several trees, see FrozenBST
+     */
+    bool remove(const T& t);
+    virtual bool find(const T& t);
+    virtual size_t size();
+    virtual void clear();
+
+    /**
+     * Interleaved seeks, see CoarseGrainedBST::find_many. A lane only needs
+     * the current node, since find does not use the rest of the seek record.
+     * The whole batch is one pass through the gc barrier.
+     */
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results);
+
+    /**
+     * Walk the tree below S_root, skipping the sentinel leaf.
+     * Keys are only counted at leaves. The tree must be quiescent.
+     */
+    virtual shape_stats_t shape_stats();
+    virtual void set_N(size_t _N);
+    virtual void register_thread(size_t tid);
+    virtual const ReclaimStats* reclaim_stats() { return &rstats; }
+
+    /**
+     * A seek starts at the finger if no node was freed since it was taken,
+     * its key interval holds the key and neither of its edges is marked.
+     * Only the parent of an erased leaf and the tagged chain above it are
+     * removed, and all of them have a marked edge which is never cleared,
+     * so an unmarked node is still in the tree. Its interval only widens
+     * when a cleanup lifts its subtree, so the key is still below it.
+     * erase always seeks from the root, since cleanup needs the ancestor.
+     */
+    virtual void set_fingers(bool enabled) { fingers = enabled; }
+
+    /**
+     * Choose what insert and erase do after a lost CAS, see ContentionManager.
+     * The default is None, the original algorithm.
+     */
+    void set_contention_wait(ContentionWait wait) { contention_wait = wait; }
+    // Let retries of insert and erase seek from the last unmarked ancestor instead of the root, off by default
+    void set_local_restart(bool restart) { local_restart = restart; }
+
+    /**
+     * The key set only changes at the insert CAS and at the flag CAS of
+     * erase, so a collect during which neither of them ran is a snapshot.
+     * Physical removal in cleanup() does not change the key set, and a
+     * flagged leaf is already erased. After a few failed attempts
+     * the keys are corrected with a journal of the updates instead, so
+     * the query never stops updates.
+     *
+     * @param lo inclusive lower bound
+     * @param hi exclusive upper bound
+     * @param out where keys are stored to in ascending order
+     */
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * range_query with nullptr for an unbounded side, for callers which
+     * read the keys under updates, unlike walk_range, see FrozenBST
+     */
+    void range_keys(const T* lo, const T* hi, std::vector<T>& out);
+
+    // Failed attempts of a snapshot read before it collects with a journal, RANGE_RETRIES by default
+    void set_range_retries(int retries) { range_retries = retries; }
+
+    /**
+     * Order statistics are exact and linearizable like range_query, and take
+     * O(k) for k counted keys. Internal nodes do not keep subtree counts,
+     * because an insert or a cleanup CAS could not update them atomically
+     * along the whole path.
+     */
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+
+    /**
+     * Lock-free, it runs next to other operations. One walk flags the
+     * leaves of the range in ascending order and cleans each one up with
+     * the seek record of its own path (erase_leaf), so a leaf takes O(1)
+     * steps after the previous one instead of a seek from the root. Every
+     * flag is one erase, so the range is not erased atomically. Unlinked
+     * nodes go to the retire list like the ones of erase.
+     */
+    virtual size_t erase_range(const T& lo, const T& hi);
+
+    /**
+     * Walks the leaf keys and skips flagged leaves like range_query does.
+     */
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+
+    /**
+     * Sampled from the top of the tree, see split_from_top. Routing keys
+     * of internal nodes bound the ranges, and only leaves count as keys.
+     */
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+
+    /**
+     * Stream all keys as of one linearization point to fd in ascending
+     * order while updates continue, see SnapshotExport. Every chunk is
+     * collected like range_query and written without holding any lock.
+     *
+     * @param fd file descriptor the keys are written to as raw T values
+     * @return true if all keys were written; false if write() failed
+     */
+    bool export_snapshot(int fd);
 
     /**
-     * Push the node to the retire list.
+     * Remove the smallest key. The flag CAS on the edge which held the
+     * leftmost unflagged leaf when the walk saw it is the linearization
+     * point. All leaves on its left were flagged, so an insert of a smaller
+     * key has to swing that same edge first, which makes the flag CAS fail
+     * and the pop start over.
      *
-     * @param ptr the node which needs to be retired
+     * @param result where the removed key is stored to
+     * @return true if a key is removed; false if the tree is empty
      */
-    void retire(node_t* ptr);
+    bool pop_min(T& result);
 
-    void init();
-public:
-    LockFreeBST();
-    virtual ~LockFreeBST();
-    virtual bool insert(const T& t);
-    virtual void erase(const T& t);
-    virtual bool find(const T& t);
-    virtual size_t size();
-    virtual void clear();
-    virtual void set_N(size_t _N);
-    virtual void register_thread(size_t tid);
+    /**
+     * Remove the largest key, see pop_min.
+     */
+    bool pop_max(T& result);
+
+    /**
+     * Let pop_min/pop_max remove a random one of the k smallest/largest
+     * keys instead of always the extreme one. This spreads concurrent pops
+     * over k leaves, at the cost of relaxing the order: the result is only
+     * guaranteed to be among the k extreme keys. k = 1 is exact.
+     */
+    void set_pop_spray(size_t k) { pop_spray = k == 0 ? 1 : k; }
 };
 
 template<typename T>
 thread_local size_t LockFreeBST<T>::thread_id;
 
+template<typename T>
+thread_local typename LockFreeBST<T>::finger_t LockFreeBST<T>::finger;
+
 template<typename T>
 void LockFreeBST<T>::set_N(size_t _N) {
     BST<T>::set_N(_N);
     rlist.resize(_N);
+    rstats.resize(_N);
 }
 
 template<typename T>
@@ -825,19 +3239,30 @@ void LockFreeBST<T>::register_thread(size_t tid) {
 template<typename T>
 void LockFreeBST<T>::retire(node_t* ptr) {
     rlist[thread_id].push_back(ptr);
+    rstats.retire(thread_id);
 }
 
 template<typename T>
 void LockFreeBST<T>::gc() {
     if (rlist[thread_id].size() > BST<T>::R) {
+        BST_TRACE_SCOPE("gc");
         mtx.lock();
-        while (rw_count > 0);
+        size_t pause_start = ReclaimStats::now();
+        // Before the wait: an operation which passed the barrier but is not
+        // counted yet reads the new epoch once it is, and drops its finger
+        gc_epoch = next_finger_epoch();
+        {
+            BST_TRACE_SCOPE("gc_wait");
+            while (rw_count > 0);
+        }
         // Iterate the retire list and free nodes
         for (node_t* node : rlist[thread_id]) {
             delete node;
         }
+        size_t freed = rlist[thread_id].size();
         rlist[thread_id].clear();
         mtx.unlock();
+        rstats.pause(thread_id, freed, ReclaimStats::now() - pause_start);
     }
 }
 
@@ -865,7 +3290,8 @@ void LockFreeBST<T>::init() {
 }
 
 template<typename T>
-LockFreeBST<T>::LockFreeBST() {
+LockFreeBST<T>::LockFreeBST(): range_retries(RANGE_RETRIES), gc_epoch(next_finger_epoch()), fingers(false),
+    contention_wait(ContentionWait::None), local_restart(false), pop_spray(1) {
     init();
 }
 
@@ -914,16 +3340,61 @@ typename LockFreeBST<T>::node_t *LockFreeBST<T>::get_addr(size_t addr) {
 }
 
 template<typename T>
-void LockFreeBST<T>::seek(const T& key, struct seekRecord_t *seekRecord) {
-    // Init the seek record
-    seekRecord->ancestor = R_root;
-    seekRecord->successor = S_root;
-    seekRecord->parent = S_root;
-    size_t S_left = (get_addr(S_root.load())->left).load();
-    seekRecord->leaf = reinterpret_cast<size_t>(get_addr(S_left));
+bool LockFreeBST<T>::seek(const T& key, struct seekRecord_t *seekRecord, bool use_finger, node_t* from) {
+    BST_TRACE_SCOPE("seek");
+    BST_STAT_INC(LF_Seek);
+    size_t epoch = gc_epoch.load();
+    // Bounds of the subtree of leaf and of parent, nullptr if unbounded
+    const T* lo = nullptr;
+    const T* hi = nullptr;
+    const T* parent_lo = nullptr;
+    const T* parent_hi = nullptr;
+    T finger_lo;
+    T finger_hi;
+    size_t parentField;
+    node_t* start = from;
+    bool from_finger = false;
+    if (start == nullptr && use_finger && finger.owner == this && finger.epoch == epoch
+            && (!finger.has_lo || !(key < finger.lo)) && (!finger.has_hi || key < finger.hi)) {
+        start = finger.node;
+        from_finger = true;
+    }
+    if (start != nullptr && ((start->left.load() & addr_mask) != 0 || (start->right.load() & addr_mask) != 0)) {
+        start = nullptr;
+        from_finger = false;
+    }
+    // The finger is only moved if the bounds of the start node are known
+    use_finger = use_finger && (start == nullptr || from_finger);
+    if (start != nullptr) {
+        if (from_finger) {
+            finger_lo = finger.lo;
+            finger_hi = finger.hi;
+            parent_lo = finger.has_lo ? &finger_lo : nullptr;
+            parent_hi = finger.has_hi ? &finger_hi : nullptr;
+        }
+        seekRecord->ancestor = 0;
+        seekRecord->successor = 0;
+        seekRecord->parent = reinterpret_cast<size_t>(start);
+        if (key < start->key) {
+            parentField = start->left.load();
+            lo = parent_lo;
+            hi = &start->key;
+        } else {
+            parentField = start->right.load();
+            lo = &start->key;
+            hi = parent_hi;
+        }
+    } else {
+        // Init the seek record
+        seekRecord->ancestor = R_root;
+        seekRecord->successor = S_root;
+        seekRecord->parent = S_root;
+        parentField = (get_addr(S_root.load())->left).load();
+    }
+    seekRecord->leaf = reinterpret_cast<size_t>(get_addr(parentField));
     // Init variables used in traversal
-    size_t parentField = get_addr(seekRecord->parent)->left;
-    size_t currentField = get_addr(seekRecord->leaf)->left;
+    node_t* leaf = get_addr(seekRecord->leaf);
+    size_t currentField = key < leaf->key ? leaf->left.load() : leaf->right.load();
     node_t *current = get_addr(currentField);
     // Traverse tree
     while (current != nullptr) {
@@ -934,8 +3405,16 @@ void LockFreeBST<T>::seek(const T& key, struct seekRecord_t *seekRecord) {
             seekRecord->successor = seekRecord->leaf;
         }
         // Advance parent and leaf
+        node_t* parent = get_addr(seekRecord->leaf);
         seekRecord->parent = seekRecord->leaf;
         seekRecord->leaf = reinterpret_cast<size_t>(current);
+        parent_lo = lo;
+        parent_hi = hi;
+        if (key < parent->key) {
+            hi = &parent->key;
+        } else {
+            lo = &parent->key;
+        }
         // Update other traversal variables
         parentField = currentField;
         if (key < current->key) {
@@ -945,12 +3424,46 @@ void LockFreeBST<T>::seek(const T& key, struct seekRecord_t *seekRecord) {
         }
         current = get_addr(currentField);
     }
+    if (use_finger && seekRecord->parent != S_root) {
+        finger.has_lo = parent_lo != nullptr;
+        finger.has_hi = parent_hi != nullptr;
+        if (parent_lo != nullptr) {
+            finger.lo = *parent_lo;
+        }
+        if (parent_hi != nullptr) {
+            finger.hi = *parent_hi;
+        }
+        finger.owner = this;
+        finger.epoch = epoch;
+        finger.node = get_addr(seekRecord->parent);
+    }
+    return start != nullptr;
+}
+
+template<typename T>
+void LockFreeBST<T>::reseek(const T& key, struct seekRecord_t *seekRecord, size_t previous) {
+    node_t* from = nullptr;
+    if (local_restart && previous != 0 && previous != R_root) {
+        from = get_addr(previous);
+    }
+    if (seek(key, seekRecord, false, from)) {
+        if (seekRecord->ancestor != 0) {
+            BST_STAT_INC(LF_Local_Restart);
+            return;
+        }
+        // The leaf hangs below the start node, whose parent cleanup would need
+        seek(key, seekRecord);
+    }
 }
 
 template<typename T>
 bool LockFreeBST<T>::insert(const T& t) {
-    mtx.lock();
-    mtx.unlock();
+    BST_TRACE_SCOPE("insert");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
 
     rw_count++;
     
@@ -966,10 +3479,18 @@ bool LockFreeBST<T>::insert(const T& t) {
 
 template<typename T>
 bool LockFreeBST<T>::insert_helper(const T& t) {
+    ContentionManager contention(contention_wait);
+    size_t previous = 0; // Ancestor of the previous seek, 0 before the first one
     // While loop is used for traversing the tree
     while (true) {
         struct seekRecord_t seekRecord;
-        seek(t, &seekRecord); // Get the leaf location where the key should be inserted to
+        // Get the leaf location where the key should be inserted to
+        if (previous == 0) {
+            seek(t, &seekRecord, fingers);
+        } else {
+            reseek(t, &seekRecord, previous);
+        }
+        previous = seekRecord.ancestor != 0 ? seekRecord.ancestor : R_root.load();
         if (get_addr(seekRecord.leaf)->key != t) {
             size_t parent = seekRecord.parent;
             size_t leaf = seekRecord.leaf;
@@ -994,6 +3515,7 @@ bool LockFreeBST<T>::insert_helper(const T& t) {
             atomic_size_t* childAddrPtr;
             bool result;
             // Reconnect internal node, old leaf, and new leaf
+            size_t ticket = useq.begin(thread_id);
             if (t < parent_n->key) {
                 childAddrPtr = &parent_n->left;
                 result = std::atomic_compare_exchange_weak(&(parent_n->left), &old_leaf, internal);
@@ -1001,15 +3523,27 @@ bool LockFreeBST<T>::insert_helper(const T& t) {
                 childAddrPtr = &parent_n->right;
                 result = std::atomic_compare_exchange_weak(&(parent_n->right), &old_leaf, internal);
             }
+            if (result) {
+                exporter.record(t, ticket, false);
+            }
+            useq.end(thread_id);
             if (result) {
                 // Return if edge modifications are successful
                 return true;
             } else {
+                BST_STAT_INC(LF_Insert_CAS_Fail);
+                BST_TRACE_INSTANT("cas_fail");
+                // Never published, the next attempt allocates new ones
+                delete new_leaf;
+                delete newInternal;
                 // help the conflicting delete operation
                 size_t childAddr = *childAddrPtr;
-                if (get_addr(childAddr) == leaf_n && (is_flagged(childAddr) || is_tagged(childAddr))) {
+                // A seek from the finger has no ancestor if the leaf hangs below the finger
+                if (seekRecord.ancestor != 0 && get_addr(childAddr) == leaf_n && (is_flagged(childAddr) || is_tagged(childAddr))) {
+                    BST_STAT_INC(LF_Cleanup_Help);
                     cleanup(t, &seekRecord);
                 }
+                contention.fail();
             }
         } 
         // key existed in the tree
@@ -1025,8 +3559,17 @@ enum Mode {
 
 template<typename T>
 void LockFreeBST<T>::erase(const T& key) {
-    mtx.lock();
-    mtx.unlock();
+    remove(key);
+}
+
+template<typename T>
+bool LockFreeBST<T>::remove(const T& key) {
+    BST_TRACE_SCOPE("erase");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
     
     rw_count++;
 
@@ -1037,17 +3580,26 @@ void LockFreeBST<T>::erase(const T& key) {
 
     rw_count--;
     gc();
+    return result;
 }
 
 template<typename T>
-bool LockFreeBST<T>::erase_helper(const T& key) {
-    Mode mode = Mode::INJECTION;
-    size_t leaf;
+bool LockFreeBST<T>::erase_helper(const T& key, size_t flagged) {
+    ContentionManager contention(contention_wait);
+    Mode mode = flagged != 0 ? Mode::CLEANUP : Mode::INJECTION;
+    size_t leaf = flagged;
     node_t* leaf_n;
     bool done = false;
+    size_t previous = 0; // Ancestor of the previous seek, 0 before the first one
     while (!done) {
         seekRecord_t seekRecord;
-        seek(key, &seekRecord); // Get the parent and the leaf which needs to be erased
+        // Get the parent and the leaf which needs to be erased
+        if (previous == 0) {
+            seek(key, &seekRecord);
+        } else {
+            reseek(key, &seekRecord, previous);
+        }
+        previous = seekRecord.ancestor;
         size_t parent = seekRecord.parent;
         node_t* parent_n = get_addr(parent);
         atomic_size_t* childAddrPtr;
@@ -1066,29 +3618,42 @@ bool LockFreeBST<T>::erase_helper(const T& key) {
             }
             // Set flag bit
             size_t old_leaf = reinterpret_cast<size_t>(leaf_n);
+            size_t ticket = useq.begin(thread_id);
             bool result = std::atomic_compare_exchange_weak(
                 childAddrPtr, 
                 &old_leaf, 
                 set_flag(reinterpret_cast<size_t>(leaf_n))
             );
+            if (result) {
+                exporter.record(leaf_n->key, ticket, true);
+            }
+            useq.end(thread_id);
             if (result) {
                 mode = Mode::CLEANUP;
                 // Cleanup the node
                 done = cleanup(key, &seekRecord);
             } else {
+                BST_STAT_INC(LF_Erase_CAS_Fail);
+                BST_TRACE_INSTANT("cas_fail");
                 size_t childAddr = *childAddrPtr;
                 if (get_addr(childAddr) == leaf_n && (is_flagged(childAddr) || is_tagged(childAddr))) {
                     // If the node has been marked as clean, help to clean the node
+                    BST_STAT_INC(LF_Cleanup_Help);
                     cleanup(key, &seekRecord);
                 }
+                contention.fail();
             }
         } else {
             if (seekRecord.leaf != leaf) {
-                // Leaf has been erased
-                return false;
+                // Leaf flagged by this thread has been cleaned up and retired by a helper
+                return true;
             } else {
                 // Help to clean
+                BST_STAT_INC(LF_Erase_Retry);
                 done = cleanup(key, &seekRecord);
+                if (!done) {
+                    contention.fail();
+                }
             }
         }
     }
@@ -1097,14 +3662,13 @@ bool LockFreeBST<T>::erase_helper(const T& key) {
 
 template<typename T>
 bool LockFreeBST<T>::cleanup(const T& key, const seekRecord_t* seekRecord) {
+    BST_TRACE_SCOPE("cleanup");
     size_t ancestor = seekRecord->ancestor;
     node_t* ancestor_n = get_addr(ancestor);
     size_t successor = seekRecord->successor;
     node_t* successor_n = get_addr(successor);
     size_t parent = seekRecord->parent;
     node_t* parent_n = get_addr(parent);
-    size_t leaf = seekRecord->leaf;
-    node_t* leaf_n = get_addr(leaf);
     atomic_size_t* successorAddrPtr;
     if (key < ancestor_n->key) {
         successorAddrPtr = &(ancestor_n->left);
@@ -1145,8 +3709,18 @@ bool LockFreeBST<T>::cleanup(const T& key, const seekRecord_t* seekRecord) {
     );
     
     if (result) {
+        // Tagged edges and flagged leaves do not change any more
+        for (node_t* node = successor_n; node != parent_n; ) {
+            bool left = key < node->key;
+            retire(get_addr((left ? node->right : node->left).load()));
+            retire(node);
+            node = get_addr((left ? node->left : node->right).load());
+        }
+        retire(get_addr(siblingAddrPtr == &parent_n->left ? parent_n->right.load() : parent_n->left.load()));
         retire(parent_n);
-        retire(leaf_n);
+    } else {
+        BST_STAT_INC(LF_Cleanup_CAS_Fail);
+        BST_TRACE_INSTANT("cas_fail");
     }
     
     return result;
@@ -1154,8 +3728,12 @@ bool LockFreeBST<T>::cleanup(const T& key, const seekRecord_t* seekRecord) {
 
 template<typename T>
 bool LockFreeBST<T>::find(const T& t) {
-    mtx.lock();
-    mtx.unlock();
+    BST_TRACE_SCOPE("find");
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
     
     rw_count++;
 
@@ -1166,10 +3744,65 @@ bool LockFreeBST<T>::find(const T& t) {
     return result;
 }
 
+template<typename T>
+void LockFreeBST<T>::find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+    BST_TRACE_SCOPE("find_many");
+    struct lane_t {
+        size_t index;       // Index of the key in the batch
+        const node_t* node; // Node the seek is at
+    };
+    results.assign(keys.size(), false);
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    // seek() starts at the child of S_root
+    const node_t* top = get_addr(get_addr(S_root.load())->left.load());
+    lane_t lanes[BST<T>::FIND_LANES];
+    size_t active = 0;
+    size_t next = 0;
+    while (active < BST<T>::FIND_LANES && next < keys.size()) {
+        lanes[active].index = next++;
+        lanes[active].node = top;
+        active++;
+    }
+    while (active > 0) {
+        size_t i = 0;
+        while (i < active) {
+            lane_t& lane = lanes[i];
+            const node_t* node = lane.node;
+            const T& key = keys[lane.index];
+            size_t left = node->left.load();
+            if (get_addr(left) != nullptr) {
+                node = get_addr(key < node->key ? left : node->right.load());
+                __builtin_prefetch(node);
+                lane.node = node;
+                i++;
+                continue;
+            }
+            // Leaf reached, same check as find_helper
+            results[lane.index] = node->key == key;
+            if (next < keys.size()) {
+                lane.index = next++;
+                lane.node = top;
+                i++;
+            } else {
+                lane = lanes[--active];
+            }
+        }
+    }
+
+    rw_count--;
+}
+
 template<typename T>
 bool LockFreeBST<T>::find_helper(const T& t) {
     struct seekRecord_t seekRecord;
-    seek(t, &seekRecord);
+    seek(t, &seekRecord, fingers);
     if (get_addr(seekRecord.leaf)->key == t) {
         return true;
     }
@@ -1181,6 +3814,351 @@ size_t LockFreeBST<T>::size() {
     return _size.load();
 }
 
+template<typename T>
+template<typename F>
+void LockFreeBST<T>::snapshot_read(const T* lo, const T* hi, F read) {
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    for (int attempt = 0; attempt < range_retries; attempt++) {
+        size_t version;
+        if (useq.wait_stable(version)) {
+            read(nullptr);
+            if (useq.validate(version)) {
+                rw_count--;
+                return;
+            }
+        }
+        BST_STAT_INC(SR_Retry);
+    }
+
+    // Too many conflicts, correct the keys with the updates since a version
+    std::vector<T> keys;
+    exporter.collect(useq, lo, hi, keys, [&](std::vector<T>& out) {
+        walk(lo, hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+    read(&keys);
+
+    rw_count--;
+}
+
+template<typename T>
+template<typename F>
+void LockFreeBST<T>::walk(const std::vector<T>* keys, const T* lo, const T* hi, F visit) {
+    if (keys == nullptr) {
+        walk(lo, hi, visit);
+        return;
+    }
+    typename std::vector<T>::const_iterator it = lo == nullptr ? keys->begin()
+        : std::lower_bound(keys->begin(), keys->end(), *lo);
+    for (; it != keys->end() && (hi == nullptr || *it < *hi); ++it) {
+        if (!visit(*it)) {
+            return;
+        }
+    }
+}
+
+template<typename T>
+bool LockFreeBST<T>::export_snapshot(int fd) {
+    BST_TRACE_SCOPE("export_snapshot");
+    return exporter.run(fd, useq, [&](const T* lo, size_t limit, std::vector<T>& out) {
+        snapshot_read(lo, nullptr, [&](const std::vector<T>* keys) {
+            out.clear();
+            walk(keys, lo, nullptr, [&](const T& key) {
+                out.push_back(key);
+                return out.size() < limit;
+            });
+        });
+    });
+}
+
+template<typename T>
+void LockFreeBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    range_keys(&lo, &hi, out);
+}
+
+template<typename T>
+void LockFreeBST<T>::range_keys(const T* lo, const T* hi, std::vector<T>& out) {
+    BST_TRACE_SCOPE("range_query");
+    snapshot_read(lo, hi, [&](const std::vector<T>* keys) {
+        out.clear();
+        walk(keys, lo, hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+}
+
+template<typename T>
+size_t LockFreeBST<T>::rank(const T& t) {
+    BST_TRACE_SCOPE("rank");
+    size_t count = 0;
+    snapshot_read(nullptr, &t, [&](const std::vector<T>* keys) {
+        count = 0;
+        walk(keys, nullptr, &t, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T>
+bool LockFreeBST<T>::select(size_t k, T& result) {
+    BST_TRACE_SCOPE("select");
+    bool found = false;
+    snapshot_read(nullptr, nullptr, [&](const std::vector<T>* keys) {
+        size_t left = k;
+        found = false;
+        walk(keys, nullptr, nullptr, [&](const T& key) {
+            if (left == 0) {
+                result = key;
+                found = true;
+                return false;
+            }
+            left--;
+            return true;
+        });
+    });
+    return found;
+}
+
+template<typename T>
+size_t LockFreeBST<T>::range_count(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("range_count");
+    size_t count = 0;
+    snapshot_read(&lo, &hi, [&](const std::vector<T>* keys) {
+        count = 0;
+        walk(keys, &lo, &hi, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T>
+bool LockFreeBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    BST_TRACE_SCOPE("nearest");
+    bool found = false;
+    // The keys a fallback collects: all keys on the requested side of t
+    const T* lo = bounded && ascending ? &t : nullptr;
+    const T* hi = bounded && !ascending && !inclusive ? &t : nullptr;
+    snapshot_read(lo, hi, [&](const std::vector<T>* keys) {
+        found = keys == nullptr ? nearest_helper(t, bounded, inclusive, ascending, result)
+            : nearest_in(*keys, t, bounded, inclusive, ascending, result);
+    });
+    return found;
+}
+
+template<typename T>
+bool LockFreeBST<T>::nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result,
+    size_t skip, seekRecord_t* record) {
+    struct frame_t {
+        size_t edge;
+        seekRecord_t path; // Seek record at the edge, leaf is not set yet
+    };
+    bool found = false;
+    // Edges still to be visited, the top of the stack is the closest one
+    std::vector<frame_t> stack;
+    frame_t top = { get_addr(S_root.load())->left.load(), { R_root.load(), S_root.load(), S_root.load(), 0 } };
+    stack.push_back(top);
+    while (!stack.empty()) {
+        frame_t frame = stack.back();
+        stack.pop_back();
+        node_t* node = get_addr(frame.edge);
+        if (node == nullptr) {
+            continue;
+        }
+        size_t left = node->left.load();
+        size_t right = node->right.load();
+        if (get_addr(left) == nullptr) {
+            // Leaf, skip it if it is erased, out of bound, or the sentinel
+            if (!is_flagged(frame.edge) && node->key < INFINITY_0 &&
+                within_bound(node->key, t, bounded, inclusive, ascending)) {
+                result = node->key;
+                found = true;
+                if (record != nullptr) {
+                    *record = frame.path;
+                    record->leaf = reinterpret_cast<size_t>(node);
+                }
+                if (skip == 0) {
+                    return true;
+                }
+                skip--;
+            }
+            continue;
+        }
+        // The children see node as parent, and advance ancestor and successor like seek()
+        frame_t child = frame;
+        if (!is_tagged(frame.edge)) {
+            child.path.ancestor = frame.path.parent;
+            child.path.successor = reinterpret_cast<size_t>(node);
+        }
+        child.path.parent = reinterpret_cast<size_t>(node);
+        // Left subtree holds keys smaller than node, right subtree keys not smaller than node
+        if (ascending) {
+            child.edge = right;
+            stack.push_back(child);
+            if (!bounded || t < node->key) {
+                child.edge = left;
+                stack.push_back(child);
+            }
+        } else {
+            child.edge = left;
+            stack.push_back(child);
+            if (!bounded || node->key < t || (inclusive && !(t < node->key))) {
+                child.edge = right;
+                stack.push_back(child);
+            }
+        }
+    }
+    return found;
+}
+
+template<typename T>
+template<typename F>
+void LockFreeBST<T>::walk(const T* lo, const T* hi, F visit) {
+    // Edges still to be visited, the top of the stack is the leftmost one
+    std::vector<size_t> stack;
+    stack.push_back(get_addr(S_root.load())->left.load());
+    while (!stack.empty()) {
+        size_t edge = stack.back();
+        stack.pop_back();
+        node_t* node = get_addr(edge);
+        if (node == nullptr) {
+            continue;
+        }
+        size_t left = node->left.load();
+        size_t right = node->right.load();
+        if (get_addr(left) == nullptr) {
+            // Leaf, skip it if it is erased or if it is the sentinel
+            if (!is_flagged(edge) && node->key < INFINITY_0
+                && (lo == nullptr || !(node->key < *lo)) && (hi == nullptr || node->key < *hi)) {
+                if (!visit(node->key)) {
+                    return;
+                }
+            }
+            continue;
+        }
+        // Right subtree holds keys not smaller than node, left subtree keys smaller than node
+        if (hi == nullptr || node->key < *hi) {
+            stack.push_back(right);
+        }
+        if (lo == nullptr || *lo < node->key) {
+            stack.push_back(left);
+        }
+    }
+}
+
+template<typename T>
+bool LockFreeBST<T>::pop_min(T& result) {
+    BST_TRACE_SCOPE("pop_min");
+    return pop_helper(true, result);
+}
+
+template<typename T>
+bool LockFreeBST<T>::pop_max(T& result) {
+    BST_TRACE_SCOPE("pop_max");
+    return pop_helper(false, result);
+}
+
+template<typename T>
+bool LockFreeBST<T>::pop_helper(bool ascending, T& result) {
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    static thread_local unsigned int seed = static_cast<unsigned int>(thread_id) * 2654435761u + 1;
+    bool popped = false;
+    while (true) {
+        size_t skip = 0;
+        if (pop_spray > 1) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            skip = seed % pop_spray;
+        }
+        seekRecord_t record;
+        if (!nearest_helper(T(), false, true, ascending, result, skip, &record)) {
+            // Tree is empty
+            break;
+        }
+        // The edge the walk came through, expected to still hold the leaf unmarked
+        node_t* parent_n = get_addr(record.parent);
+        atomic_size_t* childAddrPtr = result < parent_n->key ? &parent_n->left : &parent_n->right;
+        size_t old_leaf = record.leaf;
+        size_t ticket = useq.begin(thread_id);
+        bool flagged = childAddrPtr->compare_exchange_strong(old_leaf, set_flag(record.leaf));
+        if (flagged) {
+            exporter.record(result, ticket, true);
+        }
+        useq.end(thread_id);
+        if (flagged) {
+            erase_helper(result, record.leaf);
+            popped = true;
+            break;
+        }
+        // Another thread erased the leaf, or an insert or cleanup changed its edge
+        BST_STAT_INC(LF_Pop_Retry);
+        if (get_addr(old_leaf) == get_addr(record.leaf) && (is_flagged(old_leaf) || is_tagged(old_leaf))) {
+            // Help the erase which marked the edge, like a failed flag CAS of erase_helper does
+            BST_STAT_INC(LF_Cleanup_Help);
+            cleanup(result, &record);
+        }
+    }
+    if (popped) {
+        _size--;
+    }
+
+    rw_count--;
+    gc();
+
+    return popped;
+}
+
+template<typename T>
+shape_stats_t LockFreeBST<T>::shape_stats() {
+    shape_stats_t stats;
+    std::vector<std::pair<const node_t*, size_t>> stack;
+    stack.push_back(std::make_pair(get_addr(get_addr(S_root.load())->left.load()), 0));
+    while (!stack.empty()) {
+        const node_t* node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        const node_t* left = get_addr(node->left.load());
+        const node_t* right = get_addr(node->right.load());
+        bool leaf = left == nullptr && right == nullptr;
+        if (leaf && node->key == INFINITY_0) {
+            // Sentinel leaf
+            continue;
+        }
+        stats.visit(depth, leaf, leaf);
+        if (left != nullptr) {
+            stack.push_back(std::make_pair(left, depth + 1));
+        }
+        if (right != nullptr) {
+            stack.push_back(std::make_pair(right, depth + 1));
+        }
+    }
+    for (const std::vector<node_t*>& list : rlist) {
+        stats.retired_nodes += list.size();
+    }
+    return stats;
+}
+
 template<typename T>
 void LockFreeBST<T>::clear() {
     clear(R_root.load());
@@ -1188,22 +4166,185 @@ void LockFreeBST<T>::clear() {
         for (node_t* node : rlist[thread_id]) {
             delete node;
         }
+        rstats.free(thread_id, rlist[thread_id].size());
         rlist[thread_id].clear();
     }
+    gc_epoch = next_finger_epoch();
     init();
 }
 
 template<typename T>
 void LockFreeBST<T>::clear(size_t node_addr) {
-    if (node_addr == 0) {
-        return;
+    size_t keys = 0;
+    clear(node_addr, keys);
+}
+
+/**
+ * Free a subtree with an explicit stack of edges.
+ */
+template<typename T>
+size_t LockFreeBST<T>::clear(size_t node_addr, size_t& keys) {
+    size_t freed = 0;
+    std::vector<size_t> stack;
+    stack.push_back(node_addr);
+    while (!stack.empty()) {
+        size_t edge = stack.back();
+        stack.pop_back();
+        node_t *node = get_addr(edge);
+        if (node == nullptr) {
+            continue;
+        }
+        size_t left = node->left.load();
+        size_t right = node->right.load();
+        if (get_addr(left) == nullptr && !is_flagged(edge)) {
+            keys++;
+        }
+        stack.push_back(left);
+        stack.push_back(right);
+        delete node;
+        freed++;
+    }
+    return freed;
+}
+
+template<typename T>
+void LockFreeBST<T>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    walk(lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
+}
+
+template<typename T>
+void LockFreeBST<T>::split_keys(size_t count, std::vector<T>& keys) {
+    bool sampled = split_from_top(get_addr(get_addr(S_root.load())->left.load()), _size.load(), count, keys,
+        [this](node_t* node, node_t*& left, node_t*& right, const T*& key, size_t& weight) {
+            left = get_addr(node->left.load());
+            right = get_addr(node->right.load());
+            // Sentinels neither bound a range nor count
+            key = node->key < INFINITY_0 ? &node->key : nullptr;
+            weight = left == nullptr && key != nullptr ? 1 : 0;
+        });
+    if (!sampled) {
+        BST<T>::split_keys(count, keys);
+    }
+}
+
+template<typename T>
+size_t LockFreeBST<T>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+
+    rw_count++;
+
+    size_t removed = 0;
+    // The walk goes to the smallest leaf not below lo, then to the smallest
+    // one above the last leaf it erased. The path stays on the stack, so
+    // the next leaf is found from the ancestor of the last cleanup.
+    const T* cursor = &lo;
+    bool inclusive = true;
+    T last;
+    std::vector<path_frame_t> path;
+    while (true) {
+        if (path.empty()) {
+            path.push_back(path_frame_t{get_addr(S_root.load()), S_root.load(), true});
+        }
+        path_frame_t& top = path.back();
+        node_t* node = top.node;
+        size_t left = node->left.load();
+        size_t right = node->right.load();
+        if (get_addr(left) != nullptr) {
+            // Left subtree holds keys smaller than node, right subtree keys not smaller than node
+            top.left = *cursor < node->key;
+            if (!top.left && !(node->key < hi)) {
+                path.pop_back();
+            } else {
+                size_t edge = top.left ? left : right;
+                path.push_back(path_frame_t{get_addr(edge), edge, true});
+                continue;
+            }
+        } else if (!is_flagged(top.edge) && node->key < INFINITY_0 && node->key < hi
+                && (inclusive ? !(node->key < *cursor) : *cursor < node->key)) {
+            last = node->key;
+            cursor = &last;
+            inclusive = false;
+            if (erase_leaf(path)) {
+                removed++;
+            }
+            continue;
+        } else {
+            path.pop_back();
+        }
+        // Back to the deepest node whose right subtree is still to be walked
+        while (!path.empty() && (!path.back().left || !(path.back().node->key < hi))) {
+            path.pop_back();
+        }
+        if (path.size() <= 1) {
+            // Nothing left below S_root->left
+            break;
+        }
+        path_frame_t& turn = path.back();
+        turn.left = false;
+        size_t edge = turn.node->right.load();
+        path.push_back(path_frame_t{get_addr(edge), edge, true});
+    }
+    _size -= removed;
+
+    rw_count--;
+
+    gc();
+    return removed;
+}
+
+template<typename T>
+bool LockFreeBST<T>::erase_leaf(std::vector<path_frame_t>& path) {
+    size_t depth = path.size();
+    node_t* leaf_n = path[depth - 1].node;
+    node_t* parent_n = path[depth - 2].node;
+    T key = leaf_n->key;
+    // The seek record of the path, see seek
+    seekRecord_t record;
+    record.ancestor = R_root;
+    record.successor = S_root;
+    size_t ancestor_index = SIZE_MAX;
+    for (size_t i = depth - 2; i >= 1; i--) {
+        if (!is_tagged(path[i].edge)) {
+            record.ancestor = reinterpret_cast<size_t>(path[i - 1].node);
+            record.successor = reinterpret_cast<size_t>(path[i].node);
+            ancestor_index = i - 1;
+            break;
+        }
+    }
+    record.parent = reinterpret_cast<size_t>(parent_n);
+    record.leaf = reinterpret_cast<size_t>(leaf_n);
+    atomic_size_t* childAddrPtr = path[depth - 2].left ? &parent_n->left : &parent_n->right;
+    size_t old_leaf = reinterpret_cast<size_t>(leaf_n);
+    size_t ticket = useq.begin(thread_id);
+    bool flagged = std::atomic_compare_exchange_strong(childAddrPtr, &old_leaf, set_flag(old_leaf));
+    if (flagged) {
+        exporter.record(key, ticket, true);
+    }
+    useq.end(thread_id);
+    bool erased;
+    if (flagged && cleanup(key, &record)) {
+        // The sibling subtree took the place of successor below ancestor
+        path.resize(ancestor_index + 1);
+        return true;
+    } else if (flagged) {
+        erased = erase_helper(key, record.leaf);
+    } else {
+        // The leaf was flagged or its edge changed since the walk read it
+        erased = erase_helper(key);
     }
-    node_t *node = get_addr(node_addr);
-    size_t left = node->left.load();
-    size_t right = node->right.load();
-    clear(left);
-    clear(right);
-    delete node;
+    path.clear();
+    return erased;
 }
 
 #endif
@@ -0,0 +1,108 @@
+#ifndef CONTENTION_H
+#define CONTENTION_H
+
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include "stats.h"
+
+/**
+ * What a thread does after it lost a CAS, before it retries
+ */
+enum class ContentionWait {
+    None=0,     // Retry at once
+    Backoff,    // Bounded exponential backoff with random jitter
+    Spin_Yield, // Spin while the thread's spin budget lasts, then yield the CPU
+    Unknown
+};
+
+/**
+ * Contention manager of one operation, which owns the retry loop's
+ * waiting. Backoff doubles a randomized pause per lost CAS up to
+ * MAX_PAUSE. Spin_Yield pauses briefly for the first failures and yields
+ * after that; the number of failures a thread spins through adapts to
+ * how its previous operations ended: a retry storm that was resolved by
+ * spinning grows the budget, one which needed a yield halves it.
+ */
+class ContentionManager {
+    ContentionWait wait;
+    size_t failures; // CAS failures of this operation so far
+    bool yielded;    // Whether the operation yielded the CPU
+
+    static const size_t MIN_PAUSE = 16;   // Pause loop iterations after the first failure
+    static const size_t MAX_PAUSE = 4096; // Bound of the exponential backoff
+    static const size_t SPIN_PAUSE = 64;  // Pause loop iterations of one spin round
+    static const size_t MAX_SPIN_BUDGET = 16;
+
+    static size_t& spin_budget() {
+        static thread_local size_t budget = 4;
+        return budget;
+    }
+
+    // xorshift, the jitter only needs to decorrelate threads
+    static size_t random() {
+        static thread_local size_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    static void pause(size_t iterations) {
+        for (size_t i = 0; i < iterations; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#else
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+        }
+    }
+
+public:
+    explicit ContentionManager(ContentionWait _wait): wait(_wait), failures(0), yielded(false) {}
+
+    ~ContentionManager() {
+        if (wait != ContentionWait::Spin_Yield || failures == 0) {
+            return;
+        }
+        size_t& budget = spin_budget();
+        if (yielded) {
+            budget = std::max(budget / 2, static_cast<size_t>(1));
+        } else {
+            budget = std::min(budget + 1, static_cast<size_t>(MAX_SPIN_BUDGET));
+        }
+    }
+
+    ContentionManager(const ContentionManager& other)=delete;
+    ContentionManager& operator=(const ContentionManager& other)=delete;
+
+    /**
+     * Wait after a lost CAS according to the policy
+     */
+    void fail() {
+        failures++;
+        switch (wait) {
+            case ContentionWait::Backoff: {
+                size_t limit = std::min(MIN_PAUSE << std::min(failures - 1, static_cast<size_t>(20)), static_cast<size_t>(MAX_PAUSE));
+                BST_STAT_INC(LF_Backoff);
+                pause(limit / 2 + random() % (limit / 2 + 1));
+                break;
+            }
+            case ContentionWait::Spin_Yield:
+                if (failures <= spin_budget()) {
+                    BST_STAT_INC(LF_Backoff);
+                    pause(SPIN_PAUSE);
+                } else {
+                    BST_STAT_INC(LF_Yield);
+                    yielded = true;
+                    std::this_thread::yield();
+                }
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef ELIMINATION_H
+#define ELIMINATION_H
+
+#include "bst.h"
+#include <thread>
+
+/**
+ * Elimination array in front of another tree. An insert(k) and an
+ * erase(k) which are pending at the same time and meet in the slot of k
+ * cancel out without touching the tree: insert returns true and the key
+ * set is left unchanged.
+ *
+ * The pair is only allowed to cancel if k is not in the tree, otherwise
+ * the insert would have to return false and the erase would remove k.
+ * The operation which finds the other one's offer calls find(k) on the
+ * tree while the offer is posted and only claims it if k is absent, so
+ * the pair linearizes as insert then erase at the linearization point of
+ * that find. Both are pending then: the offer stays posted until it is
+ * claimed or withdrawn, and a sequence number in the slot state keeps a
+ * claim from hitting a later offer of the same slot.
+ *
+ * An operation which finds no partner posts its own offer and waits for
+ * up to spins rounds before it withdraws and runs on the tree, so the
+ * layer only pays off when updates of the same key collide often.
+ */
+template<typename T>
+class EliminationBST : public BST<T> {
+    enum Kind {
+        Empty=0,  // No offer, the slot can be taken
+        Busy,     // The owner writes the key of its offer, or a partner claimed it
+        Insert,   // Pending insert of key
+        Erase,    // Pending erase of key
+    };
+
+    // Slot state is seq << 2 | kind, seq is incremented on every transition
+    static size_t make_state(size_t seq, Kind kind) { return (seq << 2) | kind; }
+    static size_t state_seq(size_t state) { return state >> 2; }
+    static Kind state_kind(size_t state) { return static_cast<Kind>(state & 3); }
+
+    struct slot_t {
+        std::atomic<size_t> state;
+        T key;
+        char pad[64]; // Keep slots on different cache lines
+        slot_t(): state(make_state(0, Empty)) {}
+    };
+
+    BST<T>& tree;
+    std::vector<slot_t> slots;
+    size_t spins;
+
+    slot_t& slot_of(const T& key) {
+        return slots[std::hash<T>()(key) % slots.size()];
+    }
+
+    /**
+     * Cancel the operation of the given kind against a posted offer of the
+     * opposite kind, or post an offer and wait for a partner.
+     *
+     * @return true if the operation was eliminated; false if it still has to run on the tree
+     */
+    bool eliminate(const T& key, Kind kind);
+
+public:
+    /**
+     * @param _tree tree the operations which are not eliminated run on, not owned
+     * @param width number of slots, keys are spread over them by hash
+     * @param _spins number of yields an offer waits for its partner
+     */
+    EliminationBST(BST<T>& _tree, size_t width=16, size_t _spins=32):
+        tree(_tree), slots(width == 0 ? 1 : width), spins(_spins) {}
+    EliminationBST(EliminationBST& other)=delete;
+    EliminationBST& operator=(const EliminationBST& other)=delete;
+
+    virtual bool insert(const T& t) {
+        if (eliminate(t, Insert)) {
+            return true;
+        }
+        return tree.insert(t);
+    }
+
+    virtual void erase(const T& t) {
+        if (!eliminate(t, Erase)) {
+            tree.erase(t);
+        }
+    }
+
+    virtual bool find(const T& t) { return tree.find(t); }
+    virtual size_t size() { return tree.size(); }
+    virtual void clear() { tree.clear(); }
+    virtual shape_stats_t shape_stats() { return tree.shape_stats(); }
+
+    virtual void set_N(size_t _N) {
+        BST<T>::set_N(_N);
+        tree.set_N(_N);
+    }
+
+    virtual void set_R(size_t _R) {
+        BST<T>::set_R(_R);
+        tree.set_R(_R);
+    }
+
+    virtual void set_fingers(bool enabled) { tree.set_fingers(enabled); }
+    virtual const ReclaimStats* reclaim_stats() { return tree.reclaim_stats(); }
+    virtual void register_thread(size_t tid) { tree.register_thread(tid); }
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out) { tree.range_query(lo, hi, out); }
+
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+        return tree.nearest(t, bounded, inclusive, ascending, result);
+    }
+
+    virtual size_t rank(const T& t) { return tree.rank(t); }
+    virtual bool select(size_t k, T& result) { return tree.select(k, result); }
+    virtual size_t range_count(const T& lo, const T& hi) { return tree.range_count(lo, hi); }
+    virtual size_t erase_range(const T& lo, const T& hi) { return tree.erase_range(lo, hi); }
+    virtual void split_keys(size_t count, std::vector<T>& keys) { tree.split_keys(count, keys); }
+
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+        tree.walk_range(lo, hi, f);
+    }
+
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+        tree.find_many(keys, results);
+    }
+};
+
+template<typename T>
+bool EliminationBST<T>::eliminate(const T& key, Kind kind) {
+    slot_t& slot = slot_of(key);
+    Kind partner = kind == Insert ? Erase : Insert;
+    size_t state = slot.state.load();
+    if (state_kind(state) == partner) {
+        // The key is only stable while the state is unchanged
+        T offered = slot.key;
+        if (slot.state.load() != state || !(offered == key)) {
+            return false;
+        }
+        if (tree.find(key)) {
+            return false;
+        }
+        // The offer was posted during the whole find if the state did not move on.
+        // The slot stays Busy until the owner sees the claim and empties it.
+        if (!slot.state.compare_exchange_strong(state, make_state(state_seq(state) + 1, Busy))) {
+            return false;
+        }
+        BST_STAT_INC(EL_Eliminated);
+        return true;
+    }
+    if (state_kind(state) != Empty) {
+        return false;
+    }
+    // Post an offer
+    if (!slot.state.compare_exchange_strong(state, make_state(state_seq(state) + 1, Busy))) {
+        return false;
+    }
+    slot.key = key;
+    size_t offer = make_state(state_seq(state) + 2, kind);
+    slot.state.store(offer);
+    for (size_t i = 0; i < spins && slot.state.load() == offer; i++) {
+        std::this_thread::yield();
+    }
+    // Withdraw, a failed CAS means a partner claimed the offer and left the slot Busy
+    size_t expected = offer;
+    if (slot.state.compare_exchange_strong(expected, make_state(state_seq(offer) + 1, Empty))) {
+        BST_STAT_INC(EL_Timeout);
+        return false;
+    }
+    slot.state.store(make_state(state_seq(expected) + 1, Empty));
+    return true;
+}
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "file_io.h"
+#include "stats.h"
+#include "trace.h"
+#include "update_seq.h"
+
+/**
+ * Journal of the updates since a version, for trees which bracket their
+ * updates with update_seq_t. It opens at a version v at which no update
+ * was in flight (update_seq_t::open_journal), and from then on an update
+ * records its key right after its linearization point, together with its
+ * ticket and whether the key was present before. For a key which was
+ * updated since v, the record with the smallest ticket tells the state at
+ * v, so keys read from the live tree later are corrected to the key set
+ * at v, as long as every update which changed them has ended by then.
+ * Updates only take the journal lock while it is open.
+ *
+ * The journal is not capped, but it holds one record per key: at most
+ * the keys which were in the tree or inserted while it is open, minus the
+ * ones correct() has passed. A record is one std::map node, about 48 B
+ * plus the key, so a journal open while the whole tree is rewritten ahead
+ * of a slow export costs about as much as a copy of the keys.
+ */
+template<typename T>
+class UpdateJournal {
+    struct record_t {
+        size_t ticket;
+        bool was_present; // Whether the key was in the tree right before the update
+    };
+
+    std::atomic<bool> active;
+
+    std::mutex jmtx; // Guards the fields below
+    size_t floor;    // Version of the journal, older updates are not recorded
+    std::map<T, record_t> journal;
+    T cursor;        // Keys below it are corrected already
+    bool has_cursor;
+
+public:
+    std::mutex owner; // The journal serves one export or snapshot read at a time
+
+    UpdateJournal(): active(false), floor(0), has_cursor(false) {}
+    UpdateJournal(const UpdateJournal& other)=delete;
+    UpdateJournal& operator=(const UpdateJournal& other)=delete;
+
+    /**
+     * Called by an update after its linearization point and before
+     * update_seq_t::end(), only if it changed the key set.
+     *
+     * @param ticket what update_seq_t::begin() returned
+     * @param was_present true for a removal; false for an insertion
+     */
+    void record(const T& key, size_t ticket, bool was_present) {
+        if (!active.load()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(jmtx);
+        if (ticket < floor || (has_cursor && key < cursor)) {
+            return;
+        }
+        typename std::map<T, record_t>::iterator it = journal.find(key);
+        if (it == journal.end()) {
+            record_t r = { ticket, was_present };
+            journal.insert(std::make_pair(key, r));
+        } else if (ticket < it->second.ticket) {
+            it->second.ticket = ticket;
+            it->second.was_present = was_present;
+        }
+    }
+
+    /**
+     * Start recording updates of tickets from version on, called through
+     * update_seq_t::open_journal.
+     */
+    void open(size_t version) {
+        std::lock_guard<std::mutex> lock(jmtx);
+        floor = version;
+        active.store(true);
+        // Records of a previous use which raced with close()
+        journal.clear();
+        has_cursor = false;
+    }
+
+    /**
+     * Turn the keys of [lo, hi) read from the live tree into the keys at
+     * the version of the journal. Records below hi are dropped, and so
+     * are later updates of keys below hi.
+     */
+    void correct(const T* lo, const T* hi, std::vector<T>& keys);
+
+    // Stop recording and drop all records
+    void close() {
+        std::lock_guard<std::mutex> lock(jmtx);
+        active.store(false);
+        journal.clear();
+        has_cursor = false;
+    }
+};
+
+template<typename T>
+void UpdateJournal<T>::correct(const T* lo, const T* hi, std::vector<T>& keys) {
+    std::lock_guard<std::mutex> lock(jmtx);
+    typename std::map<T, record_t>::iterator it = lo == nullptr ? journal.begin() : journal.lower_bound(*lo);
+    typename std::map<T, record_t>::iterator end = hi == nullptr ? journal.end() : journal.lower_bound(*hi);
+    if (it != end) {
+        std::vector<T> merged;
+        merged.reserve(keys.size());
+        size_t i = 0;
+        for (; it != end; ++it) {
+            BST_STAT_INC(EX_Corrected);
+            while (i < keys.size() && keys[i] < it->first) {
+                merged.push_back(keys[i++]);
+            }
+            if (i < keys.size() && !(it->first < keys[i])) {
+                i++;
+            }
+            if (it->second.was_present) {
+                merged.push_back(it->first);
+            }
+        }
+        merged.insert(merged.end(), keys.begin() + i, keys.end());
+        keys.swap(merged);
+    }
+    if (hi != nullptr) {
+        cursor = *hi;
+        has_cursor = true;
+        journal.erase(journal.begin(), end);
+    }
+}
+
+/**
+ * Key set of a live tree as of one version while updates keep running,
+ * either streamed to a file (run) or collected for one key range
+ * (collect). Each uses its own UpdateJournal.
+ *
+ * An export reads the tree chunk by chunk, each chunk with a short
+ * validated read of the live tree, and corrects a chunk with the records
+ * of its key range before it is written. Records of keys below the chunks
+ * already written are dropped, so the memory is one chunk plus the keys
+ * ahead of the export which were updated while it runs, see UpdateJournal
+ * for the bound. No lock is held while writing.
+ */
+template<typename T>
+class SnapshotExport {
+    UpdateJournal<T> exports;
+    UpdateJournal<T> scans;
+
+public:
+    static const size_t CHUNK = 4096; // Keys per write
+
+    SnapshotExport() {}
+    SnapshotExport(const SnapshotExport& other)=delete;
+    SnapshotExport& operator=(const SnapshotExport& other)=delete;
+
+    // See UpdateJournal::record
+    void record(const T& key, size_t ticket, bool was_present) {
+        exports.record(key, ticket, was_present);
+        scans.record(key, ticket, was_present);
+    }
+
+    /**
+     * Write the keys in ascending order as raw T values.
+     *
+     * @param useq counts the updates of the tree
+     * @param read_chunk read(lo, limit, out) collects up to limit keys >= *lo
+     *        (all keys for nullptr) of the live tree into out with a validated read
+     * @return true if all keys were written; false if write() failed
+     */
+    template<size_t SLOTS, typename Read>
+    bool run(int fd, update_seq_t<SLOTS>& useq, Read read_chunk);
+
+    /**
+     * Collect the keys of [lo, hi) in ascending order as of one version,
+     * while updates keep running. Snapshot reads fall back to it when
+     * their validations keep failing. Updates are only held back for the
+     * two short gates of update_seq_t, and collects of the same tree run
+     * one at a time.
+     *
+     * @param walk walk(keys) reads the keys of [lo, hi) of the live tree
+     *        without validation, a key which is not updated meanwhile must
+     *        be read exactly once
+     */
+    template<size_t SLOTS, typename Walk>
+    void collect(update_seq_t<SLOTS>& useq, const T* lo, const T* hi, std::vector<T>& keys, Walk walk);
+};
+
+template<typename T>
+template<size_t SLOTS, typename Read>
+bool SnapshotExport<T>::run(int fd, update_seq_t<SLOTS>& useq, Read read_chunk) {
+    std::lock_guard<std::mutex> guard(exports.owner);
+    useq.open_journal([&](size_t version) {
+        exports.open(version);
+    });
+    std::vector<T> keys;
+    T lo;
+    bool has_lo = false;
+    bool ok = true;
+    while (ok) {
+        read_chunk(has_lo ? &lo : nullptr, CHUNK + 1, keys);
+        bool last = keys.size() <= CHUNK;
+        T hi;
+        if (!last) {
+            hi = keys[CHUNK];
+            keys.resize(CHUNK);
+        }
+        exports.correct(has_lo ? &lo : nullptr, last ? nullptr : &hi, keys);
+        BST_STAT_INC(EX_Chunk);
+        {
+            BST_TRACE_SCOPE("export_write");
+            ok = write_all(fd, keys.data(), keys.size() * sizeof(T));
+        }
+        if (last) {
+            break;
+        }
+        lo = hi;
+        has_lo = true;
+    }
+    exports.close();
+    useq.close_journal();
+    return ok;
+}
+
+template<typename T>
+template<size_t SLOTS, typename Walk>
+void SnapshotExport<T>::collect(update_seq_t<SLOTS>& useq, const T* lo, const T* hi, std::vector<T>& keys, Walk walk) {
+    BST_TRACE_SCOPE("journal_collect");
+    BST_STAT_INC(SR_Collect);
+    std::lock_guard<std::mutex> guard(scans.owner);
+    useq.open_journal([&](size_t version) {
+        scans.open(version);
+    });
+    keys.clear();
+    walk(keys);
+    // Updates which changed a key read above have recorded it once they ended
+    useq.quiesce();
+    scans.correct(lo, hi, keys);
+    scans.close();
+    useq.close_journal();
+}
+
+#endif
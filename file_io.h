@@ -0,0 +1,29 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * Write the whole buffer, retrying short and interrupted writes.
+ *
+ * @return true on success; false if write() failed
+ */
+inline bool write_all(int fd, const void* buf, size_t len) {
+    const char* pos = static_cast<const char*>(buf);
+    while (len > 0) {
+        ssize_t written = write(fd, pos, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += written;
+        len -= written;
+    }
+    return true;
+}
+
+#endif
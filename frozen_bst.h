@@ -0,0 +1,940 @@
+#ifndef FROZEN_BST_H
+#define FROZEN_BST_H
+
+#include "bst.h"
+#include "file_io.h"
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Read-only array which does not own its elements, either the buffer of
+ * a vector or a part of a mapped file.
+ */
+template<typename T>
+struct array_view_t {
+    const T* ptr;
+    size_t n;
+
+    array_view_t(const T* _ptr, size_t _n): ptr(_ptr), n(_n) {}
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + n; }
+    size_t size() const { return n; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+};
+
+/**
+ * Sorted keys stored in Eytzinger (BFS) order: the children of slot i are
+ * slots 2i and 2i + 1, and slot 0 is unused. A search touches one slot per
+ * level without branching on the comparison, and since the descendants of
+ * slot i a few levels down are contiguous, they are prefetched while the
+ * levels in between are searched.
+ */
+template<typename T>
+class EytzingerArray {
+    std::vector<T> owned; // Empty if the slots live somewhere else
+    const T* slots;
+    size_t n; // Number of keys, there are n + 1 slots
+
+    // Descendants of slot i at depth log2(PREFETCH_STRIDE) start at slot i * PREFETCH_STRIDE
+    static const size_t PREFETCH_STRIDE = sizeof(T) < 64 ? 64 / sizeof(T) : 1;
+
+    /**
+     * Fill the subtree rooted at slot i by an in-order walk of the implicit tree.
+     *
+     * @param next index of the next sorted key to place
+     */
+    void fill(const std::vector<T>& sorted, size_t& next, size_t i) {
+        if (i >= owned.size()) {
+            return;
+        }
+        fill(sorted, next, 2 * i);
+        owned[i] = sorted[next++];
+        fill(sorted, next, 2 * i + 1);
+    }
+
+public:
+    EytzingerArray(): owned(1), slots(owned.data()), n(0) {}
+
+    explicit EytzingerArray(const std::vector<T>& sorted): owned(sorted.size() + 1), n(sorted.size()) {
+        size_t next = 0;
+        fill(sorted, next, 1);
+        slots = owned.data();
+    }
+
+    /**
+     * Use n + 1 slots laid out by another EytzingerArray, e.g. in a mapped
+     * file, which must outlive this array.
+     */
+    EytzingerArray(const T* _slots, size_t _n): slots(_slots), n(_n) {}
+
+    EytzingerArray(const EytzingerArray& other)=delete;
+    EytzingerArray& operator=(const EytzingerArray& other)=delete;
+
+    size_t size() const {
+        return n;
+    }
+
+    // All n + 1 slots, slot 0 included
+    const T* data() const {
+        return slots;
+    }
+
+    /**
+     * @return slot of the smallest key not smaller than key, 0 if there is none
+     */
+    size_t lower_bound(const T& key) const {
+        size_t i = 1;
+        while (i <= n) {
+            __builtin_prefetch(slots + std::min(i * PREFETCH_STRIDE, n));
+            i = 2 * i + (slots[i] < key);
+        }
+        // i went right after the answer on every level, undo these turns and the last left turn
+        return i >> __builtin_ffsll(static_cast<long long>(~i));
+    }
+
+    bool contains(const T& key) const {
+        size_t i = lower_bound(key);
+        return i != 0 && !(key < slots[i]);
+    }
+};
+
+/**
+ * Read-optimized tree for find-dominated traffic. The key set is the
+ * frozen snapshot, stored sorted and in an EytzingerArray, corrected by
+ * two small LockFreeBSTs: keys added since the snapshot, and snapshot keys
+ * removed since. find() searches the flat array first and only touches a
+ * delta tree when it may hold the key.
+ *
+ * Updates take no lock: an update of a key is one operation on one delta
+ * tree, bracketed by an update_seq_t like the updates of FineGrainedBST.
+ * Multi-key queries validate against it and retry, and after
+ * range_retries failed attempts hold updates back for one read.
+ *
+ * Snapshot and deltas form a generation, swapped by freeze(). freeze()
+ * runs periodically on a background thread, and also on demand. It moves
+ * updates on to fresh deltas under a short gate, then merges the snapshot
+ * with the old deltas, which no longer change, while updates and queries
+ * go on: until the merge is done, the old deltas stay in the generation as
+ * a middle layer. An old generation is freed like gc() frees nodes: new
+ * operations are stopped and operations which pinned it are waited for.
+ */
+template<typename T>
+class FrozenBST : public BST<T> {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are written to and mapped from images as bytes");
+
+    /**
+     * Header of an image file. The snapshot arrays are stored at offsets
+     * from the start of the file, so the image maps at any address.
+     */
+    struct image_header_t {
+        char magic[8];
+        uint64_t key_size;      // sizeof(T) of the writer
+        uint64_t count;         // Number of keys
+        uint64_t sorted_offset; // Keys in ascending order
+        uint64_t layout_offset; // count + 1 Eytzinger slots
+        uint64_t file_size;
+    };
+
+    // Arrays start on cache lines, mmap returns page aligned addresses
+    static const size_t IMAGE_ALIGN = 64;
+
+    struct snapshot_t {
+        std::vector<T> keys;      // Snapshot keys if they are not mapped
+        void* image;              // Mapped image file, nullptr if none
+        size_t image_size;
+        array_view_t<T> sorted;   // Snapshot keys in ascending order
+        EytzingerArray<T> layout; // Snapshot keys for find
+
+        explicit snapshot_t(const std::vector<T>& _keys):
+            keys(_keys), image(nullptr), image_size(0), sorted(keys.data(), keys.size()), layout(keys) {}
+
+        // Snapshot served from a mapped image which it takes over
+        snapshot_t(void* _image, const image_header_t* header):
+            image(_image), image_size(header->file_size),
+            sorted(reinterpret_cast<const T*>(static_cast<const char*>(_image) + header->sorted_offset), header->count),
+            layout(reinterpret_cast<const T*>(static_cast<const char*>(_image) + header->layout_offset), header->count) {}
+
+        ~snapshot_t() {
+            if (image != nullptr) {
+                munmap(image, image_size);
+            }
+        }
+    };
+
+    // Changes to a base key set, which is the snapshot and the deltas below
+    struct delta_t {
+        LockFreeBST<T> added;   // Keys not in the base which were inserted since
+        LockFreeBST<T> removed; // Keys of the base which were erased since
+
+        explicit delta_t(size_t N) {
+            added.set_N(N);
+            removed.set_N(N);
+        }
+
+        bool empty() {
+            return added.size() == 0 && removed.size() == 0;
+        }
+    };
+
+    /**
+     * Snapshot and deltas are shared by the generations of one freeze():
+     * the one which merges frozen into the snapshot, and the one after.
+     */
+    struct gen_t {
+        std::shared_ptr<snapshot_t> snapshot;
+        std::shared_ptr<delta_t> frozen; // Deltas being merged by freeze(), nullptr if none
+        std::shared_ptr<delta_t> delta;  // Updates go here
+
+        gen_t(const std::shared_ptr<snapshot_t>& _snapshot, const std::shared_ptr<delta_t>& _frozen,
+              const std::shared_ptr<delta_t>& _delta):
+            snapshot(_snapshot), frozen(_frozen), delta(_delta) {}
+
+        // Snapshot with empty deltas
+        gen_t(const std::shared_ptr<snapshot_t>& _snapshot, size_t N):
+            snapshot(_snapshot), delta(std::make_shared<delta_t>(N)) {}
+    };
+
+    /**
+     * Write sorted keys as an image to path. The image is written to a
+     * temporary file, synced, and renamed, then the directory is synced,
+     * so after a crash path holds the old image or the whole new one.
+     *
+     * @return true on success; false if the file could not be written or synced
+     */
+    static bool write_image(const std::vector<T>& sorted, const char* path);
+
+    // Sync the directory which holds path, so a rename into it is durable
+    static bool sync_dir(const char* path);
+
+    std::atomic<gen_t*> gen;
+    std::mutex swap_mtx; // Serializes freeze(), clear(), load_mmap() and set_N(), updates do not take it
+    update_seq_t<> useq;
+    int range_retries; // Failed attempts of snapshot_read before it holds updates back
+    static thread_local size_t thread_id; // Local thread id
+
+    /**
+     * Atomic variables and locks for GC purpose
+     */
+    std::atomic<int> rw_count;
+    std::mutex mtx;
+
+    size_t rebuild_ms; // Period of the background freeze(), 0 for none
+    bool stopping;
+    std::mutex rebuild_mtx;
+    std::condition_variable rebuild_cv;
+    std::thread rebuilder;
+
+    /**
+     * Merge a sorted base and its deltas in [lo, hi) in ascending order.
+     *
+     * @param lo inclusive lower bound, nullptr for no bound
+     * @param hi exclusive upper bound, nullptr for no bound
+     * @param visit called on every key in range, the merge stops once it returns false
+     */
+    template<typename F>
+    static void merge_delta(const array_view_t<T>& sorted, delta_t& delta, const T* lo, const T* hi, F visit);
+
+    /**
+     * Merge all layers of g in [lo, hi), see merge_delta. The caller must
+     * read in snapshot_read, or the tree must be quiescent.
+     */
+    template<typename F>
+    static void merged(gen_t* g, const T* lo, const T* hi, F visit);
+
+    // Whether t is in the base of g->delta
+    static bool in_base(gen_t* g, const T& t);
+
+    // Number of keys of g smaller than t, called in snapshot_read
+    static size_t rank_in(gen_t* g, const T& t);
+
+    static bool nearest_in(gen_t* g, const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * Call read on the current generation until no update happened during
+     * it, see FineGrainedBST::snapshot_read. read must reset its output.
+     */
+    template<typename F>
+    void snapshot_read(F read);
+
+    /**
+     * Merge the deltas into a new snapshot, without holding back updates
+     * for the merge.
+     *
+     * @param force also rebuild if nothing changed since the last snapshot
+     */
+    void rebuild(bool force);
+
+    // Make g current once the updates in flight have ended, and free the old generation
+    void swap(gen_t* g);
+
+    // Free a generation which is no longer reachable once no operation uses it
+    void retire(gen_t* old);
+
+    void rebuild_loop();
+
+    // Current generation, kept alive for the caller until unpin()
+    gen_t* pin();
+    void unpin() { rw_count--; }
+
+public:
+    /**
+     * @param _rebuild_ms period of the background freeze() in milliseconds, 0 for none
+     */
+    FrozenBST(size_t _rebuild_ms=100);
+    virtual ~FrozenBST();
+    FrozenBST(FrozenBST& other)=delete;
+    FrozenBST& operator=(const FrozenBST& other)=delete;
+
+    /**
+     * Materialize the current key set into a new snapshot
+     */
+    void freeze() {
+        rebuild(true);
+    }
+
+    /**
+     * Save the current key set as an image file for load_mmap(). The keys
+     * are collected like range_query collects them, updates do not wait
+     * for the write.
+     *
+     * @return true on success; false if the file could not be written
+     */
+    bool save(const char* path);
+
+    /**
+     * Save the keys of any quiescent tree as an image file for load_mmap()
+     */
+    static bool save_tree(BST<T>& tree, const char* path);
+
+    /**
+     * Replace the key set by the one of an image file. The image is
+     * mapped, not read: queries are served from it right away and fault
+     * its pages in as they touch them, and updates go to the deltas as
+     * usual. The next freeze() copies the keys into memory and unmaps it.
+     *
+     * @return true on success; false if the file is missing or not an image of T
+     */
+    bool load_mmap(const char* path);
+
+    virtual bool insert(const T& t);
+    virtual void erase(const T& t);
+    virtual bool find(const T& t);
+    virtual size_t size();
+    virtual void clear();
+
+    /**
+     * Shape of the implicit tree of the snapshot, deltas are not included
+     */
+    virtual shape_stats_t shape_stats();
+    virtual void set_N(size_t _N);
+    virtual void register_thread(size_t tid);
+
+    // Failed attempts of a snapshot read before it holds updates back, RANGE_RETRIES by default
+    void set_range_retries(int retries) { range_retries = retries; }
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * rank and range_count take O(log n) plus the deltas. select merges
+     * keys up to the k-th one.
+     */
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+
+    /**
+     * Snapshot keys in the range are recorded as removed one by one, the
+     * next freeze() drops them. Like in FineGrainedBST, updates of keys in
+     * the range which run alongside may or may not survive.
+     */
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+};
+
+template<typename T>
+thread_local size_t FrozenBST<T>::thread_id;
+
+template<typename T>
+FrozenBST<T>::FrozenBST(size_t _rebuild_ms):
+    gen(new gen_t(std::make_shared<snapshot_t>(std::vector<T>()), 0)), range_retries(RANGE_RETRIES),
+    rw_count(0), rebuild_ms(_rebuild_ms), stopping(false) {
+    if (rebuild_ms > 0) {
+        rebuilder = std::thread([this]() {
+            rebuild_loop();
+        });
+    }
+}
+
+template<typename T>
+FrozenBST<T>::~FrozenBST() {
+    {
+        std::lock_guard<std::mutex> lock(rebuild_mtx);
+        stopping = true;
+    }
+    rebuild_cv.notify_all();
+    if (rebuilder.joinable()) {
+        rebuilder.join();
+    }
+    delete gen.load();
+}
+
+template<typename T>
+void FrozenBST<T>::rebuild_loop() {
+    std::unique_lock<std::mutex> lock(rebuild_mtx);
+    while (!stopping) {
+        rebuild_cv.wait_for(lock, std::chrono::milliseconds(rebuild_ms));
+        if (stopping) {
+            break;
+        }
+        lock.unlock();
+        rebuild(false);
+        lock.lock();
+    }
+}
+
+template<typename T>
+typename FrozenBST<T>::gen_t* FrozenBST<T>::pin() {
+    {
+        BST_TRACE_SCOPE("gc_barrier");
+        mtx.lock();
+        mtx.unlock();
+    }
+    rw_count++;
+    return gen.load();
+}
+
+template<typename T>
+template<typename F>
+void FrozenBST<T>::merge_delta(const array_view_t<T>& sorted, delta_t& delta, const T* lo, const T* hi, F visit) {
+    // Not walk_range, updates run alongside
+    std::vector<T> added;
+    std::vector<T> removed;
+    delta.added.range_keys(lo, hi, added);
+    delta.removed.range_keys(lo, hi, removed);
+    size_t i = lo == nullptr ? 0 : std::lower_bound(sorted.begin(), sorted.end(), *lo) - sorted.begin();
+    size_t end = hi == nullptr ? sorted.size() : std::lower_bound(sorted.begin(), sorted.end(), *hi) - sorted.begin();
+    size_t a = 0;
+    size_t r = 0;
+    while (i < end || a < added.size()) {
+        // Removed keys are a subset of the base, added keys are disjoint from it
+        if (i < end && r < removed.size() && !(removed[r] < sorted[i])) {
+            if (!(sorted[i] < removed[r])) {
+                i++;
+                r++;
+                continue;
+            }
+        }
+        bool from_base = a == added.size() || (i < end && sorted[i] < added[a]);
+        if (!visit(from_base ? sorted[i++] : added[a++])) {
+            return;
+        }
+    }
+}
+
+template<typename T>
+template<typename F>
+void FrozenBST<T>::merged(gen_t* g, const T* lo, const T* hi, F visit) {
+    if (g->frozen == nullptr) {
+        merge_delta(g->snapshot->sorted, *g->delta, lo, hi, visit);
+        return;
+    }
+    // freeze() is merging the frozen deltas, merge the range of them first
+    std::vector<T> base;
+    merge_delta(g->snapshot->sorted, *g->frozen, lo, hi, [&base](const T& key) {
+        base.push_back(key);
+        return true;
+    });
+    merge_delta(array_view_t<T>(base.data(), base.size()), *g->delta, lo, hi, visit);
+}
+
+template<typename T>
+template<typename F>
+void FrozenBST<T>::snapshot_read(F read) {
+    pin();
+    for (int attempt = 0; attempt < range_retries; attempt++) {
+        size_t version;
+        if (useq.wait_stable(version)) {
+            read(gen.load());
+            if (useq.validate(version)) {
+                unpin();
+                return;
+            }
+        }
+        BST_STAT_INC(SR_Retry);
+    }
+    // Too many conflicts, hold updates back for one read
+    useq.exclusive([&]() {
+        read(gen.load());
+    });
+    unpin();
+}
+
+template<typename T>
+void FrozenBST<T>::rebuild(bool force) {
+    BST_TRACE_SCOPE("freeze");
+    std::lock_guard<std::mutex> lock(swap_mtx);
+    gen_t* old = gen.load();
+    if (!force && old->delta->empty()) {
+        return;
+    }
+    // Updates move on to fresh deltas, the current ones freeze
+    gen_t* merging = new gen_t(old->snapshot, old->delta, std::make_shared<delta_t>(BST<T>::N));
+    swap(merging);
+    std::vector<T> keys;
+    keys.reserve(merging->snapshot->sorted.size() + merging->frozen->added.size());
+    merge_delta(merging->snapshot->sorted, *merging->frozen, nullptr, nullptr, [&keys](const T& key) {
+        keys.push_back(key);
+        return true;
+    });
+    // The new snapshot holds the keys of the old one and the frozen deltas,
+    // which is the base of the current deltas, so they carry over
+    gen.store(new gen_t(std::make_shared<snapshot_t>(keys), nullptr, merging->delta));
+    retire(merging);
+}
+
+template<typename T>
+void FrozenBST<T>::swap(gen_t* g) {
+    gen_t* old = gen.load();
+    useq.exclusive([&]() {
+        gen.store(g);
+    });
+    retire(old);
+}
+
+template<typename T>
+void FrozenBST<T>::retire(gen_t* old) {
+    mtx.lock();
+    {
+        BST_TRACE_SCOPE("gc_wait");
+        while (rw_count > 0);
+    }
+    mtx.unlock();
+    delete old;
+}
+
+template<typename T>
+bool FrozenBST<T>::in_base(gen_t* g, const T& t) {
+    delta_t* frozen = g->frozen.get();
+    if (g->snapshot->layout.contains(t)) {
+        return frozen == nullptr || frozen->removed.size() == 0 || !frozen->removed.find(t);
+    }
+    return frozen != nullptr && frozen->added.size() != 0 && frozen->added.find(t);
+}
+
+template<typename T>
+bool FrozenBST<T>::insert(const T& t) {
+    BST_TRACE_SCOPE("insert");
+    pin();
+    // The generation is loaded in the bracket, so freeze() cannot freeze its deltas under the update
+    useq.begin(thread_id);
+    gen_t* g = gen.load();
+    bool result = in_base(g, t) ? g->delta->removed.remove(t) : g->delta->added.insert(t);
+    useq.end(thread_id);
+    unpin();
+    return result;
+}
+
+template<typename T>
+void FrozenBST<T>::erase(const T& t) {
+    BST_TRACE_SCOPE("erase");
+    pin();
+    useq.begin(thread_id);
+    gen_t* g = gen.load();
+    if (in_base(g, t)) {
+        g->delta->removed.insert(t);
+    } else {
+        g->delta->added.erase(t);
+    }
+    useq.end(thread_id);
+    unpin();
+}
+
+template<typename T>
+bool FrozenBST<T>::find(const T& t) {
+    BST_TRACE_SCOPE("find");
+    gen_t* g = pin();
+    delta_t& delta = *g->delta;
+    bool result;
+    if (in_base(g, t)) {
+        result = delta.removed.size() == 0 || !delta.removed.find(t);
+    } else {
+        result = delta.added.size() != 0 && delta.added.find(t);
+    }
+    unpin();
+    return result;
+}
+
+template<typename T>
+size_t FrozenBST<T>::size() {
+    gen_t* g = pin();
+    size_t result = g->snapshot->sorted.size();
+    if (g->frozen != nullptr) {
+        result = result - g->frozen->removed.size() + g->frozen->added.size();
+    }
+    result = result - g->delta->removed.size() + g->delta->added.size();
+    unpin();
+    return result;
+}
+
+template<typename T>
+void FrozenBST<T>::clear() {
+    std::lock_guard<std::mutex> lock(swap_mtx);
+    swap(new gen_t(std::make_shared<snapshot_t>(std::vector<T>()), BST<T>::N));
+}
+
+template<typename T>
+shape_stats_t FrozenBST<T>::shape_stats() {
+    shape_stats_t stats;
+    size_t n = pin()->snapshot->sorted.size();
+    unpin();
+    for (size_t i = 1; i <= n; i++) {
+        size_t depth = 0;
+        for (size_t parent = i; parent > 1; parent /= 2) {
+            depth++;
+        }
+        stats.visit(depth, 2 * i > n, true);
+    }
+    return stats;
+}
+
+template<typename T>
+void FrozenBST<T>::set_N(size_t _N) {
+    BST<T>::set_N(_N);
+    std::lock_guard<std::mutex> lock(swap_mtx);
+    gen_t* g = gen.load();
+    g->delta->added.set_N(_N);
+    g->delta->removed.set_N(_N);
+}
+
+template<typename T>
+void FrozenBST<T>::register_thread(size_t tid) {
+    thread_id = tid;
+    // Thread ids of the delta trees are shared by all LockFreeBSTs, later deltas see them too
+    gen_t* g = pin();
+    g->delta->added.register_thread(tid);
+    g->delta->removed.register_thread(tid);
+    unpin();
+}
+
+template<typename T>
+void FrozenBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    BST_TRACE_SCOPE("range_query");
+    snapshot_read([&](gen_t* g) {
+        out.clear();
+        merged(g, &lo, &hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+}
+
+template<typename T>
+bool FrozenBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    BST_TRACE_SCOPE("nearest");
+    bool found = false;
+    snapshot_read([&](gen_t* g) {
+        found = nearest_in(g, t, bounded, inclusive, ascending, result);
+    });
+    return found;
+}
+
+template<typename T>
+bool FrozenBST<T>::nearest_in(gen_t* g, const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    const array_view_t<T>& sorted = g->snapshot->sorted;
+    delta_t* frozen = g->frozen.get();
+    LockFreeBST<T>& removed = g->delta->removed;
+    // Snapshot keys are gone if a layer removed them
+    auto gone = [&](const T& key) {
+        return (frozen != nullptr && frozen->removed.size() != 0 && frozen->removed.find(key))
+            || (removed.size() != 0 && removed.find(key));
+    };
+    bool found = false;
+    // Closest snapshot key within the bound which is not gone
+    if (ascending) {
+        size_t i = 0;
+        if (bounded) {
+            i = (inclusive ? std::lower_bound(sorted.begin(), sorted.end(), t)
+                : std::upper_bound(sorted.begin(), sorted.end(), t)) - sorted.begin();
+        }
+        while (i < sorted.size() && gone(sorted[i])) {
+            i++;
+        }
+        if (i < sorted.size()) {
+            result = sorted[i];
+            found = true;
+        }
+    } else {
+        size_t i = sorted.size();
+        if (bounded) {
+            i = (inclusive ? std::upper_bound(sorted.begin(), sorted.end(), t)
+                : std::lower_bound(sorted.begin(), sorted.end(), t)) - sorted.begin();
+        }
+        while (i > 0 && gone(sorted[i - 1])) {
+            i--;
+        }
+        if (i > 0) {
+            result = sorted[i - 1];
+            found = true;
+        }
+    }
+    auto offer = [&](const T& key) {
+        if (!found || (ascending ? key < result : result < key)) {
+            result = key;
+        }
+        found = true;
+    };
+    T added;
+    if (frozen != nullptr && frozen->added.nearest(t, bounded, inclusive, ascending, added)) {
+        // Keys the frozen deltas added may be removed again
+        bool kept = true;
+        while (removed.size() != 0 && removed.find(added)) {
+            T from = added;
+            if (!frozen->added.nearest(from, true, false, ascending, added)) {
+                kept = false;
+                break;
+            }
+        }
+        if (kept) {
+            offer(added);
+        }
+    }
+    if (g->delta->added.nearest(t, bounded, inclusive, ascending, added)) {
+        offer(added);
+    }
+    return found;
+}
+
+template<typename T>
+size_t FrozenBST<T>::rank(const T& t) {
+    BST_TRACE_SCOPE("rank");
+    size_t result = 0;
+    snapshot_read([&](gen_t* g) {
+        result = rank_in(g, t);
+    });
+    return result;
+}
+
+template<typename T>
+size_t FrozenBST<T>::rank_in(gen_t* g, const T& t) {
+    const array_view_t<T>& sorted = g->snapshot->sorted;
+    size_t rank = std::lower_bound(sorted.begin(), sorted.end(), t) - sorted.begin();
+    // Removed keys are in the layers below, added keys are not
+    if (g->frozen != nullptr) {
+        rank = rank - g->frozen->removed.rank(t) + g->frozen->added.rank(t);
+    }
+    return rank - g->delta->removed.rank(t) + g->delta->added.rank(t);
+}
+
+template<typename T>
+bool FrozenBST<T>::select(size_t k, T& result) {
+    BST_TRACE_SCOPE("select");
+    bool found = false;
+    snapshot_read([&](gen_t* g) {
+        size_t left = k;
+        found = false;
+        merged(g, nullptr, nullptr, [&](const T& key) {
+            if (left == 0) {
+                result = key;
+                found = true;
+                return false;
+            }
+            left--;
+            return true;
+        });
+    });
+    return found;
+}
+
+template<typename T>
+size_t FrozenBST<T>::range_count(const T& lo, const T& hi) {
+    if (!(lo < hi)) {
+        return 0;
+    }
+    BST_TRACE_SCOPE("range_count");
+    // Both ranks in one read, an update between them would shift only one
+    size_t result = 0;
+    snapshot_read([&](gen_t* g) {
+        result = rank_in(g, hi) - rank_in(g, lo);
+    });
+    return result;
+}
+
+template<typename T>
+size_t FrozenBST<T>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    pin();
+    // One long update, queries which overlap it retry
+    useq.begin(thread_id);
+    gen_t* g = gen.load();
+    delta_t& delta = *g->delta;
+    size_t removed = delta.added.erase_range(lo, hi);
+    auto remove = [&](const T& key) {
+        if (delta.removed.insert(key)) {
+            removed++;
+        }
+        return true;
+    };
+    if (g->frozen == nullptr) {
+        const array_view_t<T>& sorted = g->snapshot->sorted;
+        size_t i = std::lower_bound(sorted.begin(), sorted.end(), lo) - sorted.begin();
+        for (; i < sorted.size() && sorted[i] < hi; i++) {
+            remove(sorted[i]);
+        }
+    } else {
+        merge_delta(g->snapshot->sorted, *g->frozen, &lo, &hi, remove);
+    }
+    useq.end(thread_id);
+    unpin();
+    return removed;
+}
+
+template<typename T>
+void FrozenBST<T>::split_keys(size_t count, std::vector<T>& keys) {
+    keys.clear();
+    gen_t* g = pin();
+    const array_view_t<T>& sorted = g->snapshot->sorted;
+    // Evenly spaced snapshot keys, walk_range also covers the deltas
+    for (size_t i = 1; i <= count && i * sorted.size() / (count + 1) < sorted.size(); i++) {
+        size_t index = i * sorted.size() / (count + 1);
+        if (keys.empty() || keys.back() < sorted[index]) {
+            keys.push_back(sorted[index]);
+        }
+    }
+    unpin();
+}
+
+template<typename T>
+void FrozenBST<T>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    // Pinned, so a background freeze() cannot free the generation during the walk
+    merged(pin(), lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
+    unpin();
+}
+
+template<typename T>
+bool FrozenBST<T>::write_image(const std::vector<T>& sorted, const char* path) {
+    BST_TRACE_SCOPE("save");
+    EytzingerArray<T> layout(sorted);
+    image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BSTIMG1", 8);
+    header.key_size = sizeof(T);
+    header.count = sorted.size();
+    size_t sorted_bytes = sorted.size() * sizeof(T);
+    size_t layout_bytes = (sorted.size() + 1) * sizeof(T);
+    header.sorted_offset = (sizeof(header) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    header.layout_offset = (header.sorted_offset + sorted_bytes + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    header.file_size = header.layout_offset + layout_bytes;
+
+    std::string tmp = std::string(path) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    static const char zeros[IMAGE_ALIGN] = {0};
+    bool ok = write_all(fd, &header, sizeof(header))
+        && write_all(fd, zeros, header.sorted_offset - sizeof(header))
+        && write_all(fd, sorted.data(), sorted_bytes)
+        && write_all(fd, zeros, header.layout_offset - header.sorted_offset - sorted_bytes)
+        && write_all(fd, layout.data(), layout_bytes);
+    // The data must be on disk before the rename can expose it
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return sync_dir(path);
+}
+
+template<typename T>
+bool FrozenBST<T>::sync_dir(const char* path) {
+    std::string dir(path);
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+
+template<typename T>
+bool FrozenBST<T>::save(const char* path) {
+    std::vector<T> keys;
+    snapshot_read([&keys](gen_t* g) {
+        keys.clear();
+        merged(g, nullptr, nullptr, [&keys](const T& key) {
+            keys.push_back(key);
+            return true;
+        });
+    });
+    return write_image(keys, path);
+}
+
+template<typename T>
+bool FrozenBST<T>::save_tree(BST<T>& tree, const char* path) {
+    std::vector<T> keys;
+    keys.reserve(tree.size());
+    tree.walk_range(nullptr, nullptr, [&keys](const T& key) {
+        keys.push_back(key);
+    });
+    return write_image(keys, path);
+}
+
+template<typename T>
+bool FrozenBST<T>::load_mmap(const char* path) {
+    BST_TRACE_SCOPE("load_mmap");
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(image_header_t)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* image = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    close(fd);
+    if (image == MAP_FAILED) {
+        return false;
+    }
+    const image_header_t* header = static_cast<const image_header_t*>(image);
+    bool valid = memcmp(header->magic, "BSTIMG1", 8) == 0
+        && header->key_size == sizeof(T)
+        && header->file_size == size
+        && header->sorted_offset % IMAGE_ALIGN == 0
+        && header->layout_offset % IMAGE_ALIGN == 0
+        && header->sorted_offset + header->count * sizeof(T) <= header->layout_offset
+        && header->layout_offset + (header->count + 1) * sizeof(T) <= size;
+    if (!valid) {
+        munmap(image, size);
+        return false;
+    }
+    // Start reading the image ahead, without waiting for it
+    madvise(image, size, MADV_WILLNEED);
+    std::lock_guard<std::mutex> lock(swap_mtx);
+    swap(new gen_t(std::make_shared<snapshot_t>(image, header), BST<T>::N));
+    return true;
+}
+
+#endif
@@ -1,4 +1,11 @@
 #include "bst.h"
+#include "frozen_bst.h"
+#include "elimination.h"
+#include "adaptive_bst.h"
+#include "persistent_bst.h"
+#include "shared_bst.h"
+#include "op_trace.h"
+#include "perf_counters.h"
 #include <iostream>
 #include <cassert>
 #include <vector>
@@ -8,6 +15,10 @@
 #include <chrono>
 #include <getopt.h>
 #include <numeric>
+#include <algorithm>
+#include <set>
+#include <iterator>
+#include <sys/wait.h>
 
 /********************************
  * Macros for testing correctness
@@ -17,9 +28,29 @@
 //#define TEST_CORRECTNESS
 #define TEST_PARALLEL
 #define TEST_ERASE
+#define TEST_RANGE
+#define TEST_ORDER
+#define TEST_POP
+#define TEST_RANK
+#define TEST_ERASE_RANGE
+#define TEST_SET_ALGEBRA
+#define TEST_PARALLEL_WALK
+#define TEST_FIND_MANY
+#define TEST_FREEZE
+#define TEST_FINGER
+#define TEST_ELIMINATION
+#define TEST_CONTENTION
+#define TEST_ADAPTIVE
+#define TEST_READ_MODE
+#define TEST_SNAPSHOT
+#define TEST_IMAGE
+#define TEST_EXPORT
+#define TEST_SHARED
+#define TEST_COMPACT
+#define TEST_TRACE
 
 enum class State {
-    Correctness_Test=0, Load_Test=1, Unknown=2
+    Correctness_Test=0, Load_Test=1, Replay_Test=2, Unknown=3
 };
 
 enum class Pattern {
@@ -29,22 +60,111 @@ enum class Pattern {
 static State state = State::Unknown;
 static Pattern pattern = Pattern::Unknown;
 
-static BST<int>* bst_ptrs[3];
+static BST<int>* bst_ptrs[8];
 static size_t bst_selection = 0;
 static std::mutex mtx;
 static size_t TEST_SIZE = 10000;
 static size_t THREAD_NUM = 2;
+static bool PERF_ENABLED = false;
+static bool RECLAIM_PRINT = false;
+static size_t RETIRE_THRESHOLD = 0; // 0 keeps the default of the tree
+static bool SHAPE_PRINT = false;
+static bool AUGMENTED = false; // Maintain subtree counts in CoarseGrainedBST
+static size_t FIND_BATCH = 0; // Keys per find_many call in the Find pattern, 0 uses find
+static bool FINGERS = false; // Start find and insert at the last position of the thread
+static size_t ELIMINATION_WIDTH = 0; // Slots of the elimination array in front of the tree, 0 for none
+static ContentionWait CONTENTION_WAIT = ContentionWait::Unknown; // Unknown keeps the default of the lock-free trees
+static int LOCAL_RESTART = -1; // Whether LockFree retries seek from the ancestor, -1 keeps the default
+static ReadMode READ_MODE = ReadMode::Unknown; // Unknown keeps the default of CoarseGrained
+static std::string RECORD_PATH; // Trace file the operations of the run are recorded to, empty for none
+static std::string REPLAY_PATH; // Trace file which is replayed
+static bool REPLAY_PACED = false; // Replay at the recorded pace instead of as fast as possible
+static std::vector<PerfCounters::Reading> perf_readings;
+
+/**
+ * Counts performance events of the current thread while it is alive.
+ * The reading is stored to the slot of the thread on destruction.
+ */
+class PerfScope {
+    PerfCounters counters;
+    size_t thread_id;
+    bool enabled;
+public:
+    PerfScope(size_t _thread_id): thread_id(_thread_id), enabled(PERF_ENABLED) {
+        if (enabled) {
+            counters.open();
+            counters.start();
+        }
+    }
+
+    ~PerfScope() {
+        if (enabled) {
+            counters.stop();
+            perf_readings[thread_id] = counters.read();
+        }
+    }
+};
+
+/**
+ * Node slots of a SharedBST or CompactBST: two nodes per key of every
+ * test, and the retire lists, where every thread holds up to R nodes
+ * and the two of its last erase before gc() frees them.
+ */
+size_t arena_capacity(size_t R) {
+    return 8 * TEST_SIZE + THREAD_NUM * (R + 2) + (1 << 16);
+}
 
 void init_bsts() {
-    bst_ptrs[0] = new CoarseGrainedBST<int>();
+    bst_ptrs[0] = new CoarseGrainedBST<int>(AUGMENTED);
     bst_ptrs[1] = new FineGrainedBST<int>();
     bst_ptrs[2] = new LockFreeBST<int>();
+    bst_ptrs[3] = new FrozenBST<int>();
+    bst_ptrs[4] = new AdaptiveBST<int>();
+    bst_ptrs[5] = new PersistentBST<int>();
+    // Arenas are only mapped for the selected tree, the others run without /dev/shm
+    if (bst_selection == 6) {
+        SharedBST<int>* shared = new SharedBST<int>();
+        size_t R = RETIRE_THRESHOLD > 0 ? RETIRE_THRESHOLD : shared->get_R();
+        std::string name = "/bst_shared_" + std::to_string(getpid());
+        SharedBST<int>::unlink(name.c_str());
+        if (!shared->attach(name.c_str(), arena_capacity(R))) {
+            printf("cannot create shared memory tree %s\n", name.c_str());
+            exit(1);
+        }
+        // The mapping stays, the name is not needed by anyone else
+        SharedBST<int>::unlink(name.c_str());
+        bst_ptrs[6] = shared;
+    }
+    if (bst_selection == 7) {
+        CompactBST<int>* compact = new CompactBST<int>();
+        size_t R = RETIRE_THRESHOLD > 0 ? RETIRE_THRESHOLD : compact->get_R();
+        if (!compact->attach(nullptr, arena_capacity(R))) {
+            printf("cannot map node arena\n");
+            exit(1);
+        }
+        bst_ptrs[7] = compact;
+    }
+}
+
+// Tell if inserts of an arena tree threw because the arena ran full
+template<typename Tree>
+void report_arena(BST<int>* bst) {
+    Tree* tree = dynamic_cast<Tree*>(bst);
+    if (tree != nullptr && tree->failed_allocations() > 0) {
+        printf("node arena of %lu slots ran full, %lu node allocations failed\n",
+            tree->capacity(), tree->failed_allocations());
+    }
 }
 
 void free_bsts() {
     delete bst_ptrs[0];
     delete bst_ptrs[1];
     delete bst_ptrs[2];
+    delete bst_ptrs[3];
+    delete bst_ptrs[4];
+    delete bst_ptrs[5];
+    delete bst_ptrs[6];
+    delete bst_ptrs[7];
 }
 
 /**
@@ -76,10 +196,95 @@ void test_single_thread(BST<int>& bst) {
     }
     assert(bst.find(INT_MIN) == false);
     assert(bst.find(INT_MAX) == false);
+    #ifdef TEST_RANGE
+    std::vector<int> expected;
+    for (int test : unique_elements) {
+        if (test >= RAND_RANGE / 4 && test < RAND_RANGE / 2) {
+            expected.push_back(test);
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+    std::vector<int> keys;
+    bst.range_query(RAND_RANGE / 4, RAND_RANGE / 2, keys);
+    assert(keys == expected);
+    #endif
+    #ifdef TEST_ORDER
+    std::set<int> ordered(elements.begin(), elements.end());
+    int key;
+    assert(bst.min(key) && key == *ordered.begin());
+    assert(bst.max(key) && key == *ordered.rbegin());
+    for (int test = -1; test <= RAND_RANGE; test++) {
+        std::set<int>::iterator it = ordered.lower_bound(test);
+        assert(bst.lower_bound(test, key) == (it != ordered.end()));
+        assert(it == ordered.end() || key == *it);
+        it = ordered.upper_bound(test);
+        assert(bst.successor(test, key) == (it != ordered.end()));
+        assert(it == ordered.end() || key == *it);
+        it = ordered.lower_bound(test);
+        assert(bst.predecessor(test, key) == (it != ordered.begin()));
+        assert(it == ordered.begin() || key == *(--it));
+    }
+    #endif
+    #ifdef TEST_RANK
+    std::vector<int> sorted(unique_elements.begin(), unique_elements.end());
+    std::sort(sorted.begin(), sorted.end());
+    for (int test = -1; test <= RAND_RANGE; test++) {
+        size_t rank = std::lower_bound(sorted.begin(), sorted.end(), test) - sorted.begin();
+        assert(bst.rank(test) == rank);
+        assert(bst.range_count(test, test + RAND_RANGE / 10) ==
+            std::lower_bound(sorted.begin(), sorted.end(), test + RAND_RANGE / 10) - sorted.begin() - rank);
+    }
+    for (size_t k = 0; k <= sorted.size(); k++) {
+        int key;
+        assert(bst.select(k, key) == (k < sorted.size()));
+        assert(k == sorted.size() || key == sorted[k]);
+    }
+    #endif
+    #ifdef TEST_ERASE_RANGE
+    for (int width : { 1, RAND_RANGE / 10, RAND_RANGE / 2, RAND_RANGE + 2 }) {
+        int lo = rand() % RAND_RANGE - 1;
+        int hi = lo + width;
+        std::vector<int> inside;
+        for (int test : unique_elements) {
+            if (test >= lo && test < hi) {
+                inside.push_back(test);
+            }
+        }
+        std::sort(inside.begin(), inside.end());
+        assert(bst.erase_range(lo, hi) == inside.size());
+        assert(bst.size() == unique_elements.size() - inside.size());
+        for (int test : unique_elements) {
+            assert(bst.find(test) == (test < lo || test >= hi));
+        }
+        #ifdef TEST_RANK
+        // Subtree counts must survive the detachment
+        std::vector<int> outside;
+        std::set_difference(sorted.begin(), sorted.end(), inside.begin(), inside.end(), std::back_inserter(outside));
+        int key;
+        for (size_t k = 0; k < outside.size(); k++) {
+            assert(bst.select(k, key) && key == outside[k]);
+        }
+        #endif
+        for (int test : inside) {
+            bst.insert(test);
+        }
+    }
+    #endif
     #ifdef TEST_ERASE
-    for (int test : elements) {
-        bst.erase(test);
-        assert(bst.find(test) == false);
+    for (size_t i = 0; i < elements.size(); i++) {
+        bst.erase(elements[i]);
+        assert(bst.find(elements[i]) == false);
+        #ifdef TEST_RANK
+        // Counts must survive removals of nodes with two children
+        sorted.erase(std::remove(sorted.begin(), sorted.end(), elements[i]), sorted.end());
+        if (i % 64 == 0) {
+            int key;
+            for (size_t k = 0; k < sorted.size(); k += 16) {
+                assert(bst.select(k, key) && key == sorted[k]);
+                assert(bst.rank(sorted[k]) == k);
+            }
+        }
+        #endif
     }
     assert(bst.size() == 0);
     #endif
@@ -118,6 +323,36 @@ void test_multi_thread(BST<int>& bst) {
             for (int test : elements) {
                 assert(bst.find(test) == true);
             }
+            #ifdef TEST_RANGE
+            // Other threads never touch keys of this thread
+            std::vector<int> keys;
+            bst.range_query(start, end, keys);
+            assert(keys == std::vector<int>(elements.begin(), elements.begin() + (end - start)));
+            #endif
+            #ifdef TEST_ORDER
+            for (size_t i = start; i + 1 < end; i++) {
+                int key;
+                assert(bst.successor(i, key) && key == static_cast<int>(i + 1));
+                assert(bst.predecessor(i + 1, key) && key == static_cast<int>(i));
+            }
+            #endif
+            #ifdef TEST_RANK
+            assert(bst.range_count(start, end) == end - start);
+            #endif
+            #ifdef TEST_FIND_MANY
+            // Keys of this thread interleaved with keys nobody inserts
+            std::vector<int> batch;
+            for (size_t i = start; i < end; i++) {
+                batch.push_back(i);
+                batch.push_back(i + TEST_SIZE);
+            }
+            std::vector<bool> found;
+            bst.find_many(batch, found);
+            assert(found.size() == batch.size());
+            for (size_t i = 0; i < batch.size(); i++) {
+                assert(found[i] == (i % 2 == 0));
+            }
+            #endif
             #ifdef TEST_ERASE
             for (int test : elements) {
                 bst.erase(test);
@@ -125,6 +360,23 @@ void test_multi_thread(BST<int>& bst) {
             for (int test : elements) {
                 assert(bst.find(test) == false);
             }
+            #ifdef TEST_RANGE
+            bst.range_query(start, end, keys);
+            assert(keys.empty());
+            #endif
+            #ifdef TEST_RANK
+            assert(bst.range_count(start, end) == 0);
+            #endif
+            #endif
+            #ifdef TEST_ERASE_RANGE
+            for (size_t i = start; i < end; i++) {
+                bst.insert(i);
+            }
+            assert(bst.erase_range(start, end) == end - start);
+            assert(bst.erase_range(start, end) == 0);
+            for (size_t i = start; i < end; i++) {
+                assert(bst.find(i) == false);
+            }
             #endif
         }, thread_id);
     }
@@ -134,6 +386,1085 @@ void test_multi_thread(BST<int>& bst) {
     printf("test parallel passed\n");
 }
 
+/**
+ * Test concurrent pop_min/pop_max: every key is popped exactly once, and
+ * without spraying each thread sees its keys in order.
+ */
+void test_pop(LockFreeBST<int>& bst, size_t spray) {
+    bst.set_N(THREAD_NUM);
+    bst.set_pop_spray(spray);
+    std::vector<std::thread> threads(THREAD_NUM);
+    std::vector<std::vector<int>> popped(THREAD_NUM);
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&bst](size_t thread_id) {
+            bst.register_thread(thread_id);
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                bst.insert(i);
+            }
+        }, thread_id);
+    }
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id].join();
+    }
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&bst, &popped, spray](size_t thread_id) {
+            bst.register_thread(thread_id);
+            bool from_min = thread_id % 2 == 0;
+            int key;
+            while (from_min ? bst.pop_min(key) : bst.pop_max(key)) {
+                if (spray == 1 && !popped[thread_id].empty()) {
+                    assert(from_min ? popped[thread_id].back() < key : popped[thread_id].back() > key);
+                }
+                popped[thread_id].push_back(key);
+            }
+        }, thread_id);
+    }
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id].join();
+    }
+    std::vector<int> all;
+    for (const std::vector<int>& keys : popped) {
+        all.insert(all.end(), keys.begin(), keys.end());
+    }
+    std::sort(all.begin(), all.end());
+    assert(all.size() == TEST_SIZE);
+    for (size_t i = 0; i < all.size(); i++) {
+        assert(all[i] == static_cast<int>(i));
+    }
+    assert(bst.size() == 0);
+    printf("test pop passed\n");
+}
+
+/**
+ * Test pop_min racing with inserts below the current minimum. Inserters
+ * publish the last key they inserted, and the single popper checks that
+ * no key it pops is larger than a published key it has not popped yet.
+ */
+void test_pop_race(LockFreeBST<int>& bst) {
+    const size_t inserters = THREAD_NUM > 1 ? THREAD_NUM - 1 : 1;
+    const int base = static_cast<int>(TEST_SIZE);
+    bst.set_N(inserters + 1);
+    bst.set_pop_spray(1);
+    bst.register_thread(inserters);
+    for (int key = base; key < 2 * base; key++) {
+        bst.insert(key);
+    }
+    std::vector<std::atomic<int>> marks(inserters);
+    for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+        marks[thread_id] = INT_MAX;
+    }
+    std::vector<std::thread> threads(inserters);
+    for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+        threads[thread_id] = std::thread([&bst, &marks, base, inserters](size_t thread_id) {
+            bst.register_thread(thread_id);
+            for (int key = base - 1 - static_cast<int>(thread_id); key >= 0; key -= static_cast<int>(inserters)) {
+                bst.insert(key);
+                marks[thread_id] = key;
+            }
+        }, thread_id);
+    }
+    std::vector<bool> popped(2 * TEST_SIZE, false);
+    size_t count = 0;
+    while (count < 2 * TEST_SIZE) {
+        std::vector<int> seen(inserters);
+        for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+            seen[thread_id] = marks[thread_id];
+        }
+        int key;
+        if (!bst.pop_min(key)) {
+            continue;
+        }
+        assert(!popped[key]);
+        for (int mark : seen) {
+            assert(mark == INT_MAX || popped[mark] || key <= mark);
+        }
+        popped[key] = true;
+        count++;
+    }
+    for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+        threads[thread_id].join();
+    }
+    assert(bst.size() == 0);
+    printf("test pop race passed\n");
+}
+
+/**
+ * Test erase_range racing with inserts into the same range. Every key is
+ * inserted or erased once at a time, so the keys inserted minus the keys
+ * erased must be the keys left in the tree.
+ */
+void test_erase_range_race(BST<int>& bst) {
+    const int width = 4096;
+    const size_t inserters = THREAD_NUM > 1 ? THREAD_NUM - 1 : 1;
+    bst.set_N(inserters + 1);
+    bst.register_thread(inserters);
+    std::atomic<size_t> inserted(0);
+    std::atomic<size_t> finished(0);
+    std::vector<std::thread> threads(inserters);
+    for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+        threads[thread_id] = std::thread([&bst, &inserted, &finished, width](size_t thread_id) {
+            bst.register_thread(thread_id);
+            unsigned int seed = static_cast<unsigned int>(thread_id);
+            for (size_t i = 0; i < TEST_SIZE; i++) {
+                if (bst.insert(rand_r(&seed) % width)) {
+                    inserted++;
+                }
+            }
+            finished++;
+        }, thread_id);
+    }
+    size_t erased = 0;
+    unsigned int seed = static_cast<unsigned int>(inserters);
+    while (finished < inserters) {
+        int lo = rand_r(&seed) % width;
+        erased += bst.erase_range(lo, lo + width / 8);
+        std::this_thread::yield();
+    }
+    for (size_t thread_id = 0; thread_id < inserters; thread_id++) {
+        threads[thread_id].join();
+    }
+    std::vector<int> keys;
+    bst.range_query(0, width, keys);
+    assert(bst.size() == inserted - erased && keys.size() == bst.size());
+    assert(bst.erase_range(0, width) == keys.size());
+    for (int key = 0; key < width; key++) {
+        assert(!bst.find(key));
+    }
+    assert(bst.size() == 0);
+    printf("test erase_range race passed\n");
+}
+
+/**
+ * Test parallel union, intersection and difference against std::set_*.
+ * The result tree keeps subtree counts, so select checks them too.
+ */
+void test_set_algebra() {
+    ThreadPool pool(THREAD_NUM);
+    CoarseGrainedBST<int> a;
+    CoarseGrainedBST<int> b;
+    std::set<int> a_keys;
+    std::set<int> b_keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 2);
+        a.insert(key);
+        a_keys.insert(key);
+        key = rand() % static_cast<int>(TEST_SIZE * 2);
+        b.insert(key);
+        b_keys.insert(key);
+    }
+    CoarseGrainedBST<int> result(true);
+    for (int op = 0; op < 3; op++) {
+        std::vector<int> expected;
+        if (op == 0) {
+            result.set_union(a, b, pool);
+            std::set_union(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+        } else if (op == 1) {
+            result.set_intersection(a, b, pool);
+            std::set_intersection(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+        } else {
+            result.set_difference(a, b, pool);
+            std::set_difference(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(), std::back_inserter(expected));
+        }
+        std::vector<int> keys;
+        result.range_query(INT_MIN, INT_MAX, keys);
+        assert(keys == expected);
+        assert(result.size() == expected.size());
+        for (size_t k = 0; k < expected.size(); k += 97) {
+            int key;
+            assert(result.select(k, key) && key == expected[k]);
+        }
+    }
+    // Inputs are left unchanged
+    assert(a.size() == a_keys.size() && b.size() == b_keys.size());
+    result.set_union(a, a, pool);
+    assert(result.size() == a_keys.size());
+    // Sorted inserts give paths as long as the trees, deeper than the call stack allows
+    const int deep = 200000;
+    CoarseGrainedBST<int> evens;
+    CoarseGrainedBST<int> triples;
+    evens.set_fingers(true);
+    triples.set_fingers(true);
+    // One tree after the other, the finger of a thread follows one tree
+    for (int key = 0; key < deep; key += 2) {
+        evens.insert(key);
+    }
+    for (int key = 0; key < deep; key += 3) {
+        triples.insert(key);
+    }
+    size_t sixes = (deep + 5) / 6;
+    result.set_union(evens, triples, pool);
+    assert(result.size() == evens.size() + triples.size() - sixes);
+    result.set_intersection(evens, triples, pool);
+    assert(result.size() == sixes);
+    int key;
+    assert(result.select(sixes - 1, key) && key == (deep - 1) / 6 * 6);
+    result.set_difference(evens, triples, pool);
+    assert(result.size() == evens.size() - sixes);
+    printf("test set algebra passed\n");
+}
+
+/**
+ * Test parallel_for_each and parallel_reduce on a quiescent tree. The
+ * order check folds each range into (first, last, sorted) and combines
+ * ranges in order, so it fails if ranges overlap or come out of order.
+ */
+void test_parallel_walk(BST<int>& bst) {
+    struct order_t {
+        bool empty;
+        bool sorted;
+        int first;
+        int last;
+    };
+    ThreadPool pool(THREAD_NUM);
+    bst.set_N(1);
+    bst.register_thread(0);
+    std::set<int> keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 4) - static_cast<int>(TEST_SIZE);
+        bst.insert(key);
+        keys.insert(key);
+    }
+    std::atomic<size_t> visited(0);
+    std::atomic<long> sum(0);
+    bst.parallel_for_each([&](int key) {
+        visited++;
+        sum += key;
+    }, pool);
+    assert(visited == keys.size());
+    assert(sum == std::accumulate(keys.begin(), keys.end(), 0L));
+    long total = bst.parallel_reduce(0L, [](long acc, long key) {
+        return acc + key;
+    }, pool);
+    assert(total == sum);
+    order_t identity = { true, true, 0, 0 };
+    order_t order = bst.parallel_reduce(identity, [](order_t acc, int key) {
+        order_t next = { false, acc.empty || (acc.sorted && acc.last < key), acc.empty ? key : acc.first, key };
+        return next;
+    }, [](order_t a, order_t b) {
+        if (a.empty || b.empty) {
+            return a.empty ? b : a;
+        }
+        order_t next = { false, a.sorted && b.sorted && a.last < b.first, a.first, b.last };
+        return next;
+    }, pool);
+    assert(order.sorted && order.first == *keys.begin() && order.last == *keys.rbegin());
+    bst.erase_range(INT_MIN, INT_MAX);
+    assert(bst.size() == 0);
+    printf("test parallel walk passed\n");
+}
+
+/**
+ * Test find and insert with fingers. Keys of the threads interleave, so
+ * fingers keep pointing into parts of the tree which other threads
+ * change, and the erases invalidate them.
+ */
+void test_fingers(BST<int>& bst) {
+    bst.set_N(THREAD_NUM);
+    bst.set_fingers(true);
+    std::vector<std::thread> threads(THREAD_NUM);
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&bst](size_t thread_id) {
+            bst.register_thread(thread_id);
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.insert(i) == true);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.find(i) == true);
+                assert(bst.find(i + TEST_SIZE) == false);
+                assert(bst.insert(i) == false);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += 3 * THREAD_NUM) {
+                bst.erase(i);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.find(i) == ((i - thread_id) % (3 * THREAD_NUM) != 0));
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                bst.erase(i);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.find(i) == false);
+            }
+        }, thread_id);
+    }
+    for (size_t i = 0; i < THREAD_NUM; i++) {
+        threads[i].join();
+    }
+    assert(bst.size() == 0);
+    bst.set_fingers(false);
+    printf("test fingers passed\n");
+}
+
+/**
+ * Test erase_range on a tree as deep as it is large. Only trees whose
+ * fingers make sorted inserts cheap run it.
+ */
+void test_deep_erase_range(BST<int>& bst) {
+    const int deep = 200000;
+    bst.set_N(1);
+    bst.register_thread(0);
+    bst.set_fingers(true);
+    for (int key = 0; key < deep; key++) {
+        bst.insert(key);
+    }
+    assert(bst.erase_range(deep / 4, deep / 2) == deep / 4);
+    assert(bst.size() == deep - deep / 4);
+    assert(bst.find(deep / 4 - 1) && !bst.find(deep / 4) && !bst.find(deep / 2 - 1) && bst.find(deep / 2));
+    assert(bst.erase_range(INT_MIN, INT_MAX) == deep - deep / 4);
+    assert(bst.size() == 0);
+    bst.set_fingers(false);
+    printf("test deep erase_range passed\n");
+}
+
+/**
+ * Test the elimination array with pairs of threads which insert and erase
+ * the same few keys at the same time, so that many pairs cancel out. The
+ * tree must stay consistent, and without partners the layer must behave
+ * like the tree itself.
+ */
+void test_elimination(BST<int>& bst) {
+    const int hot_keys = 8;
+    size_t thread_num = THREAD_NUM < 2 ? 2 : THREAD_NUM;
+    const size_t rounds = std::max(TEST_SIZE / hot_keys / thread_num, static_cast<size_t>(1));
+    EliminationBST<int> elimination(bst, 4);
+    elimination.set_N(thread_num);
+    std::vector<std::thread> threads(thread_num);
+    for (size_t thread_id = 0; thread_id < thread_num; thread_id++) {
+        threads[thread_id] = std::thread([&elimination, rounds](size_t thread_id) {
+            elimination.register_thread(thread_id);
+            for (size_t round = 0; round < rounds; round++) {
+                for (int key = 0; key < hot_keys; key++) {
+                    if (thread_id % 2 == 0) {
+                        elimination.insert(key);
+                    } else {
+                        elimination.erase(key);
+                    }
+                }
+            }
+        }, thread_id);
+    }
+    for (size_t i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+    elimination.register_thread(0);
+    std::vector<int> keys;
+    elimination.range_query(0, hot_keys, keys);
+    assert(elimination.size() == keys.size());
+    for (int key = 0; key < hot_keys; key++) {
+        assert(elimination.find(key) == std::binary_search(keys.begin(), keys.end(), key));
+        elimination.erase(key);
+    }
+    for (int key = 0; key < hot_keys; key++) {
+        assert(elimination.insert(key) == true);
+        assert(elimination.insert(key) == false);
+        elimination.erase(key);
+        assert(elimination.find(key) == false);
+    }
+    assert(elimination.size() == 0);
+    printf("test elimination passed\n");
+}
+
+/**
+ * Record every thread inserting its own keys, a phase mark, and every
+ * thread erasing and finding them, then check the streams of the trace
+ * and replay it on the emptied tree, once as fast as possible and once at
+ * the recorded pace. Keys of different threads are disjoint, so every
+ * replay ends with the recorded key set.
+ */
+void test_trace(BST<int>& bst) {
+    std::string path = "/tmp/bst_trace_test_" + std::to_string(getpid());
+    bst.clear();
+    RecordingBST<int> recorder(bst);
+    recorder.set_N(THREAD_NUM);
+    std::vector<std::thread> threads(THREAD_NUM);
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&recorder](size_t thread_id) {
+            recorder.register_thread(thread_id);
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                recorder.insert(static_cast<int>(i));
+            }
+        }, thread_id);
+    }
+    for (size_t i = 0; i < THREAD_NUM; i++) {
+        threads[i].join();
+    }
+    recorder.mark_phase();
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&recorder](size_t thread_id) {
+            recorder.register_thread(thread_id);
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                if (i % 3 == 0) {
+                    recorder.erase(static_cast<int>(i));
+                }
+                recorder.find(static_cast<int>(i));
+            }
+        }, thread_id);
+    }
+    for (size_t i = 0; i < THREAD_NUM; i++) {
+        threads[i].join();
+    }
+    std::vector<int> expected;
+    bst.register_thread(0);
+    bst.range_query(INT_MIN, INT_MAX, expected);
+    assert(recorder.recorded() == 2 * TEST_SIZE + (TEST_SIZE + 2) / 3 + THREAD_NUM);
+    assert(recorder.save(path.c_str()));
+
+    OpTrace<int> trace;
+    assert(trace.open(path.c_str()));
+    assert(trace.threads() == THREAD_NUM && trace.timed());
+    size_t last = 0;
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        const op_record_t<int>* records = trace.records(thread_id);
+        size_t j = 0;
+        for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM, j++) {
+            assert(records[j].op == static_cast<uint8_t>(TraceOp::Insert) && records[j].key == static_cast<int>(i));
+        }
+        assert(records[j].op == static_cast<uint8_t>(TraceOp::Phase));
+        j++;
+        for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+            if (i % 3 == 0) {
+                assert(records[j].op == static_cast<uint8_t>(TraceOp::Erase) && records[j].key == static_cast<int>(i));
+                j++;
+            }
+            assert(records[j].op == static_cast<uint8_t>(TraceOp::Find) && records[j].key == static_cast<int>(i));
+            j++;
+        }
+        assert(j == trace.count(thread_id));
+        for (size_t i = 0; i < j; i++) {
+            assert(records[i].thread == thread_id);
+            assert(i == 0 || trace.time(thread_id, i - 1) <= trace.time(thread_id, i));
+        }
+        if (j > 0) {
+            last = std::max(last, trace.time(thread_id, j - 1));
+        }
+    }
+
+    for (bool paced : {false, true}) {
+        bst.clear();
+        bst.set_N(THREAD_NUM);
+        PhaseBarrier barrier(THREAD_NUM);
+        size_t start = op_trace_now();
+        for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+            threads[thread_id] = std::thread([&bst, &trace, &barrier, paced, start](size_t thread_id) {
+                bst.register_thread(thread_id);
+                trace.replay(bst, thread_id, paced, start, &barrier);
+                // Every insert of every thread came before the first erase
+                assert(barrier.last_opened() != 0);
+            }, thread_id);
+        }
+        for (size_t i = 0; i < THREAD_NUM; i++) {
+            threads[i].join();
+        }
+        assert(!paced || op_trace_now() - start >= last);
+        bst.register_thread(0);
+        std::vector<int> keys;
+        bst.range_query(INT_MIN, INT_MAX, keys);
+        assert(keys == expected);
+    }
+    trace.close();
+
+    // A cut off trace is refused
+    struct stat st;
+    assert(stat(path.c_str(), &st) == 0);
+    assert(truncate(path.c_str(), st.st_size - 1) == 0);
+    assert(!trace.open(path.c_str()));
+    unlink(path.c_str());
+    bst.clear();
+    printf("test trace passed\n");
+}
+
+/**
+ * Test every contention manager with all threads inserting and erasing
+ * the same few keys, where most CAS attempts fail. The tree must stay
+ * consistent under each of them.
+ */
+void test_contention(LockFreeBST<int>& bst) {
+    const int hot_keys = 16;
+    const size_t rounds = std::max(TEST_SIZE / hot_keys / THREAD_NUM, static_cast<size_t>(1));
+    bst.set_N(THREAD_NUM);
+    for (int wait = 0; wait < static_cast<int>(ContentionWait::Unknown); wait++) {
+        for (int restart = 0; restart < 2; restart++) {
+            bst.set_contention_wait(static_cast<ContentionWait>(wait));
+            bst.set_local_restart(restart == 1);
+            std::vector<std::thread> threads(THREAD_NUM);
+            for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+                threads[thread_id] = std::thread([&bst, rounds](size_t thread_id) {
+                    bst.register_thread(thread_id);
+                    for (size_t round = 0; round < rounds; round++) {
+                        for (int key = 0; key < hot_keys; key++) {
+                            if ((thread_id + round) % 2 == 0) {
+                                bst.insert(key);
+                            } else {
+                                bst.erase(key);
+                            }
+                        }
+                    }
+                }, thread_id);
+            }
+            for (size_t i = 0; i < THREAD_NUM; i++) {
+                threads[i].join();
+            }
+            bst.register_thread(0);
+            std::vector<int> keys;
+            bst.range_query(0, hot_keys, keys);
+            assert(bst.size() == keys.size());
+            for (int key = 0; key < hot_keys; key++) {
+                assert(bst.find(key) == std::binary_search(keys.begin(), keys.end(), key));
+                bst.erase(key);
+            }
+            assert(bst.size() == 0);
+        }
+    }
+    printf("test contention passed\n");
+}
+
+/**
+ * Test that switches keep all keys, both on a quiescent tree and while
+ * other threads update it. Each thread checks its own keys, which no
+ * other thread touches.
+ */
+void test_adaptive(AdaptiveBST<int>& bst) {
+    bst.set_N(THREAD_NUM + 1);
+    bst.register_thread(THREAD_NUM);
+    std::set<int> keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 4) + static_cast<int>(TEST_SIZE);
+        bst.insert(key);
+        keys.insert(key);
+    }
+    for (int round = 0; round < 4; round++) {
+        bst.migrate(round % 2 == 0);
+        assert(bst.is_lock_free() == (round % 2 == 0));
+        assert(bst.size() == keys.size());
+        std::vector<int> out;
+        bst.range_query(INT_MIN, INT_MAX, out);
+        assert(out == std::vector<int>(keys.begin(), keys.end()));
+    }
+    std::atomic<bool> running(true);
+    std::thread switcher([&bst, &running]() {
+        bst.register_thread(THREAD_NUM);
+        bool to_lock_free = true;
+        while (running.load()) {
+            bst.migrate(to_lock_free);
+            to_lock_free = !to_lock_free;
+            std::this_thread::yield();
+        }
+    });
+    std::vector<std::thread> threads(THREAD_NUM);
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&bst](size_t thread_id) {
+            bst.register_thread(thread_id);
+            // Keys below TEST_SIZE, which the quiescent part does not use
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.insert(i) == true);
+                assert(bst.find(i) == true);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += 2 * THREAD_NUM) {
+                bst.erase(i);
+            }
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.find(i) == ((i - thread_id) % (2 * THREAD_NUM) != 0));
+            }
+        }, thread_id);
+    }
+    for (size_t i = 0; i < THREAD_NUM; i++) {
+        threads[i].join();
+    }
+    running.store(false);
+    switcher.join();
+    assert(bst.switches() >= 4);
+    assert(bst.range_count(0, TEST_SIZE) + keys.size() == bst.size());
+    bst.erase_range(INT_MIN, INT_MAX);
+    assert(bst.size() == 0);
+    printf("test adaptive passed\n");
+}
+
+/**
+ * Test that updates on top of a frozen snapshot are visible to every
+ * query, before and after the next freeze.
+ */
+void test_freeze(FrozenBST<int>& bst) {
+    bst.set_N(1);
+    bst.register_thread(0);
+    std::set<int> keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 2);
+        bst.insert(key);
+        keys.insert(key);
+    }
+    for (int round = 0; round < 2; round++) {
+        bst.freeze();
+        assert(bst.size() == keys.size());
+        // Erase every third key and insert new ones into the deltas
+        for (int key = 0; key < static_cast<int>(TEST_SIZE * 2); key += 3) {
+            bst.erase(key);
+            keys.erase(key);
+            assert(bst.insert(key + 1) == keys.insert(key + 1).second);
+        }
+        for (int key = -1; key <= static_cast<int>(TEST_SIZE * 2); key++) {
+            assert(bst.find(key) == (keys.count(key) == 1));
+        }
+        std::vector<int> expected(keys.begin(), keys.end());
+        std::vector<int> found;
+        bst.range_query(INT_MIN, INT_MAX, found);
+        assert(found == expected);
+        assert(bst.size() == keys.size());
+        int key;
+        assert(bst.min(key) && key == expected.front());
+        assert(bst.max(key) && key == expected.back());
+        assert(bst.successor(1, key) && key == *keys.upper_bound(1));
+        assert(bst.rank(TEST_SIZE) == static_cast<size_t>(std::distance(keys.begin(), keys.lower_bound(TEST_SIZE))));
+        assert(bst.select(expected.size() / 2, key) && key == expected[expected.size() / 2]);
+    }
+    bst.erase_range(INT_MIN, INT_MAX);
+    assert(bst.size() == 0);
+    printf("test freeze passed\n");
+}
+
+/**
+ * Test that an image saved from a tree with pending deltas maps back to
+ * the same key set, that the mapped tree takes updates and freezes into
+ * memory, and that files which are not images are rejected.
+ */
+void test_image(FrozenBST<int>& bst) {
+    std::string path = "/tmp/bst_image_" + std::to_string(getpid()) + ".img";
+    bst.set_N(1);
+    bst.register_thread(0);
+    std::set<int> keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 2);
+        bst.insert(key);
+        keys.insert(key);
+    }
+    bst.freeze();
+    for (int key = 0; key < static_cast<int>(TEST_SIZE * 2); key += 5) {
+        bst.erase(key);
+        keys.erase(key);
+        assert(bst.insert(key + 2) == keys.insert(key + 2).second);
+    }
+    assert(bst.save(path.c_str()));
+    std::vector<int> expected(keys.begin(), keys.end());
+    {
+        FrozenBST<int> loaded(0);
+        loaded.set_N(1);
+        assert(loaded.load_mmap(path.c_str()));
+        std::vector<int> found;
+        loaded.range_query(INT_MIN, INT_MAX, found);
+        assert(found == expected);
+        for (int key = -1; key <= static_cast<int>(TEST_SIZE * 2); key++) {
+            assert(loaded.find(key) == (keys.count(key) == 1));
+        }
+        int key;
+        assert(loaded.select(expected.size() / 2, key) && key == expected[expected.size() / 2]);
+        // Updates go to the deltas, freeze() moves the keys off the image
+        assert(loaded.insert(-1));
+        loaded.erase(expected.front());
+        loaded.freeze();
+        assert(loaded.size() == expected.size());
+        assert(loaded.find(-1) && !loaded.find(expected.front()));
+    }
+    {
+        CoarseGrainedBST<int> coarse;
+        // Random order, so the tree is not a list
+        std::vector<int> shuffled(expected);
+        std::random_shuffle(shuffled.begin(), shuffled.end());
+        for (int key : shuffled) {
+            coarse.insert(key);
+        }
+        assert(FrozenBST<int>::save_tree(coarse, path.c_str()));
+        FrozenBST<int> loaded(0);
+        assert(loaded.load_mmap(path.c_str()));
+        assert(loaded.size() == keys.size());
+        std::vector<int> found;
+        loaded.range_query(INT_MIN, INT_MAX, found);
+        assert(found == expected);
+    }
+    {
+        FrozenBST<int> loaded(0);
+        // Not an image: the file is truncated
+        assert(truncate(path.c_str(), 16) == 0);
+        assert(!loaded.load_mmap(path.c_str()));
+        unlink(path.c_str());
+        assert(!loaded.load_mmap(path.c_str()));
+        assert(loaded.size() == 0);
+    }
+    bst.clear();
+    assert(bst.size() == 0);
+    printf("test image passed\n");
+}
+
+/**
+ * Test that a snapshot keeps its version while the tree changes under it,
+ * and that snapshots taken during updates are consistent: every thread
+ * inserts its keys in ascending order, so a snapshot must hold a prefix
+ * of each thread's keys. Nodes pinned by a snapshot are freed once it is
+ * released.
+ */
+void test_snapshot(PersistentBST<int>& bst) {
+    bst.set_N(THREAD_NUM + 1);
+    bst.register_thread(THREAD_NUM);
+    std::set<int> keys;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        int key = rand() % static_cast<int>(TEST_SIZE * 4) + static_cast<int>(TEST_SIZE);
+        bst.insert(key);
+        keys.insert(key);
+    }
+    std::vector<int> expected(keys.begin(), keys.end());
+    size_t retired;
+    {
+        PersistentBST<int>::Snapshot before = bst.snapshot();
+        std::atomic<size_t> writing(THREAD_NUM);
+        std::thread reader([&bst, &writing]() {
+            bst.register_thread(THREAD_NUM);
+            while (writing.load() > 0) {
+                PersistentBST<int>::Snapshot snapshot = bst.snapshot();
+                std::vector<size_t> counts(THREAD_NUM, 0);
+                std::vector<size_t> ends(THREAD_NUM, 0);
+                const int bound = TEST_SIZE;
+                snapshot.walk_range(nullptr, &bound, [&](const int& key) {
+                    counts[key % THREAD_NUM]++;
+                    ends[key % THREAD_NUM] = key / THREAD_NUM + 1;
+                });
+                for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+                    assert(counts[thread_id] == ends[thread_id]);
+                }
+            }
+        });
+        std::vector<std::thread> threads(THREAD_NUM);
+        for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+            threads[thread_id] = std::thread([&bst, &writing](size_t thread_id) {
+                bst.register_thread(thread_id);
+                for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                    assert(bst.insert(i) == true);
+                }
+                writing--;
+            }, thread_id);
+        }
+        for (size_t i = 0; i < THREAD_NUM; i++) {
+            threads[i].join();
+        }
+        reader.join();
+        bst.erase_range(TEST_SIZE, INT_MAX);
+        assert(bst.size() == TEST_SIZE);
+        assert(before.size() == expected.size());
+        std::vector<int> out;
+        before.range_query(INT_MIN, INT_MAX, out);
+        assert(out == expected);
+        for (size_t i = 0; i < TEST_SIZE; i++) {
+            assert(!before.find(i));
+        }
+        retired = bst.shape_stats().retired_nodes;
+        assert(retired >= expected.size());
+    }
+    // The next gc() frees what the snapshot pinned
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        bst.erase(i);
+    }
+    assert(bst.shape_stats().retired_nodes < retired);
+    assert(bst.size() == 0);
+    printf("test snapshot passed\n");
+}
+
+/**
+ * Test every read mode with finds running against inserts and erases.
+ * Keys below TEST_SIZE are never erased and odd keys above it are never
+ * inserted, so finds of them must always hit and miss. A short retire
+ * list makes optimistic finds overlap reclamation.
+ */
+void test_read_modes() {
+    for (int mode = 0; mode < static_cast<int>(ReadMode::Unknown); mode++) {
+        CoarseGrainedBST<int> bst;
+        bst.set_R(32);
+        bst.set_read_mode(static_cast<ReadMode>(mode));
+        // Random order, so the tree is not a list
+        std::vector<int> stable;
+        for (size_t i = 0; i < TEST_SIZE; i++) {
+            stable.push_back(static_cast<int>(i));
+        }
+        std::random_shuffle(stable.begin(), stable.end());
+        for (int key : stable) {
+            bst.insert(key);
+        }
+        const size_t writers = std::max(THREAD_NUM / 2, static_cast<size_t>(1));
+        std::atomic<size_t> writing(writers);
+        std::vector<std::thread> threads;
+        for (size_t thread_id = 0; thread_id < writers; thread_id++) {
+            threads.push_back(std::thread([&bst, &writing, writers](size_t thread_id) {
+                for (size_t i = thread_id; i < TEST_SIZE; i += writers) {
+                    bst.insert(static_cast<int>(TEST_SIZE + 2 * i));
+                }
+                for (size_t i = thread_id; i < TEST_SIZE; i += writers) {
+                    bst.erase(static_cast<int>(TEST_SIZE + 2 * i));
+                }
+                writing--;
+            }, thread_id));
+        }
+        for (size_t thread_id = 0; thread_id < std::max(THREAD_NUM - writers, static_cast<size_t>(1)); thread_id++) {
+            threads.push_back(std::thread([&bst, &writing, &stable](size_t thread_id) {
+                size_t i = thread_id;
+                while (writing.load() > 0) {
+                    assert(bst.find(stable[i % TEST_SIZE]));
+                    assert(!bst.find(static_cast<int>(TEST_SIZE + 2 * (i % TEST_SIZE) + 1)));
+                    i += 7;
+                }
+            }, thread_id));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        assert(bst.size() == TEST_SIZE);
+        for (size_t i = 0; i < TEST_SIZE; i++) {
+            assert(bst.find(static_cast<int>(i)));
+            assert(!bst.find(static_cast<int>(TEST_SIZE + i)));
+        }
+    }
+    printf("test read modes passed\n");
+}
+
+/**
+ * Test that exports taken while threads update the tree are consistent.
+ * Keys 3i are never touched. Every thread inserts its keys 3i+1 and erases
+ * its keys 3i+2 in ascending order of i, alternating, so an export must
+ * hold a prefix of the thread's keys 3i+1 and have lost a prefix of its
+ * keys 3i+2 of the same length or one shorter.
+ *
+ * @param collect read the snapshots with range_query instead, every one
+ *        collected with the journal of updates rather than validated
+ */
+template<typename Tree>
+void test_export(Tree& bst, bool collect) {
+    std::string path = "/tmp/bst_export_" + std::to_string(getpid()) + ".bin";
+    bst.set_N(THREAD_NUM + 1);
+    bst.register_thread(THREAD_NUM);
+    // Random order, so the tree is not a list
+    std::vector<int> initial;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        initial.push_back(static_cast<int>(3 * i));
+        initial.push_back(static_cast<int>(3 * i + 2));
+    }
+    std::random_shuffle(initial.begin(), initial.end());
+    for (int key : initial) {
+        bst.insert(key);
+    }
+    bst.set_range_retries(collect ? 0 : RANGE_RETRIES);
+    auto export_keys = [&bst, &path, collect](std::vector<int>& keys) {
+        if (collect) {
+            bst.range_query(0, static_cast<int>(3 * TEST_SIZE), keys);
+            return;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        assert(fd >= 0);
+        assert(bst.export_snapshot(fd));
+        off_t bytes = lseek(fd, 0, SEEK_END);
+        keys.resize(bytes / sizeof(int));
+        assert(pread(fd, keys.data(), bytes, 0) == bytes);
+        close(fd);
+    };
+    std::atomic<size_t> writing(THREAD_NUM);
+    std::thread exporter([&]() {
+        bst.register_thread(THREAD_NUM);
+        std::vector<int> keys;
+        do {
+            export_keys(keys);
+            size_t stable = 0;
+            std::vector<size_t> inserted(THREAD_NUM, 0);
+            std::vector<size_t> ends(THREAD_NUM, 0);
+            std::vector<size_t> kept(THREAD_NUM, 0);
+            std::vector<size_t> firsts(THREAD_NUM, 0);
+            for (size_t j = 0; j < keys.size(); j++) {
+                assert(j == 0 || keys[j - 1] < keys[j]);
+                size_t i = keys[j] / 3;
+                size_t thread_id = i % THREAD_NUM;
+                if (keys[j] % 3 == 0) {
+                    stable++;
+                } else if (keys[j] % 3 == 1) {
+                    inserted[thread_id]++;
+                    ends[thread_id] = i / THREAD_NUM + 1;
+                } else if (kept[thread_id]++ == 0) {
+                    firsts[thread_id] = i / THREAD_NUM;
+                }
+            }
+            assert(stable == TEST_SIZE);
+            for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+                size_t total = (TEST_SIZE - thread_id + THREAD_NUM - 1) / THREAD_NUM;
+                size_t erased = kept[thread_id] == 0 ? total : firsts[thread_id];
+                assert(inserted[thread_id] == ends[thread_id]);
+                assert(kept[thread_id] + erased == total);
+                assert(inserted[thread_id] == erased || inserted[thread_id] == erased + 1);
+            }
+        } while (writing.load() > 0);
+    });
+    std::vector<std::thread> threads(THREAD_NUM);
+    for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
+        threads[thread_id] = std::thread([&bst, &writing](size_t thread_id) {
+            bst.register_thread(thread_id);
+            for (size_t i = thread_id; i < TEST_SIZE; i += THREAD_NUM) {
+                assert(bst.insert(static_cast<int>(3 * i + 1)));
+                bst.erase(static_cast<int>(3 * i + 2));
+            }
+            writing--;
+        }, thread_id);
+    }
+    for (size_t i = 0; i < THREAD_NUM; i++) {
+        threads[i].join();
+    }
+    exporter.join();
+    std::vector<int> keys;
+    export_keys(keys);
+    std::vector<int> expected;
+    bst.walk_range(nullptr, nullptr, [&expected](const int& key) {
+        expected.push_back(key);
+    });
+    assert(keys == expected);
+    assert(keys.size() == 2 * TEST_SIZE);
+    unlink(path.c_str());
+    bst.clear();
+    bst.set_range_retries(RANGE_RETRIES);
+    printf(collect ? "test snapshot collect passed\n" : "test export passed\n");
+}
+
+/**
+ * Test that processes which map the same tree at different addresses see
+ * each other's updates. Every child process attaches by name and runs two
+ * threads, which insert the keys of the process and erase the odd ones
+ * again. The parent checks the key set through its own mapping and
+ * through a new one.
+ */
+void test_shared() {
+    std::string name = "/bst_shared_test_" + std::to_string(getpid());
+    const size_t processes = std::max(THREAD_NUM, static_cast<size_t>(2));
+    const size_t threads_per_process = 2;
+    SharedBST<int>::unlink(name.c_str());
+    SharedBST<int> bst;
+    assert(bst.attach(name.c_str(), 4 * TEST_SIZE + (1 << 16)));
+    bst.set_N(1);
+    bst.register_thread(0);
+    std::vector<pid_t> children;
+    for (size_t process = 0; process < processes; process++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid != 0) {
+            children.push_back(pid);
+            continue;
+        }
+        {
+            SharedBST<int> local;
+            if (!local.attach(name.c_str(), 0)) {
+                _exit(1);
+            }
+            local.set_N(threads_per_process);
+            std::vector<std::thread> threads;
+            for (size_t thread_id = 0; thread_id < threads_per_process; thread_id++) {
+                threads.push_back(std::thread([&local, process, processes](size_t thread_id) {
+                    local.register_thread(thread_id);
+                    size_t stride = processes * threads_per_process;
+                    for (size_t i = process + processes * thread_id; i < TEST_SIZE; i += stride) {
+                        assert(local.insert(static_cast<int>(i)));
+                    }
+                    for (size_t i = process + processes * thread_id; i < TEST_SIZE; i += stride) {
+                        if (i % 2 == 1) {
+                            local.erase(static_cast<int>(i));
+                        }
+                        assert(local.find(static_cast<int>(i)) == (i % 2 == 0));
+                    }
+                }, thread_id));
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+        _exit(0);
+    }
+    for (pid_t pid : children) {
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    std::vector<int> expected;
+    for (size_t i = 0; i < TEST_SIZE; i += 2) {
+        expected.push_back(static_cast<int>(i));
+    }
+    assert(bst.size() == expected.size());
+    std::vector<int> keys;
+    bst.range_query(INT_MIN, INT_MAX, keys);
+    assert(keys == expected);
+    {
+        SharedBST<int> other;
+        assert(other.attach(name.c_str(), 0));
+        other.set_N(1);
+        assert(other.size() == expected.size());
+        assert(other.rank(static_cast<int>(TEST_SIZE / 2)) == (TEST_SIZE / 2 + 1) / 2);
+        // Updates through one mapping are seen through the other
+        assert(other.insert(-1));
+        assert(bst.find(-1));
+        bst.erase(-1);
+        assert(!other.find(-1));
+    }
+    assert(bst.erase_range(0, INT_MAX) == expected.size());
+    assert(bst.size() == 0);
+    // Freed slots are reused before new ones
+    size_t used = bst.used_slots();
+    for (size_t i = 0; i < expected.size(); i++) {
+        assert(bst.insert(static_cast<int>(i)));
+    }
+    assert(bst.used_slots() == used);
+    bst.clear();
+    bst.detach();
+    assert(SharedBST<int>::unlink(name.c_str()));
+    printf("test shared passed\n");
+}
+
+/**
+ * Nodes of 32-bit references are half the size, and an arena which is
+ * full refuses inserts until slots are freed again.
+ */
+void test_compact() {
+    assert(CompactBST<int>::node_size() == 12);
+    assert(SharedBST<int>::node_size() == 24);
+    CompactBST<int> bst;
+    assert(!bst.attach(nullptr, CompactBST<int>::max_capacity() + 1));
+    // Five slots hold the sentinels, every key takes two
+    const size_t keys = 32;
+    assert(bst.attach(nullptr, 5 + 2 * keys));
+    bst.set_N(1);
+    bst.register_thread(0);
+    // A full arena throws, while a key which exists still returns false
+    auto full = [&bst](int key) {
+        try {
+            bst.insert(key);
+        } catch (const std::bad_alloc&) {
+            return true;
+        }
+        return false;
+    };
+    for (size_t i = 0; i < keys; i++) {
+        assert(bst.insert(static_cast<int>(i)));
+    }
+    assert(full(static_cast<int>(keys)) && bst.failed_allocations() > 0);
+    assert(!bst.insert(0));
+    assert(bst.size() == keys);
+    assert(bst.rank(static_cast<int>(keys)) == keys);
+    assert(bst.erase_range(0, static_cast<int>(keys / 2)) == keys / 2);
+    for (size_t i = keys; i < keys + keys / 2; i++) {
+        assert(bst.insert(static_cast<int>(i)));
+    }
+    assert(full(-1));
+    std::vector<int> result;
+    bst.range_query(INT_MIN, INT_MAX, result);
+    assert(result.size() == keys);
+    for (size_t i = 0; i < keys; i++) {
+        assert(result[i] == static_cast<int>(keys / 2 + i));
+    }
+    bst.clear();
+    assert(bst.size() == 0);
+    assert(bst.used_slots() == 5 + 2 * keys);
+    for (size_t i = 0; i < keys; i++) {
+        assert(bst.insert(static_cast<int>(i)));
+    }
+    assert(full(static_cast<int>(keys)));
+    printf("test compact passed\n");
+}
+
 void correctness_test(BST<int>& bst) {
     auto start = std::chrono::high_resolution_clock::now();
     #ifdef TEST_CORRECTNESS
@@ -142,6 +1473,108 @@ void correctness_test(BST<int>& bst) {
     #ifdef TEST_PARALLEL
     test_multi_thread(bst);
     #endif
+    #ifdef TEST_POP
+    LockFreeBST<int>* lock_free = dynamic_cast<LockFreeBST<int>*>(&bst);
+    if (lock_free != nullptr) {
+        test_pop(*lock_free, 1);
+        test_pop(*lock_free, 4);
+        test_pop_race(*lock_free);
+    }
+    #endif
+    #ifdef TEST_CONTENTION
+    LockFreeBST<int>* contended = dynamic_cast<LockFreeBST<int>*>(&bst);
+    if (contended != nullptr) {
+        test_contention(*contended);
+    }
+    #endif
+    #ifdef TEST_PARALLEL_WALK
+    test_parallel_walk(bst);
+    #endif
+    #ifdef TEST_FINGER
+    test_fingers(bst);
+    #endif
+    #ifdef TEST_ERASE_RANGE
+    if (dynamic_cast<CoarseGrainedBST<int>*>(&bst) != nullptr || dynamic_cast<LockFreeBST<int>*>(&bst) != nullptr) {
+        test_deep_erase_range(bst);
+    }
+    if (dynamic_cast<FineGrainedBST<int>*>(&bst) != nullptr || dynamic_cast<LockFreeBST<int>*>(&bst) != nullptr) {
+        test_erase_range_race(bst);
+    }
+    #endif
+    #ifdef TEST_ELIMINATION
+    test_elimination(bst);
+    #endif
+    #ifdef TEST_TRACE
+    test_trace(bst);
+    #endif
+    #ifdef TEST_FREEZE
+    FrozenBST<int>* frozen = dynamic_cast<FrozenBST<int>*>(&bst);
+    if (frozen != nullptr) {
+        test_freeze(*frozen);
+    }
+    #endif
+    #ifdef TEST_ADAPTIVE
+    AdaptiveBST<int>* adaptive = dynamic_cast<AdaptiveBST<int>*>(&bst);
+    if (adaptive != nullptr) {
+        test_adaptive(*adaptive);
+    }
+    #endif
+    #ifdef TEST_IMAGE
+    FrozenBST<int>* imaged = dynamic_cast<FrozenBST<int>*>(&bst);
+    if (imaged != nullptr) {
+        test_image(*imaged);
+    }
+    #endif
+    #ifdef TEST_SNAPSHOT
+    PersistentBST<int>* persistent = dynamic_cast<PersistentBST<int>*>(&bst);
+    if (persistent != nullptr) {
+        test_snapshot(*persistent);
+    }
+    #endif
+    #ifdef TEST_EXPORT
+    FineGrainedBST<int>* fine_grained = dynamic_cast<FineGrainedBST<int>*>(&bst);
+    if (fine_grained != nullptr) {
+        test_export(*fine_grained, false);
+        test_export(*fine_grained, true);
+    }
+    LockFreeBST<int>* exported = dynamic_cast<LockFreeBST<int>*>(&bst);
+    if (exported != nullptr) {
+        test_export(*exported, false);
+        test_export(*exported, true);
+    }
+    #endif
+    #ifdef TEST_SHARED
+    if (dynamic_cast<SharedBST<int>*>(&bst) != nullptr) {
+        test_shared();
+    }
+    #endif
+    #ifdef TEST_COMPACT
+    if (dynamic_cast<CompactBST<int>*>(&bst) != nullptr) {
+        test_compact();
+    }
+    #endif
+    #ifdef TEST_READ_MODE
+    if (dynamic_cast<CoarseGrainedBST<int>*>(&bst) != nullptr) {
+        test_read_modes();
+    }
+    #endif
+    #ifdef TEST_SET_ALGEBRA
+    if (dynamic_cast<CoarseGrainedBST<int>*>(&bst) != nullptr) {
+        test_set_algebra();
+    }
+    #endif
+    #ifdef TEST_RANK
+    if (dynamic_cast<CoarseGrainedBST<int>*>(&bst) != nullptr) {
+        // Same tests against the tree with subtree counts
+        CoarseGrainedBST<int> augmented(true);
+        #ifdef TEST_CORRECTNESS
+        test_single_thread(augmented);
+        #endif
+        #ifdef TEST_PARALLEL
+        test_multi_thread(augmented);
+        #endif
+    }
+    #endif
     auto end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
     printf("test finished in %f\n", static_cast<float>(duration.count()) / 1e3);
@@ -149,11 +1582,42 @@ void correctness_test(BST<int>& bst) {
 
 typedef std::chrono::microseconds time_std;
 
+/**
+ * Number of tree operations performed in the measured phase of the pattern
+ */
+size_t pattern_op_count() {
+    switch (pattern) {
+        case Pattern::Insert:
+        case Pattern::Erase:
+        case Pattern::Find:
+            return TEST_SIZE;
+        case Pattern::Contention:
+            return THREAD_NUM < 3 ? 0 : TEST_SIZE * 3;
+        case Pattern::Write_dominance:
+            return TEST_SIZE * 2;
+        case Pattern::Mixed:
+            return TEST_SIZE * 5;
+        case Pattern::Read_dominance:
+            return TEST_SIZE * 10;
+        default:
+            return 0;
+    }
+}
+
+// End the populate phase of a recorded run, a replay times only what follows
+void mark_phase(BST<int>& bst) {
+    RecordingBST<int>* recorder = dynamic_cast<RecordingBST<int>*>(&bst);
+    if (recorder != nullptr) {
+        recorder->mark_phase();
+    }
+}
+
 void load_test(BST<int>& bst) {
     // bst.clear();
     bst.set_N(THREAD_NUM);
     std::vector<std::thread> threads(THREAD_NUM);
     std::vector<int> data(TEST_SIZE);
+    perf_readings.assign(THREAD_NUM, PerfCounters::Reading());
     for (size_t i = 0; i < data.size(); i++) {
         data[i] = i;
     }
@@ -161,10 +1625,12 @@ void load_test(BST<int>& bst) {
     switch (pattern) {
         case Pattern::Insert:
             // Insert only
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
@@ -190,10 +1656,16 @@ void load_test(BST<int>& bst) {
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id].join();
             }
+            if (SHAPE_PRINT) {
+                bst.shape_stats().print("populate");
+            }
+            mark_phase(bst);
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst, &data](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
@@ -219,21 +1691,37 @@ void load_test(BST<int>& bst) {
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id].join();
             }
+            if (SHAPE_PRINT) {
+                bst.shape_stats().print("populate");
+            }
+            mark_phase(bst);
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst, &data](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
-                    for (size_t i = start; i < end; i++) {
-                        bst.find(data[i]);
+                    if (FIND_BATCH == 0) {
+                        for (size_t i = start; i < end; i++) {
+                            bst.find(data[i]);
+                        }
+                        return;
+                    }
+                    std::vector<int> batch;
+                    std::vector<bool> found;
+                    for (size_t i = start; i < end; i += FIND_BATCH) {
+                        batch.assign(data.begin() + i, data.begin() + std::min(end, i + FIND_BATCH));
+                        bst.find_many(batch, found);
                     }
                 }, thread_id);
             }
             break;
         case Pattern::Contention:
             // Read/Write on same data
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst, &data](size_t thread_id) {
@@ -241,6 +1729,7 @@ void load_test(BST<int>& bst) {
                         return;
                     }
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     
                     size_t thread_num = THREAD_NUM / 3.f;
                     size_t insert_id_max = thread_num;
@@ -279,10 +1768,12 @@ void load_test(BST<int>& bst) {
             break;
         case Pattern::Write_dominance:
             // 50% insert, 50% erase
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
@@ -297,10 +1788,12 @@ void load_test(BST<int>& bst) {
             break;
         case Pattern::Mixed:
             // 20% insert, 20% delete, 60% find
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst, &data](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
@@ -320,10 +1813,12 @@ void load_test(BST<int>& bst) {
             break;
         case Pattern::Read_dominance:
             // 10% insert, 90% find
+            BST_STAT_RESET();
             start_time = std::chrono::high_resolution_clock::now();
             for (size_t thread_id = 0; thread_id < THREAD_NUM; thread_id++) {
                 threads[thread_id] = std::thread([&bst, &data](size_t thread_id) {
                     bst.register_thread(thread_id);
+                    PerfScope perf_scope(thread_id);
                     size_t local_test_size = (TEST_SIZE + THREAD_NUM - 1) / THREAD_NUM;
                     size_t start = thread_id * local_test_size;
                     size_t end = std::min(TEST_SIZE, (thread_id + 1) * local_test_size);
@@ -352,7 +1847,65 @@ void load_test(BST<int>& bst) {
     // printf("load test %fs\n", static_cast<float>(avg) / static_cast<float>(1e6));
     // printf("load test %fms\n", static_cast<float>(avg));
     printf("%f\n", static_cast<float>(time_count) / static_cast<float>(1e6));
+    if (PERF_ENABLED) {
+        PerfCounters::Reading total = perf_readings[0];
+        for (size_t thread_id = 1; thread_id < perf_readings.size(); thread_id++) {
+            total += perf_readings[thread_id];
+        }
+        PerfCounters::print(total, pattern_op_count());
+    }
+    BST_STAT_DUMP(pattern_op_count());
+    if (RECLAIM_PRINT && bst.reclaim_stats() != nullptr) {
+        bst.reclaim_stats()->print();
+    }
+    if (SHAPE_PRINT) {
+        bst.shape_stats().print("measured");
+    }
+}
 
+/**
+ * Replay the trace at REPLAY_PATH against the tree, one thread per stream
+ * of the trace, and print the time it took like the load test. Threads
+ * meet at the phase marks of the trace, and the time is taken from the
+ * last one, so the populate phase of a recorded load test is not counted.
+ */
+void replay_test(BST<int>& bst) {
+    OpTrace<int> trace;
+    if (!trace.open(REPLAY_PATH.c_str())) {
+        printf("cannot read trace %s\n", REPLAY_PATH.c_str());
+        return;
+    }
+    if (REPLAY_PACED && !trace.timed()) {
+        printf("trace has no timestamps, replaying as fast as possible\n");
+    }
+    bst.set_N(trace.threads());
+    std::vector<std::thread> threads(trace.threads());
+    PhaseBarrier barrier(trace.threads());
+    BST_STAT_RESET();
+    size_t start = op_trace_now();
+    for (size_t thread_id = 0; thread_id < threads.size(); thread_id++) {
+        threads[thread_id] = std::thread([&bst, &trace, &barrier, start](size_t thread_id) {
+            bst.register_thread(thread_id);
+            trace.replay(bst, thread_id, REPLAY_PACED, start, &barrier);
+        }, thread_id);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    size_t end = op_trace_now();
+    size_t measured_from = barrier.last_opened() != 0 ? barrier.last_opened() : start;
+    printf("%f\n", static_cast<float>(end - measured_from) / static_cast<float>(1e9));
+    size_t ops = 0;
+    for (size_t thread_id = 0; thread_id < trace.threads(); thread_id++) {
+        ops += trace.count(thread_id);
+    }
+    BST_STAT_DUMP(ops);
+    if (RECLAIM_PRINT && bst.reclaim_stats() != nullptr) {
+        bst.reclaim_stats()->print();
+    }
+    if (SHAPE_PRINT) {
+        bst.shape_stats().print("measured");
+    }
 }
 
 void print_test_status() {
@@ -366,7 +1919,7 @@ int main(int argc, char **argv) {
     srand(time(NULL));
     int opt;
     std::string tmp;
-    while ((opt = getopt(argc, argv, "p:thn:d:a:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:thn:d:a:cgr:sob:fe:m:l:w:k:i:u")) != -1) {
         switch (opt) {
             case 't':
                 state = State::Correctness_Test;
@@ -377,7 +1930,7 @@ int main(int argc, char **argv) {
                     if (!isdigit(c)) {
                         printf("Unknown algorithm\n");
                         printf("Availabe algorihtms:\n");
-                        printf("0=CoarseGrained 1=FineGrained 2=LockFree");
+                        printf("0=CoarseGrained 1=FineGrained 2=LockFree 3=Frozen 4=Adaptive 5=Persistent 6=Shared 7=Compact");
                         return 0;
                     }
                 }
@@ -385,7 +1938,7 @@ int main(int argc, char **argv) {
                 if (bst_selection >= (sizeof(bst_ptrs) / sizeof(BST<int>*))) {
                     printf("Unknown algorithm\n");
                     printf("Availabe algorihtms:\n");
-                    printf("0=CoarseGrained 1=FineGrained 2=LockFree\n");
+                    printf("0=CoarseGrained 1=FineGrained 2=LockFree 3=Frozen 4=Adaptive 5=Persistent 6=Shared 7=Compact\n");
                     return 0;
                 }
                 break;
@@ -424,32 +1977,187 @@ int main(int argc, char **argv) {
                 }
                 TEST_SIZE = stoi(tmp);
                 break;
+            case 'c':
+                // performance counters
+                PERF_ENABLED = true;
+                break;
+            case 'g':
+                // reclamation telemetry
+                RECLAIM_PRINT = true;
+                break;
+            case 's':
+                // tree shape after each phase
+                SHAPE_PRINT = true;
+                break;
+            case 'b':
+                // batched lookups
+                tmp = std::string(optarg);
+                for (char c : tmp) {
+                    if (!isdigit(c)) {
+                        printf("batch size should be a number\n");
+                        return 0;
+                    }
+                }
+                FIND_BATCH = stoul(tmp);
+                break;
+            case 'e':
+                // elimination array
+                tmp = std::string(optarg);
+                for (char c : tmp) {
+                    if (!isdigit(c)) {
+                        printf("elimination width should be a number\n");
+                        return 0;
+                    }
+                }
+                ELIMINATION_WIDTH = stoul(tmp);
+                break;
+            case 'm':
+                // contention manager
+                tmp = std::string(optarg);
+                if (tmp.size() != 1 || tmp[0] < '0' || tmp[0] >= '0' + static_cast<int>(ContentionWait::Unknown)) {
+                    printf("Unknown contention wait\n");
+                    printf("Available waits: 0=None, 1=Backoff, 2=Spin_Yield\n");
+                    return 0;
+                }
+                CONTENTION_WAIT = static_cast<ContentionWait>(tmp[0] - '0');
+                break;
+            case 'l':
+                // local restart
+                tmp = std::string(optarg);
+                if (tmp != "0" && tmp != "1") {
+                    printf("local restart should be 0 or 1\n");
+                    return 0;
+                }
+                LOCAL_RESTART = tmp[0] - '0';
+                break;
+            case 'w':
+                // read mode of CoarseGrained
+                tmp = std::string(optarg);
+                if (tmp.size() != 1 || tmp[0] < '0' || tmp[0] >= '0' + static_cast<int>(ReadMode::Unknown)) {
+                    printf("Unknown read mode\n");
+                    printf("Available read modes: 0=Lock, 1=Shared, 2=Optimistic\n");
+                    return 0;
+                }
+                READ_MODE = static_cast<ReadMode>(tmp[0] - '0');
+                break;
+            case 'f':
+                // finger search
+                FINGERS = true;
+                break;
+            case 'o':
+                // order statistics in O(depth)
+                AUGMENTED = true;
+                break;
+            case 'k':
+                // record a trace
+                RECORD_PATH = std::string(optarg);
+                break;
+            case 'i':
+                // replay a trace
+                REPLAY_PATH = std::string(optarg);
+                state = State::Replay_Test;
+                break;
+            case 'u':
+                // replay at the recorded pace
+                REPLAY_PACED = true;
+                break;
+            case 'r':
+                // retire list threshold
+                tmp = std::string(optarg);
+                for (char c : tmp) {
+                    if (!isdigit(c)) {
+                        printf("retire threshold should be a number\n");
+                        return 0;
+                    }
+                }
+                RETIRE_THRESHOLD = stoul(tmp);
+                break;
             default:
-                printf("-a: algorithm, availabe trees: 0=CoarseGrained 1=FineGrained 2=LockFree\n");
+                printf("-a: algorithm, availabe trees: 0=CoarseGrained 1=FineGrained 2=LockFree 3=Frozen 4=Adaptive 5=Persistent 6=Shared 7=Compact\n");
                 printf("-t: run correctness tests\n");
                 printf("-p: run pattern generator, available parameters: 0=Insert, 1=Erase, 2=Find, 3=Contention, 4=Write_dominance, 5=Mixed, 6=Read_dominance\n");
                 printf("-n: thread num\n");
                 printf("-d: data size\n");
+                printf("-c: collect performance counters per operation in the load test\n");
+                printf("-g: print retired node counts and gc pause histogram after the load test\n");
+                printf("-r: retire list length which triggers gc\n");
+                printf("-s: print tree shape after each phase of the load test\n");
+                printf("-o: maintain subtree counts in CoarseGrained for rank/select\n");
+                printf("-b: keys per find_many batch in the Find pattern, 0 uses find\n");
+                printf("-f: start find and insert at the last position of the thread in CoarseGrained and LockFree\n");
+                printf("-e: slots of an elimination array which cancels concurrent insert/erase pairs of a key, 0 for none\n");
+                printf("-m: what LockFree, Shared and Compact do after a lost CAS: 0=None, 1=Backoff, 2=Spin_Yield\n");
+                printf("-l: 1 lets LockFree retries seek from the last unmarked ancestor, 0 from the root\n");
+                printf("-w: how CoarseGrained reads: 0=Lock, 1=Shared reader-writer lock, 2=Optimistic seqlock finds\n");
+                printf("-k: record insert, erase and find of the run to the given trace file, the populate phase ends with a phase mark\n");
+                printf("-i: replay the given trace file, one thread per recorded thread\n");
+                printf("-u: replay at the recorded pace instead of as fast as possible\n");
                 printf("-h help\n");
                 return 0;
         }
     }
     init_bsts();
+    BST<int>* bst = bst_ptrs[bst_selection];
+    if (RETIRE_THRESHOLD > 0) {
+        bst->set_R(RETIRE_THRESHOLD);
+    }
+    bst->set_fingers(FINGERS);
+    LockFreeBST<int>* lock_free = dynamic_cast<LockFreeBST<int>*>(bst);
+    if (lock_free != nullptr && CONTENTION_WAIT != ContentionWait::Unknown) {
+        lock_free->set_contention_wait(CONTENTION_WAIT);
+    }
+    SharedBST<int>* shared = dynamic_cast<SharedBST<int>*>(bst);
+    if (shared != nullptr && CONTENTION_WAIT != ContentionWait::Unknown) {
+        shared->set_contention_wait(CONTENTION_WAIT);
+    }
+    CompactBST<int>* compact = dynamic_cast<CompactBST<int>*>(bst);
+    if (compact != nullptr && CONTENTION_WAIT != ContentionWait::Unknown) {
+        compact->set_contention_wait(CONTENTION_WAIT);
+    }
+    if (lock_free != nullptr && LOCAL_RESTART >= 0) {
+        lock_free->set_local_restart(LOCAL_RESTART == 1);
+    }
+    CoarseGrainedBST<int>* coarse = dynamic_cast<CoarseGrainedBST<int>*>(bst);
+    if (coarse != nullptr && READ_MODE != ReadMode::Unknown) {
+        coarse->set_read_mode(READ_MODE);
+    }
+    EliminationBST<int>* elimination = nullptr;
+    if (ELIMINATION_WIDTH > 0) {
+        elimination = new EliminationBST<int>(*bst, ELIMINATION_WIDTH);
+        bst = elimination;
+    }
+    RecordingBST<int>* recorder = nullptr;
+    if (!RECORD_PATH.empty()) {
+        recorder = new RecordingBST<int>(*bst);
+        bst = recorder;
+    }
     switch (state) {
         case State::Correctness_Test:
             // print_test_status(); 
-            correctness_test(*bst_ptrs[bst_selection]);
+            correctness_test(*bst);
             break;
         case State::Load_Test:
             // print_test_status();
-            load_test(*bst_ptrs[bst_selection]);
+            load_test(*bst);
+            break;
+        case State::Replay_Test:
+            replay_test(*bst);
             break;
         default:
             printf("Unknown state\n");
             printf("-t Correctness_Test\n");
             printf("-p Load_Test\n");
+            printf("-i Replay_Test\n");
             break;
     }
+    report_arena<SharedBST<int>>(bst_ptrs[bst_selection]);
+    report_arena<CompactBST<int>>(bst_ptrs[bst_selection]);
+    if (recorder != nullptr && !recorder->save(RECORD_PATH.c_str())) {
+        printf("cannot write trace %s\n", RECORD_PATH.c_str());
+    }
+    delete recorder;
+    delete elimination;
     free_bsts();
+    BST_TRACE_FLUSH("trace.json");
     return 0;
 }
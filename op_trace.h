@@ -0,0 +1,471 @@
+#ifndef OP_TRACE_H
+#define OP_TRACE_H
+
+#include "bst.h"
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <type_traits>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Binary traces of tree operations, for replaying recorded access
+ * patterns against any tree.
+ *
+ * The file is written in host byte order:
+ *   op_trace_header_t
+ *   uint64_t counts[threads]        operations of each thread
+ *   for each thread, 8 byte aligned:
+ *     op_record_t<T> records[count]
+ *     uint64_t timestamps[count]    only if OP_TRACE_TIMED is set
+ *
+ * Operations are grouped by the thread which ran them, so a replay thread
+ * reads its stream straight from the mapping. A timestamp is the time in
+ * ns between the start of the recording and the call of the operation.
+ *
+ * A Phase record ends a phase of the run, like populating the tree before
+ * the measured part. Every stream holds the same phase records, and the
+ * replay threads wait for each other at them.
+ */
+enum class TraceOp : uint8_t {
+    Insert=0, Erase, Find, Phase, Unknown
+};
+
+static const uint32_t OP_TRACE_TIMED = 1;
+
+struct op_trace_header_t {
+    char magic[8];     // "BSTOPS1"
+    uint32_t key_size; // sizeof(T) of the recorded tree
+    uint32_t flags;
+    uint64_t threads;  // Number of streams
+    uint64_t reserved;
+};
+
+template<typename T>
+struct op_record_t {
+    uint8_t op;       // TraceOp
+    uint8_t reserved;
+    uint16_t thread;  // Thread which ran the operation
+    T key;
+};
+
+inline size_t op_trace_align(size_t offset) {
+    return (offset + 7) / 8 * 8;
+}
+
+inline size_t op_trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Barrier of the replay threads at the Phase records of a trace.
+ */
+class PhaseBarrier {
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t parties;
+    size_t waiting;
+    size_t generation;
+    size_t opened; // op_trace_now() when the barrier last opened, 0 if it never did
+
+public:
+    PhaseBarrier(size_t _parties): parties(_parties), waiting(0), generation(0), opened(0) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        size_t arrived = generation;
+        if (++waiting == parties) {
+            waiting = 0;
+            generation++;
+            opened = op_trace_now();
+            cv.notify_all();
+            return;
+        }
+        cv.wait(lock, [this, arrived]() { return generation != arrived; });
+    }
+
+    size_t last_opened() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return opened;
+    }
+};
+
+/**
+ * Wrapper which records insert, erase and find of every thread in front
+ * of another tree. Each thread appends to its own buffer, so recording
+ * takes no lock; the buffers are written out by save() afterwards. Other
+ * operations pass through unrecorded. Threads must call register_thread()
+ * before their first operation.
+ *
+ * Buffers grow by fixed size chunks, so an append never copies the
+ * records taken so far, and the clock is read after a new chunk is
+ * allocated, so the allocation does not show in the timestamps.
+ */
+template<typename T>
+class RecordingBST : public BST<T> {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are written to the trace as raw bytes");
+
+    static const size_t CHUNK_OPS = 4096;
+
+    struct chunk_t {
+        op_record_t<T> records[CHUNK_OPS];
+        uint64_t timestamps[CHUNK_OPS];
+    };
+
+    struct stream_t {
+        std::vector<std::unique_ptr<chunk_t>> chunks;
+        size_t count; // Records in all chunks, only the last one is partly filled
+        char pad[64]; // Keep the buffers of different threads on different cache lines
+        stream_t(): count(0) {}
+    };
+
+    BST<T>& tree;
+    bool timed;
+    size_t start; // Time of the start of the recording in ns
+    std::vector<stream_t> streams;
+    static thread_local size_t thread_id;
+
+    void record(TraceOp op, const T& key, size_t tid) {
+        stream_t& stream = streams[tid];
+        size_t slot = stream.count % CHUNK_OPS;
+        if (slot == 0 && stream.count == stream.chunks.size() * CHUNK_OPS) {
+            stream.chunks.emplace_back(new chunk_t);
+        }
+        chunk_t& chunk = *stream.chunks[stream.count / CHUNK_OPS];
+        op_record_t<T>& r = chunk.records[slot];
+        r.op = static_cast<uint8_t>(op);
+        r.reserved = 0;
+        r.thread = static_cast<uint16_t>(tid);
+        r.key = key;
+        if (timed) {
+            chunk.timestamps[slot] = op_trace_now() - start;
+        }
+        stream.count++;
+    }
+
+    void record(TraceOp op, const T& key) {
+        record(op, key, thread_id);
+    }
+
+public:
+    /**
+     * @param _tree tree the operations run on, not owned
+     * @param _timed whether to store the time of each operation for paced replays
+     */
+    RecordingBST(BST<T>& _tree, bool _timed=true): tree(_tree), timed(_timed), start(op_trace_now()) {}
+    RecordingBST(RecordingBST& other)=delete;
+    RecordingBST& operator=(const RecordingBST& other)=delete;
+
+    // Drop the recorded operations and restart the clock, no thread may be recording
+    void reset() {
+        for (stream_t& stream : streams) {
+            stream.chunks.clear();
+            stream.count = 0;
+        }
+        start = op_trace_now();
+    }
+
+    /**
+     * End a phase of the run in every stream, no thread may be recording.
+     * A replay runs no operation of the next phase before every stream has
+     * finished this one.
+     */
+    void mark_phase() {
+        for (size_t tid = 0; tid < streams.size(); tid++) {
+            record(TraceOp::Phase, T(), tid);
+        }
+    }
+
+    /**
+     * Write the recorded operations to path, no thread may be recording
+     *
+     * @return true if the trace is written; false otherwise
+     */
+    bool save(const char* path);
+
+    // Records taken so far, phase records included
+    size_t recorded() const {
+        size_t count = 0;
+        for (const stream_t& stream : streams) {
+            count += stream.count;
+        }
+        return count;
+    }
+
+    virtual bool insert(const T& t) {
+        record(TraceOp::Insert, t);
+        return tree.insert(t);
+    }
+
+    virtual void erase(const T& t) {
+        record(TraceOp::Erase, t);
+        tree.erase(t);
+    }
+
+    virtual bool find(const T& t) {
+        record(TraceOp::Find, t);
+        return tree.find(t);
+    }
+
+    virtual size_t size() { return tree.size(); }
+    virtual void clear() { tree.clear(); }
+    virtual shape_stats_t shape_stats() { return tree.shape_stats(); }
+
+    // Streams are only added, so set_N must not run while threads record
+    virtual void set_N(size_t _N) {
+        BST<T>::set_N(_N);
+        tree.set_N(_N);
+        if (streams.size() < _N) {
+            streams.resize(_N);
+        }
+    }
+
+    virtual void set_R(size_t _R) {
+        BST<T>::set_R(_R);
+        tree.set_R(_R);
+    }
+
+    virtual void set_fingers(bool enabled) { tree.set_fingers(enabled); }
+    virtual const ReclaimStats* reclaim_stats() { return tree.reclaim_stats(); }
+
+    virtual void register_thread(size_t tid) {
+        thread_id = tid;
+        tree.register_thread(tid);
+    }
+
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out) { tree.range_query(lo, hi, out); }
+
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+        return tree.nearest(t, bounded, inclusive, ascending, result);
+    }
+
+    virtual size_t rank(const T& t) { return tree.rank(t); }
+    virtual bool select(size_t k, T& result) { return tree.select(k, result); }
+    virtual size_t range_count(const T& lo, const T& hi) { return tree.range_count(lo, hi); }
+    virtual size_t erase_range(const T& lo, const T& hi) { return tree.erase_range(lo, hi); }
+    virtual void split_keys(size_t count, std::vector<T>& keys) { tree.split_keys(count, keys); }
+
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+        tree.walk_range(lo, hi, f);
+    }
+
+    // Recorded as one find per key
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+        for (const T& key : keys) {
+            record(TraceOp::Find, key);
+        }
+        tree.find_many(keys, results);
+    }
+};
+
+template<typename T>
+thread_local size_t RecordingBST<T>::thread_id;
+
+template<typename T>
+bool RecordingBST<T>::save(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    op_trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BSTOPS1", 8);
+    header.key_size = sizeof(T);
+    header.flags = timed ? OP_TRACE_TIMED : 0;
+    header.threads = streams.size();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const stream_t& stream : streams) {
+        uint64_t count = stream.count;
+        ok = ok && fwrite(&count, sizeof(count), 1, file) == 1;
+    }
+    static const char zeros[8] = {};
+    size_t offset = sizeof(header) + streams.size() * sizeof(uint64_t);
+    for (const stream_t& stream : streams) {
+        ok = ok && fwrite(zeros, 1, op_trace_align(offset) - offset, file) == op_trace_align(offset) - offset;
+        offset = op_trace_align(offset);
+        for (size_t first = 0; first < stream.count; first += CHUNK_OPS) {
+            size_t n = std::min(CHUNK_OPS, stream.count - first);
+            ok = ok && fwrite(stream.chunks[first / CHUNK_OPS]->records, sizeof(op_record_t<T>), n, file) == n;
+        }
+        offset += stream.count * sizeof(op_record_t<T>);
+        if (timed) {
+            ok = ok && fwrite(zeros, 1, op_trace_align(offset) - offset, file) == op_trace_align(offset) - offset;
+            offset = op_trace_align(offset);
+            for (size_t first = 0; first < stream.count; first += CHUNK_OPS) {
+                size_t n = std::min(CHUNK_OPS, stream.count - first);
+                ok = ok && fwrite(stream.chunks[first / CHUNK_OPS]->timestamps, sizeof(uint64_t), n, file) == n;
+            }
+            offset += stream.count * sizeof(uint64_t);
+        }
+    }
+    return fclose(file) == 0 && ok;
+}
+
+/**
+ * A trace file mapped read only. Streams point into the mapping and stay
+ * valid until the trace is closed.
+ */
+template<typename T>
+class OpTrace {
+    struct stream_t {
+        const op_record_t<T>* records;
+        const uint64_t* timestamps; // nullptr if the trace is not timed
+        size_t count;
+    };
+
+    void* addr;
+    size_t length;
+    std::vector<stream_t> streams;
+    size_t origin; // Smallest timestamp of all streams
+
+public:
+    OpTrace(): addr(nullptr), length(0), origin(0) {}
+    ~OpTrace() { close(); }
+    OpTrace(const OpTrace& other)=delete;
+    OpTrace& operator=(const OpTrace& other)=delete;
+
+    /**
+     * Map the trace at path
+     *
+     * @return true if the trace is mapped; false if it cannot be read, is
+     *         truncated or holds keys of another size
+     */
+    bool open(const char* path);
+    void close();
+
+    size_t threads() const { return streams.size(); }
+    size_t count(size_t tid) const { return streams[tid].count; }
+    bool timed() const { return !streams.empty() && streams[0].timestamps != nullptr; }
+    const op_record_t<T>* records(size_t tid) const { return streams[tid].records; }
+
+    // Time of the i-th operation of the thread in ns after the first operation of the trace
+    size_t time(size_t tid, size_t i) const { return streams[tid].timestamps[i] - origin; }
+
+    /**
+     * Run the operations of one stream on the tree in order. The calling
+     * thread must be registered with the tree.
+     *
+     * @param paced wait until start + time() before each operation; run them
+     *        back to back otherwise, or if the trace is not timed
+     * @param start time in ns of op_trace_now() which time 0 of the trace maps to
+     * @param barrier where the replay threads of all streams meet at phase
+     *        records, nullptr to run through them
+     */
+    void replay(BST<T>& tree, size_t tid, bool paced, size_t start, PhaseBarrier* barrier=nullptr) const;
+};
+
+template<typename T>
+bool OpTrace<T>::open(const char* path) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(op_trace_header_t)) {
+        ::close(fd);
+        return false;
+    }
+    length = st.st_size;
+    addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        length = 0;
+        return false;
+    }
+    const char* base = static_cast<const char*>(addr);
+    const op_trace_header_t* header = reinterpret_cast<const op_trace_header_t*>(base);
+    size_t offset = sizeof(op_trace_header_t);
+    bool ok = memcmp(header->magic, "BSTOPS1", 8) == 0 && header->key_size == sizeof(T)
+        && header->threads <= (length - offset) / sizeof(uint64_t);
+    if (ok) {
+        bool is_timed = (header->flags & OP_TRACE_TIMED) != 0;
+        size_t record_size = sizeof(op_record_t<T>) + (is_timed ? sizeof(uint64_t) : 0);
+        const uint64_t* counts = reinterpret_cast<const uint64_t*>(base + offset);
+        offset += header->threads * sizeof(uint64_t);
+        origin = SIZE_MAX;
+        for (size_t tid = 0; ok && tid < header->threads; tid++) {
+            stream_t stream;
+            stream.count = counts[tid];
+            stream.timestamps = nullptr;
+            // Bounds the count before anything is multiplied with it
+            ok = stream.count <= length / record_size;
+            offset = op_trace_align(offset);
+            stream.records = reinterpret_cast<const op_record_t<T>*>(base + offset);
+            offset += stream.count * sizeof(op_record_t<T>);
+            if (ok && is_timed) {
+                offset = op_trace_align(offset);
+                stream.timestamps = reinterpret_cast<const uint64_t*>(base + offset);
+                offset += stream.count * sizeof(uint64_t);
+            }
+            ok = ok && offset <= length;
+            if (ok && stream.timestamps != nullptr && stream.count > 0) {
+                origin = std::min(origin, static_cast<size_t>(stream.timestamps[0]));
+            }
+            streams.push_back(stream);
+        }
+        if (origin == SIZE_MAX) {
+            origin = 0;
+        }
+    }
+    if (!ok) {
+        close();
+    }
+    return ok;
+}
+
+template<typename T>
+void OpTrace<T>::close() {
+    if (addr != nullptr) {
+        munmap(addr, length);
+    }
+    addr = nullptr;
+    length = 0;
+    streams.clear();
+    origin = 0;
+}
+
+template<typename T>
+void OpTrace<T>::replay(BST<T>& tree, size_t tid, bool paced, size_t start, PhaseBarrier* barrier) const {
+    const stream_t& stream = streams[tid];
+    paced = paced && stream.timestamps != nullptr;
+    for (size_t i = 0; i < stream.count; i++) {
+        if (paced) {
+            size_t due = start + time(tid, i);
+            while (op_trace_now() < due) {
+                std::this_thread::yield();
+            }
+        }
+        const op_record_t<T>& r = stream.records[i];
+        switch (static_cast<TraceOp>(r.op)) {
+            case TraceOp::Insert:
+                tree.insert(r.key);
+                break;
+            case TraceOp::Erase:
+                tree.erase(r.key);
+                break;
+            case TraceOp::Find:
+                tree.find(r.key);
+                break;
+            case TraceOp::Phase:
+                if (barrier != nullptr) {
+                    barrier->wait();
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * Hardware/software performance counters of the calling thread, read
+ * through perf_event_open. Every event is opened on its own, so an event
+ * which is not supported by the machine (or forbidden by
+ * perf_event_paranoid) only marks that single counter as unavailable.
+ */
+class PerfCounters {
+public:
+    enum Event {
+        Cycles=0, Instructions, LLC_Misses, DTLB_Misses, Branch_Misses, Context_Switches, Count
+    };
+
+    /**
+     * Values of all counters. A counter is valid only if it could be
+     * opened and was actually scheduled on the PMU during the measurement.
+     */
+    struct Reading {
+        uint64_t values[Event::Count];
+        bool valid[Event::Count];
+
+        Reading() {
+            memset(values, 0, sizeof(values));
+            memset(valid, 0, sizeof(valid));
+        }
+
+        /**
+         * Accumulate another thread's reading. A counter stays valid
+         * only if it was valid in every reading.
+         */
+        Reading& operator+=(const Reading& other) {
+            for (int i = 0; i < Event::Count; i++) {
+                values[i] += other.values[i];
+                valid[i] = valid[i] && other.valid[i];
+            }
+            return *this;
+        }
+    };
+
+    PerfCounters() {
+        for (int i = 0; i < Event::Count; i++) {
+            fds[i] = -1;
+        }
+    }
+
+    ~PerfCounters() {
+        close();
+    }
+
+    PerfCounters(const PerfCounters& other)=delete;
+    PerfCounters& operator=(const PerfCounters& other)=delete;
+
+    /**
+     * Open counters for the calling thread. Counters are created disabled.
+     *
+     * @return true if at least one counter is available; false otherwise
+     */
+    bool open() {
+        bool any = false;
+        for (int i = 0; i < Event::Count; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.disabled = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            config(static_cast<Event>(i), &attr);
+            // pid = 0, cpu = -1: follow the calling thread on any cpu
+            fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            if (fds[i] < 0 && attr.type != PERF_TYPE_SOFTWARE) {
+                // Unprivileged users may only count user space events
+                attr.exclude_kernel = 1;
+                fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            }
+            any = any || fds[i] >= 0;
+        }
+        return any;
+    }
+
+    void start() {
+        for (int i = 0; i < Event::Count; i++) {
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() {
+        for (int i = 0; i < Event::Count; i++) {
+            if (fds[i] >= 0) {
+                ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    /**
+     * Read counters. Values are scaled up if the kernel multiplexed
+     * the counter with other events.
+     */
+    Reading read() const {
+        Reading reading;
+        for (int i = 0; i < Event::Count; i++) {
+            if (fds[i] < 0) {
+                continue;
+            }
+            uint64_t buf[3]; // value, time_enabled, time_running
+            if (::read(fds[i], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf))) {
+                continue;
+            }
+            if (buf[2] == 0) {
+                // Never scheduled, the value is meaningless
+                continue;
+            }
+            double scale = static_cast<double>(buf[1]) / static_cast<double>(buf[2]);
+            reading.values[i] = static_cast<uint64_t>(static_cast<double>(buf[0]) * scale);
+            reading.valid[i] = true;
+        }
+        return reading;
+    }
+
+    void close() {
+        for (int i = 0; i < Event::Count; i++) {
+            if (fds[i] >= 0) {
+                ::close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+
+    static const char* name(Event event) {
+        static const char* names[Event::Count] = {
+            "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses", "context_switches"
+        };
+        return names[event];
+    }
+
+    /**
+     * Print counters normalized by the number of operations.
+     *
+     * @param reading summed reading of all threads
+     * @param ops number of operations performed during the measurement
+     */
+    static void print(const Reading& reading, size_t ops) {
+        printf("perf:");
+        for (int i = 0; i < Event::Count; i++) {
+            if (reading.valid[i] && ops > 0) {
+                printf(" %s/op=%f", name(static_cast<Event>(i)),
+                    static_cast<double>(reading.values[i]) / static_cast<double>(ops));
+            } else {
+                printf(" %s/op=n/a", name(static_cast<Event>(i)));
+            }
+        }
+        printf("\n");
+    }
+
+private:
+    int fds[Event::Count];
+
+    static void config(Event event, struct perf_event_attr* attr) {
+        const uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        switch (event) {
+            case Event::Cycles:
+                attr->type = PERF_TYPE_HARDWARE;
+                attr->config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case Event::Instructions:
+                attr->type = PERF_TYPE_HARDWARE;
+                attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case Event::LLC_Misses:
+                attr->type = PERF_TYPE_HW_CACHE;
+                attr->config = PERF_COUNT_HW_CACHE_LL | read_miss;
+                break;
+            case Event::DTLB_Misses:
+                attr->type = PERF_TYPE_HW_CACHE;
+                attr->config = PERF_COUNT_HW_CACHE_DTLB | read_miss;
+                break;
+            case Event::Branch_Misses:
+                attr->type = PERF_TYPE_HARDWARE;
+                attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            default:
+                attr->type = PERF_TYPE_SOFTWARE;
+                attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+                break;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,782 @@
+#ifndef PERSISTENT_BST_H
+#define PERSISTENT_BST_H
+
+#include "bst.h"
+#include <set>
+
+/**
+ * Persistent tree with path copying. Nodes are never changed once they
+ * are reachable from a published root: an update copies the path from the
+ * root to the nodes it changes, and publishes the new root with one atomic
+ * store. Every root is a complete version of the key set, so readers and
+ * snapshot() handles never block and never see an update half-done.
+ *
+ * Updates are serialized by a writer lock and pay O(depth) copies. A node
+ * which an update created itself is private until the root is published,
+ * so it is changed in place instead of copied again; this keeps multi-node
+ * updates like erase_range at one copy per touched node.
+ *
+ * Reclamation works with eras. era is incremented by every publish, and a
+ * replaced node is retired with the era in which it was last reachable.
+ * An operation announces the era it reads in its thread's slot, a snapshot
+ * registers its era until it is released, and gc() frees the retired nodes
+ * of all eras older than the oldest announced or registered one.
+ */
+template<typename T>
+class PersistentBST : public BST<T> {
+    struct node_t {
+        node_t* left;
+        node_t* right;
+        T val;
+        size_t count; // Number of nodes in the subtree
+        size_t birth; // Update which created the node, see own()
+        node_t(const T& _val, size_t _birth):
+            left(nullptr), right(nullptr), val(_val), count(1), birth(_birth) {}
+    };
+
+    struct retired_t {
+        node_t* node;
+        size_t era; // Last era in which node was reachable
+        size_t tid; // Thread which retired node, whose stats slot it counts in
+    };
+
+    // Era a thread reads, IDLE if none
+    struct announce_t {
+        std::atomic<size_t> era;
+        char pad[64]; // Keep slots of different threads on different cache lines
+        announce_t(): era(IDLE) {}
+    };
+
+    static const size_t IDLE = static_cast<size_t>(-1);
+
+    std::atomic<node_t*> root;
+    std::atomic<size_t> era;
+
+    static thread_local size_t thread_id; // Local thread id
+    std::unique_ptr<announce_t[]> announced;
+    size_t announced_size;
+
+    std::mutex snap_mtx;              // Guards snapshots
+    std::multiset<size_t> snapshots;  // Eras pinned by Snapshot handles
+
+    std::mutex wmtx;                // Serializes updates
+    size_t wseq;                    // Number of updates, guarded by wmtx
+    std::vector<retired_t> rlist;   // In era order, guarded by wmtx
+    size_t gc_at;                   // rlist length which triggers the next gc()
+    ReclaimStats rstats;
+
+    /**
+     * Announce the current era for the calling thread
+     *
+     * @return root of the announced version
+     */
+    node_t* pin();
+    void unpin() { announced[thread_id].era.store(IDLE); }
+
+    /**
+     * Node which the running update may change: node itself if the update
+     * created it, otherwise a copy of it, and node is retired. The caller
+     * must hold the writer lock.
+     */
+    node_t* own(node_t* node);
+
+    // Drop a node of the old version, the caller must hold the writer lock
+    void discard(node_t* node);
+    size_t discard_subtree(node_t* node);
+    void retire(node_t* node);
+
+    /**
+     * Make node the root of the next version and free what no reader
+     * can reach anymore. The caller must hold the writer lock.
+     */
+    void publish(node_t* node);
+    void gc();
+
+    // The helpers below are the updates of CoarseGrainedBST, with own() before every change
+    node_t* erase_range_helper(node_t* node, const T& lo, const T& hi, size_t& removed);
+    node_t* trim(node_t* node, const T& bound, bool keep_less, size_t& removed);
+    node_t* join(node_t* left, node_t* right);
+    node_t* split_last(node_t* node, node_t*& last);
+
+    static size_t count(const node_t* node) {
+        return node == nullptr ? 0 : node->count;
+    }
+
+    static void fix_count(node_t* node) {
+        node->count = count(node->left) + count(node->right) + 1;
+    }
+
+    // fix_count on a path from its bottom up
+    static void fix_counts(const std::vector<node_t*>& path) {
+        for (size_t i = path.size(); i-- > 0;) {
+            fix_count(path[i]);
+        }
+    }
+
+    // Queries on one version, shared by the tree and its snapshots
+    static bool find_in(const node_t* node, const T& t);
+    static size_t rank_in(const node_t* node, const T& t);
+    static bool select_in(const node_t* node, size_t k, T& result);
+    static bool nearest_in(const node_t* node, const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * In-order walk over keys in [lo, hi) with an explicit stack.
+     *
+     * @param lo inclusive lower bound, nullptr for no bound
+     * @param hi exclusive upper bound, nullptr for no bound
+     */
+    template<typename F>
+    static void walk(const node_t* node, const T* lo, const T* hi, F visit);
+
+    static void free_subtree(node_t* node);
+
+public:
+    /**
+     * Read-only handle of the version which was current when it was taken.
+     * It keeps the nodes of that version alive until it is destroyed, so
+     * it should not be held longer than needed, and it must be destroyed
+     * before the tree.
+     */
+    class Snapshot {
+        PersistentBST* tree;
+        const node_t* root;
+        size_t era;
+
+        friend class PersistentBST;
+        Snapshot(PersistentBST* _tree, const node_t* _root, size_t _era): tree(_tree), root(_root), era(_era) {}
+
+    public:
+        Snapshot(Snapshot&& other): tree(other.tree), root(other.root), era(other.era) {
+            other.tree = nullptr;
+        }
+
+        ~Snapshot() {
+            if (tree != nullptr) {
+                tree->release(era);
+            }
+        }
+
+        Snapshot(const Snapshot& other)=delete;
+        Snapshot& operator=(const Snapshot& other)=delete;
+
+        size_t size() const { return count(root); }
+        bool find(const T& t) const { return find_in(root, t); }
+        size_t rank(const T& t) const { return rank_in(root, t); }
+        bool select(size_t k, T& result) const { return select_in(root, k, result); }
+
+        bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) const {
+            return nearest_in(root, t, bounded, inclusive, ascending, result);
+        }
+
+        void range_query(const T& lo, const T& hi, std::vector<T>& out) const {
+            out.clear();
+            walk(root, &lo, &hi, [&out](const T& key) {
+                out.push_back(key);
+                return true;
+            });
+        }
+
+        void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) const {
+            walk(root, lo, hi, [&f](const T& key) {
+                f(key);
+                return true;
+            });
+        }
+    };
+
+    PersistentBST();
+    virtual ~PersistentBST();
+    PersistentBST(const PersistentBST& other)=delete;
+    PersistentBST& operator=(const PersistentBST& other)=delete;
+
+    /**
+     * Pin the current version in O(log snapshots), without copying it
+     */
+    Snapshot snapshot();
+
+    // Unregister the era of a destroyed snapshot
+    void release(size_t pinned);
+
+    virtual bool insert(const T& t);
+    virtual void erase(const T& t);
+    virtual bool find(const T& t);
+    virtual size_t size();
+
+    /**
+     * Publish an empty version, the old nodes are retired like by erase
+     */
+    virtual void clear();
+    virtual shape_stats_t shape_stats();
+    virtual void set_N(size_t _N);
+    virtual void register_thread(size_t tid) { thread_id = tid; }
+    virtual const ReclaimStats* reclaim_stats() { return &rstats; }
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+
+    /**
+     * The whole batch reads one version
+     */
+    virtual void find_many(const std::vector<T>& keys, std::vector<bool>& results);
+};
+
+template<typename T>
+thread_local size_t PersistentBST<T>::thread_id;
+
+template<typename T>
+PersistentBST<T>::PersistentBST():
+    root(nullptr), era(0), announced(new announce_t[1]), announced_size(1), wseq(0), gc_at(0) {
+    rstats.resize(1);
+}
+
+template<typename T>
+PersistentBST<T>::~PersistentBST() {
+    free_subtree(root.load());
+    for (const retired_t& retired : rlist) {
+        delete retired.node;
+    }
+}
+
+template<typename T>
+void PersistentBST<T>::set_N(size_t _N) {
+    BST<T>::set_N(_N);
+    size_t slots = std::max(_N, static_cast<size_t>(1));
+    announced.reset(new announce_t[slots]);
+    announced_size = slots;
+    rstats.resize(slots);
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::pin() {
+    std::atomic<size_t>& slot = announced[thread_id].era;
+    while (true) {
+        size_t current = era.load();
+        slot.store(current);
+        node_t* node = root.load();
+        // A publish after the era was read may have retired node before the slot was seen
+        if (era.load() == current) {
+            return node;
+        }
+    }
+}
+
+template<typename T>
+typename PersistentBST<T>::Snapshot PersistentBST<T>::snapshot() {
+    std::lock_guard<std::mutex> lock(snap_mtx);
+    while (true) {
+        size_t current = era.load();
+        std::multiset<size_t>::iterator it = snapshots.insert(current);
+        node_t* node = root.load();
+        if (era.load() == current) {
+            return Snapshot(this, node, current);
+        }
+        snapshots.erase(it);
+    }
+}
+
+template<typename T>
+void PersistentBST<T>::release(size_t pinned) {
+    std::lock_guard<std::mutex> lock(snap_mtx);
+    snapshots.erase(snapshots.find(pinned));
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::own(node_t* node) {
+    if (node->birth == wseq) {
+        return node;
+    }
+    node_t* copy = new node_t(*node);
+    copy->birth = wseq;
+    retire(node);
+    return copy;
+}
+
+template<typename T>
+void PersistentBST<T>::discard(node_t* node) {
+    if (node->birth == wseq) {
+        delete node;
+    } else {
+        retire(node);
+    }
+}
+
+template<typename T>
+size_t PersistentBST<T>::discard_subtree(node_t* node) {
+    size_t dropped = 0;
+    std::vector<node_t*> stack;
+    if (node != nullptr) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        if (node->left != nullptr) {
+            stack.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+            stack.push_back(node->right);
+        }
+        discard(node);
+        dropped++;
+    }
+    return dropped;
+}
+
+template<typename T>
+void PersistentBST<T>::retire(node_t* node) {
+    // The node is reachable until the next publish, which ends the current era
+    retired_t retired = {node, era.load(), thread_id};
+    rlist.push_back(retired);
+    rstats.retire(thread_id);
+}
+
+template<typename T>
+void PersistentBST<T>::publish(node_t* node) {
+    root.store(node);
+    era++;
+    if (rlist.size() > gc_at) {
+        gc();
+    }
+}
+
+template<typename T>
+void PersistentBST<T>::gc() {
+    BST_TRACE_SCOPE("gc");
+    size_t pause_start = ReclaimStats::now();
+    size_t oldest = era.load();
+    for (size_t i = 0; i < announced_size; i++) {
+        oldest = std::min(oldest, announced[i].era.load());
+    }
+    {
+        std::lock_guard<std::mutex> lock(snap_mtx);
+        if (!snapshots.empty()) {
+            oldest = std::min(oldest, *snapshots.begin());
+        }
+    }
+    size_t freed = 0;
+    while (freed < rlist.size() && rlist[freed].era < oldest) {
+        delete rlist[freed].node;
+        rstats.free(rlist[freed].tid, 1);
+        freed++;
+    }
+    rlist.erase(rlist.begin(), rlist.begin() + freed);
+    // Nodes pinned by an old snapshot are not scanned again before R more are retired
+    gc_at = rlist.size() + BST<T>::R;
+    rstats.pause(thread_id, 0, ReclaimStats::now() - pause_start);
+}
+
+template<typename T>
+void PersistentBST<T>::free_subtree(node_t* node) {
+    std::vector<node_t*> stack;
+    if (node != nullptr) {
+        stack.push_back(node);
+    }
+    while (!stack.empty()) {
+        node = stack.back();
+        stack.pop_back();
+        if (node->left != nullptr) {
+            stack.push_back(node->left);
+        }
+        if (node->right != nullptr) {
+            stack.push_back(node->right);
+        }
+        delete node;
+    }
+}
+
+template<typename T>
+bool PersistentBST<T>::insert(const T& t) {
+    BST_TRACE_SCOPE("insert");
+    std::lock_guard<std::mutex> lock(wmtx);
+    node_t* node = root.load();
+    if (find_in(node, t)) {
+        return false;
+    }
+    wseq++;
+    node_t* top = nullptr;
+    node_t** link = &top;
+    while (node != nullptr) {
+        node = own(node);
+        node->count++;
+        *link = node;
+        link = t < node->val ? &node->left : &node->right;
+        node = *link;
+    }
+    *link = new node_t(t, wseq);
+    publish(top);
+    return true;
+}
+
+/**
+ * A node with two children takes the key of its successor, which is then
+ * unlinked, so only the path down to the successor is copied.
+ */
+template<typename T>
+void PersistentBST<T>::erase(const T& t) {
+    BST_TRACE_SCOPE("erase");
+    std::lock_guard<std::mutex> lock(wmtx);
+    node_t* node = root.load();
+    if (!find_in(node, t)) {
+        return;
+    }
+    wseq++;
+    node_t* top = nullptr;
+    node_t** link = &top;
+    while (true) {
+        node = own(node);
+        *link = node;
+        if (t == node->val) {
+            break;
+        }
+        node->count--;
+        link = t < node->val ? &node->left : &node->right;
+        node = *link;
+    }
+    if (node->left == nullptr || node->right == nullptr) {
+        *link = node->left != nullptr ? node->left : node->right;
+        discard(node);
+        publish(top);
+        return;
+    }
+    node->count--;
+    link = &node->right;
+    node_t* next = node->right;
+    while (next->left != nullptr) {
+        next = own(next);
+        next->count--;
+        *link = next;
+        link = &next->left;
+        next = next->left;
+    }
+    node->val = next->val;
+    *link = next->right;
+    discard(next);
+    publish(top);
+}
+
+template<typename T>
+bool PersistentBST<T>::find(const T& t) {
+    BST_TRACE_SCOPE("find");
+    bool found = find_in(pin(), t);
+    unpin();
+    return found;
+}
+
+template<typename T>
+void PersistentBST<T>::find_many(const std::vector<T>& keys, std::vector<bool>& results) {
+    BST_TRACE_SCOPE("find_many");
+    results.assign(keys.size(), false);
+    const node_t* node = pin();
+    for (size_t i = 0; i < keys.size(); i++) {
+        results[i] = find_in(node, keys[i]);
+    }
+    unpin();
+}
+
+template<typename T>
+size_t PersistentBST<T>::size() {
+    size_t result = count(pin());
+    unpin();
+    return result;
+}
+
+template<typename T>
+void PersistentBST<T>::clear() {
+    std::lock_guard<std::mutex> lock(wmtx);
+    wseq++;
+    discard_subtree(root.load());
+    publish(nullptr);
+}
+
+template<typename T>
+bool PersistentBST<T>::find_in(const node_t* node, const T& t) {
+    while (node != nullptr && !(t == node->val)) {
+        node = t < node->val ? node->left : node->right;
+    }
+    return node != nullptr;
+}
+
+template<typename T>
+size_t PersistentBST<T>::rank_in(const node_t* node, const T& t) {
+    size_t rank = 0;
+    while (node != nullptr) {
+        if (node->val < t) {
+            // Node and its left subtree are smaller than t
+            rank += count(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return rank;
+}
+
+template<typename T>
+bool PersistentBST<T>::select_in(const node_t* node, size_t k, T& result) {
+    while (node != nullptr) {
+        size_t left_count = count(node->left);
+        if (k < left_count) {
+            node = node->left;
+        } else if (k == left_count) {
+            result = node->val;
+            return true;
+        } else {
+            k -= left_count + 1;
+            node = node->right;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+bool PersistentBST<T>::nearest_in(const node_t* node, const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    bool found = false;
+    while (node != nullptr) {
+        if (within_bound(node->val, t, bounded, inclusive, ascending)) {
+            result = node->val;
+            found = true;
+            // Look for a closer key
+            node = ascending ? node->left : node->right;
+        } else {
+            node = ascending ? node->right : node->left;
+        }
+    }
+    return found;
+}
+
+template<typename T>
+template<typename F>
+void PersistentBST<T>::walk(const node_t* node, const T* lo, const T* hi, F visit) {
+    std::vector<const node_t*> stack;
+    while (node != nullptr || !stack.empty()) {
+        while (node != nullptr) {
+            stack.push_back(node);
+            // Left subtree only holds keys smaller than node
+            node = lo == nullptr || *lo < node->val ? node->left : nullptr;
+        }
+        node = stack.back();
+        stack.pop_back();
+        if ((lo == nullptr || !(node->val < *lo)) && (hi == nullptr || node->val < *hi)) {
+            if (!visit(node->val)) {
+                return;
+            }
+        }
+        // Right subtree only holds keys larger than node
+        node = hi == nullptr || node->val < *hi ? node->right : nullptr;
+    }
+}
+
+template<typename T>
+void PersistentBST<T>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    BST_TRACE_SCOPE("range_query");
+    out.clear();
+    walk(pin(), &lo, &hi, [&out](const T& key) {
+        out.push_back(key);
+        return true;
+    });
+    unpin();
+}
+
+template<typename T>
+bool PersistentBST<T>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    bool found = nearest_in(pin(), t, bounded, inclusive, ascending, result);
+    unpin();
+    return found;
+}
+
+template<typename T>
+size_t PersistentBST<T>::rank(const T& t) {
+    size_t result = rank_in(pin(), t);
+    unpin();
+    return result;
+}
+
+template<typename T>
+bool PersistentBST<T>::select(size_t k, T& result) {
+    bool found = select_in(pin(), k, result);
+    unpin();
+    return found;
+}
+
+template<typename T>
+size_t PersistentBST<T>::range_count(const T& lo, const T& hi) {
+    if (!(lo < hi)) {
+        return 0;
+    }
+    // Both ranks come from the same version
+    const node_t* node = pin();
+    size_t result = rank_in(node, hi) - rank_in(node, lo);
+    unpin();
+    return result;
+}
+
+template<typename T>
+size_t PersistentBST<T>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(wmtx);
+    node_t* node = root.load();
+    if (rank_in(node, hi) == rank_in(node, lo)) {
+        return 0;
+    }
+    wseq++;
+    size_t removed = 0;
+    publish(erase_range_helper(node, lo, hi, removed));
+    return removed;
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::erase_range_helper(node_t* node,
+    const T& lo, const T& hi, size_t& removed) {
+    // A loop instead of recursion, a degenerate tree is as deep as it is large
+    std::vector<node_t*> path;
+    node_t** edge = &node;
+    while (*edge != nullptr) {
+        node_t* cur = *edge;
+        if (cur->val < lo) {
+            cur = own(cur);
+            *edge = cur;
+            path.push_back(cur);
+            edge = &cur->right;
+        } else if (!(cur->val < hi)) {
+            cur = own(cur);
+            *edge = cur;
+            path.push_back(cur);
+            edge = &cur->left;
+        } else {
+            node_t* left = trim(cur->left, lo, true, removed);
+            node_t* right = trim(cur->right, hi, false, removed);
+            discard(cur);
+            removed++;
+            *edge = join(left, right);
+            break;
+        }
+    }
+    fix_counts(path);
+    return node;
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::trim(node_t* node,
+    const T& bound, bool keep_less, size_t& removed) {
+    std::vector<node_t*> path;
+    node_t** edge = &node;
+    while (true) {
+        node_t* cur = *edge;
+        while (cur != nullptr && (cur->val < bound) != keep_less) {
+            node_t* near = keep_less ? cur->left : cur->right;
+            removed += discard_subtree(keep_less ? cur->right : cur->left) + 1;
+            discard(cur);
+            cur = near;
+        }
+        if (cur == nullptr) {
+            *edge = nullptr;
+            break;
+        }
+        cur = own(cur);
+        *edge = cur;
+        path.push_back(cur);
+        edge = keep_less ? &cur->right : &cur->left;
+    }
+    fix_counts(path);
+    return node;
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::join(node_t* left, node_t* right) {
+    if (left == nullptr) {
+        return right;
+    }
+    if (right == nullptr) {
+        return left;
+    }
+    node_t* last;
+    left = split_last(left, last);
+    last->left = left;
+    last->right = right;
+    fix_count(last);
+    return last;
+}
+
+template<typename T>
+typename PersistentBST<T>::node_t* PersistentBST<T>::split_last(node_t* node, node_t*& last) {
+    std::vector<node_t*> path;
+    node_t** edge = &node;
+    while (true) {
+        node_t* cur = own(*edge);
+        *edge = cur;
+        if (cur->right == nullptr) {
+            last = cur;
+            *edge = cur->left;
+            break;
+        }
+        path.push_back(cur);
+        edge = &cur->right;
+    }
+    fix_counts(path);
+    return node;
+}
+
+template<typename T>
+void PersistentBST<T>::split_keys(size_t count, std::vector<T>& keys) {
+    // Evenly spaced ranks by the subtree counts, O(depth) each
+    keys.clear();
+    size_t n = size();
+    for (size_t i = 1; i <= count; i++) {
+        T key;
+        if (select(i * n / (count + 1), key) && (keys.empty() || keys.back() < key)) {
+            keys.push_back(key);
+        }
+    }
+}
+
+template<typename T>
+void PersistentBST<T>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    walk(pin(), lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
+    unpin();
+}
+
+/**
+ * Walk the tree with an explicit stack, so that degenerated trees
+ * do not overflow the call stack.
+ */
+template<typename T>
+shape_stats_t PersistentBST<T>::shape_stats() {
+    shape_stats_t stats;
+    std::vector<std::pair<const node_t*, size_t>> stack;
+    const node_t* top = pin();
+    if (top != nullptr) {
+        stack.push_back(std::make_pair(top, 0));
+    }
+    while (!stack.empty()) {
+        const node_t* node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        bool leaf = node->left == nullptr && node->right == nullptr;
+        stats.visit(depth, leaf, true);
+        if (node->left != nullptr) {
+            stack.push_back(std::make_pair(node->left, depth + 1));
+        }
+        if (node->right != nullptr) {
+            stack.push_back(std::make_pair(node->right, depth + 1));
+        }
+    }
+    unpin();
+    {
+        std::lock_guard<std::mutex> lock(wmtx);
+        stats.retired_nodes = rlist.size();
+    }
+    return stats;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef RECLAIM_STATS_H
+#define RECLAIM_STATS_H
+
+#include <stdio.h>
+#include <vector>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+/**
+ * Telemetry of the retire list based reclamation used by the concurrent
+ * trees. Every thread only updates its own slot, so no synchronization is
+ * needed while the tree is running. Readers are expected to aggregate after
+ * worker threads are joined.
+ */
+class ReclaimStats {
+public:
+    // Bucket i counts gc() pauses in [2^i, 2^(i+1)) nanoseconds
+    static const int PAUSE_BUCKETS = 40;
+
+    struct slot_t {
+        size_t retired;     // Nodes pushed to the retire list
+        size_t freed;       // Nodes deleted from the retire list
+        size_t pending;     // Nodes retired but not freed yet
+        size_t pending_hwm; // Maximum of pending
+        size_t gc_count;    // Number of gc() pauses
+        size_t pause_total; // Sum of gc() pause durations in ns
+        size_t pause_max;   // Longest gc() pause in ns
+        size_t pause_hist[PAUSE_BUCKETS];
+        char pad[64]; // Keep slots of different threads on different cache lines
+
+        slot_t() {
+            memset(this, 0, sizeof(*this));
+        }
+
+        slot_t& operator+=(const slot_t& other) {
+            retired += other.retired;
+            freed += other.freed;
+            pending += other.pending;
+            pending_hwm += other.pending_hwm;
+            gc_count += other.gc_count;
+            pause_total += other.pause_total;
+            pause_max = std::max(pause_max, other.pause_max);
+            for (int i = 0; i < PAUSE_BUCKETS; i++) {
+                pause_hist[i] += other.pause_hist[i];
+            }
+            return *this;
+        }
+    };
+
+    void resize(size_t n) {
+        slots.resize(n);
+    }
+
+    void retire(size_t tid, size_t count=1) {
+        slot_t& slot = slots[tid];
+        slot.retired += count;
+        slot.pending += count;
+        if (slot.pending > slot.pending_hwm) {
+            slot.pending_hwm = slot.pending;
+        }
+    }
+
+    /**
+     * Record nodes freed outside of a gc() pause, e.g. by clear()
+     */
+    void free(size_t tid, size_t count) {
+        slot_t& slot = slots[tid];
+        slot.freed += count;
+        slot.pending -= count;
+    }
+
+    /**
+     * Record a gc() pause which freed count nodes
+     *
+     * @param tid id of the thread which ran gc()
+     * @param count number of nodes freed
+     * @param ns how long other operations were blocked, in nanoseconds
+     */
+    void pause(size_t tid, size_t count, size_t ns) {
+        free(tid, count);
+        slot_t& slot = slots[tid];
+        slot.gc_count++;
+        slot.pause_total += ns;
+        slot.pause_max = std::max(slot.pause_max, ns);
+        int bucket = 0;
+        while (bucket + 1 < PAUSE_BUCKETS && (static_cast<size_t>(2) << bucket) <= ns) {
+            bucket++;
+        }
+        slot.pause_hist[bucket]++;
+    }
+
+    size_t threads() const {
+        return slots.size();
+    }
+
+    const slot_t& thread(size_t tid) const {
+        return slots[tid];
+    }
+
+    /**
+     * Sum of all threads. pending_hwm of the sum is the sum of per-thread
+     * high-water marks, which bounds the tree-wide high-water mark from above.
+     */
+    slot_t total() const {
+        slot_t sum;
+        for (const slot_t& slot : slots) {
+            sum += slot;
+        }
+        return sum;
+    }
+
+    void print() const {
+        slot_t sum = total();
+        size_t thread_hwm = 0;
+        for (const slot_t& slot : slots) {
+            thread_hwm = std::max(thread_hwm, slot.pending_hwm);
+        }
+        printf("reclaim: retired=%lu freed=%lu pending=%lu pending_hwm=%lu thread_pending_hwm=%lu\n",
+            sum.retired, sum.freed, sum.pending, sum.pending_hwm, thread_hwm);
+        printf("gc: pauses=%lu avg_ns=%lu max_ns=%lu\n",
+            sum.gc_count, sum.gc_count == 0 ? 0 : sum.pause_total / sum.gc_count, sum.pause_max);
+        for (int i = 0; i < PAUSE_BUCKETS; i++) {
+            if (sum.pause_hist[i] != 0) {
+                printf("gc: [%lu, %lu) ns: %lu\n",
+                    static_cast<size_t>(1) << i, static_cast<size_t>(2) << i, sum.pause_hist[i]);
+            }
+        }
+    }
+
+    /**
+     * Nanoseconds since an arbitrary fixed point, used to time pauses
+     */
+    static size_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    std::vector<slot_t> slots;
+};
+
+#endif
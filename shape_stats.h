@@ -0,0 +1,81 @@
+#ifndef SHAPE_STATS_H
+#define SHAPE_STATS_H
+
+#include <stdio.h>
+#include <vector>
+
+/**
+ * Shape of a tree. Depth is counted in edges from the topmost node which
+ * holds data, so dummy nodes of the concurrent trees are not included.
+ * Leaves are nodes without children. In the leaf-oriented LockFreeBST keys
+ * only live in leaves, while in other trees every node holds a key.
+ */
+struct shape_stats_t {
+    size_t height;         // Number of nodes on the longest path, 0 for an empty tree
+    size_t internal_nodes; // Nodes with at least one child
+    size_t leaf_nodes;     // Nodes without children
+    size_t keys;           // Nodes holding a key
+    size_t key_depth_sum;  // Sum of depths of all nodes holding a key
+    size_t retired_nodes;  // Nodes retired but not freed yet
+    std::vector<size_t> leaf_depth_hist; // leaf_depth_hist[d] is the number of leaves at depth d
+
+    shape_stats_t(): height(0), internal_nodes(0), leaf_nodes(0), keys(0), key_depth_sum(0), retired_nodes(0) {}
+
+    /**
+     * Account one node found by the tree walk.
+     *
+     * @param depth depth of the node
+     * @param leaf whether the node has no children
+     * @param key whether the node holds a key
+     */
+    void visit(size_t depth, bool leaf, bool key) {
+        if (depth + 1 > height) {
+            height = depth + 1;
+        }
+        if (leaf) {
+            leaf_nodes++;
+            if (leaf_depth_hist.size() <= depth) {
+                leaf_depth_hist.resize(depth + 1, 0);
+            }
+            leaf_depth_hist[depth]++;
+        } else {
+            internal_nodes++;
+        }
+        if (key) {
+            keys++;
+            key_depth_sum += depth;
+        }
+    }
+
+    double avg_key_depth() const {
+        return keys == 0 ? 0 : static_cast<double>(key_depth_sum) / static_cast<double>(keys);
+    }
+
+    /**
+     * Print the shape on two lines: the summary and the leaf depth
+     * histogram folded into power of 2 depth ranges [lo, hi):count.
+     *
+     * @param label name of the benchmark phase
+     */
+    void print(const char* label) const {
+        printf("shape(%s): height=%lu keys=%lu internal=%lu leaves=%lu avg_key_depth=%f retired=%lu\n",
+            label, height, keys, internal_nodes, leaf_nodes, avg_key_depth(), retired_nodes);
+        printf("shape(%s): leaf_depths=", label);
+        size_t lo = 0;
+        size_t hi = 1;
+        while (lo < leaf_depth_hist.size()) {
+            size_t count = 0;
+            for (size_t depth = lo; depth < hi && depth < leaf_depth_hist.size(); depth++) {
+                count += leaf_depth_hist[depth];
+            }
+            if (count != 0) {
+                printf(" [%lu,%lu):%lu", lo, hi, count);
+            }
+            lo = hi;
+            hi *= 2;
+        }
+        printf("\n");
+    }
+};
+
+#endif
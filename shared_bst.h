@@ -0,0 +1,1073 @@
+#ifndef SHARED_BST_H
+#define SHARED_BST_H
+
+#include "bst.h"
+#include <new>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * LockFreeBST's algorithm on nodes in a POSIX shared memory object, so
+ * that several processes map the same tree and operate on it at the same
+ * time. A process maps the object wherever mmap puts it, so child edges
+ * hold slot indices of type Ref instead of addresses: slot i is stored as
+ * (i + 1) << 2, which keeps the flag and tag bits in the low bits as in
+ * LockFreeBST and leaves 0 for nullptr. With Ref = uint32_t a node of int
+ * keys takes 12 bytes instead of the 24 of LockFreeBST, for up to 2^30
+ * slots, which fits twice the nodes in each cache line; see CompactBST.
+ *
+ * Everything the processes share lives in the header: the sentinels, the
+ * size, the update counters of range queries, and the gc barrier, which
+ * is a process-shared mutex next to the count of running operations.
+ * Nodes come from a fixed number of slots, handed out in order and then
+ * recycled through a free list. gc() pushes to the free list only while no
+ * operation runs, and only operations pop from it, so the pops never race
+ * with a push and the list has no ABA problem.
+ *
+ * Retire lists are kept per process and flushed when the process detaches.
+ * A process which dies inside an operation leaves the running count
+ * raised, and gc() in the other processes waits for it forever.
+ *
+ * Without a name the slots are a private anonymous mapping instead, an
+ * arena for the threads of one process.
+ */
+template<typename T, typename Ref = size_t>
+class SharedBST : public BST<T> {
+    static_assert(std::is_trivially_copyable<T>::value, "keys are shared between processes as raw bytes");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "atomics in shared memory must not need a lock");
+    static_assert(std::is_unsigned<Ref>::value && sizeof(Ref) <= sizeof(size_t),
+        "references are unsigned slot indices");
+
+    struct node_t {
+        T key;
+        std::atomic<Ref> left;  // Reference of the left child with flag and tag bits
+        std::atomic<Ref> right; // Reference of the right child with flag and tag bits
+    };
+
+    struct seekRecord_t {
+        Ref ancestor;
+        Ref successor;
+        Ref parent;
+        Ref leaf;
+    };
+
+    struct header_t {
+        char magic[8];
+        uint32_t key_size;
+        uint32_t node_size;
+        size_t capacity;     // Number of node slots
+        size_t nodes_offset; // Offset of the first slot
+        std::atomic<size_t> next;      // Slots handed out so far
+        std::atomic<size_t> failed;    // Allocations which found every slot in use
+        std::atomic<Ref> free_head;    // First slot of the free list, 0 if empty
+        Ref R_root;
+        Ref S_root;
+        std::atomic<size_t> size;
+        update_seq_t<> useq;
+        std::atomic<int> rw_count;
+        pthread_mutex_t mtx; // gc barrier of all processes
+        std::atomic<int> ready; // Set once the creator has initialized the header
+    };
+
+    static const size_t ATTACH_WAIT_MS = 5000;
+
+    char* base;         // Start of the mapping in this process
+    size_t mapped;      // Length of the mapping
+    header_t* header;
+    node_t* nodes;      // First slot in this process
+
+    static thread_local size_t thread_id; // Local thread id
+    std::vector<std::vector<Ref>> rlist; // Retire lists of this process
+    ReclaimStats rstats;
+    ContentionWait contention_wait; // What insert and erase of this process do after a lost CAS
+
+    static Ref set_flag(Ref ref) { return ref | static_cast<Ref>(flag_mask); }
+    static Ref clear_tag(Ref ref) { return ref & ~static_cast<Ref>(tag_mask); }
+    static Ref unmarked(Ref ref) { return ref & ~static_cast<Ref>(addr_mask); }
+    static bool is_flagged(Ref ref) { return (ref & flag_mask) != 0; }
+    static bool is_tagged(Ref ref) { return (ref & tag_mask) != 0; }
+
+    static Ref ref_of(size_t slot) { return static_cast<Ref>((slot + 1) << 2); }
+
+    node_t* get_addr(Ref ref) const {
+        size_t index = ref >> 2;
+        if (index == 0) {
+            return nullptr;
+        }
+        return nodes + index - 1;
+    }
+
+    /**
+     * Take a slot from the free list or from the unused ones.
+     *
+     * @return reference of the new node; 0 if all slots are in use
+     */
+    Ref allocate(const T& key);
+
+    // Push the node to the free list, no operation may be running
+    void free_node(Ref ref);
+
+    /**
+     * Initialize the header and the sentinels of a new object.
+     */
+    void init(size_t capacity);
+    void init_sentinel();
+
+    void lock() { pthread_mutex_lock(&header->mtx); }
+    void unlock() { pthread_mutex_unlock(&header->mtx); }
+
+    /**
+     * gc barrier, see LockFreeBST: wait until no gc() runs in any process,
+     * then register the operation.
+     */
+    void enter() {
+        {
+            BST_TRACE_SCOPE("gc_barrier");
+            lock();
+            unlock();
+        }
+        header->rw_count++;
+    }
+
+    void leave() { header->rw_count--; }
+
+    // Stop operations of all processes, like the gc() of LockFreeBST
+    void stop_world() {
+        lock();
+        BST_TRACE_SCOPE("gc_wait");
+        while (header->rw_count > 0);
+    }
+
+    void seek(const T& key, seekRecord_t* seekRecord);
+    // Sets full instead of inserting if a node cannot be allocated
+    bool insert_helper(const T& t, bool& full);
+    bool erase_helper(const T& key);
+    // Retires every node it unlinks, see LockFreeBST::cleanup
+    bool cleanup(const T& key, const seekRecord_t* seekRecord);
+
+    template<typename F>
+    void walk(const T* lo, const T* hi, F visit);
+
+    // Depth-first walk for BST::nearest, see LockFreeBST::nearest_helper, validated by snapshot_read
+    bool nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+
+    /**
+     * Run the read-only traversal until no insert or flag CAS happened
+     * during it, like LockFreeBST::snapshot_read. An attempt which finds
+     * no moment without an update in flight counts as failed. Updates of
+     * other processes cannot record to a journal in this process, so after
+     * RANGE_RETRIES failed attempts the traversal still runs once more
+     * with all operations stopped.
+     */
+    template<typename F>
+    void snapshot_read(F read);
+
+    /**
+     * Free a subtree to the free list, no operation may be running.
+     *
+     * @param keys incremented by the number of unflagged leaves freed
+     * @return number of nodes freed
+     */
+    size_t clear(Ref ref, size_t& keys);
+
+    /**
+     * Part of erase_range which runs while the world is stopped. Keys below
+     * edge lie in [*sub_lo, *sub_hi), where nullptr is unbounded. A subtree
+     * which lies inside of [lo, hi) is freed as a whole, and an internal
+     * node which loses one of its subtrees is replaced by the other one.
+     *
+     * @return the edge which replaces edge, 0 if the whole subtree is gone
+     */
+    Ref erase_range_helper(Ref edge, const T* sub_lo, const T* sub_hi,
+        const T& lo, const T& hi, size_t& removed, size_t& freed);
+
+    void retire(Ref ref);
+    void gc();
+
+    // Free the retire lists of this process
+    void flush();
+
+public:
+    SharedBST(): base(nullptr), mapped(0), header(nullptr), nodes(nullptr), contention_wait(ContentionWait::None) {}
+    virtual ~SharedBST() { detach(); }
+    SharedBST(SharedBST& other)=delete;
+    SharedBST& operator=(const SharedBST& other)=delete;
+
+    /**
+     * Map the shared memory object name, and create and initialize it if it
+     * does not exist yet. The tree must be attached before it is used.
+     * Processes which race to create the object agree on one creator, the
+     * others wait until it is initialized.
+     *
+     * @param name name of the object for shm_open, starting with '/';
+     *        nullptr for a private arena of this process
+     * @param capacity number of node slots if the object is created; ignored otherwise.
+     *        A key needs two slots, retired nodes hold theirs until the next gc.
+     * @return true if the tree is attached; false if the object could not be
+     *         created or mapped, holds a tree of other nodes, or capacity is
+     *         above max_capacity()
+     */
+    bool attach(const char* name, size_t capacity);
+
+    /**
+     * Flush the retire lists of this process and unmap the tree. The object
+     * stays until it is unlinked, so it can be attached again.
+     */
+    void detach();
+
+    // Remove the name of a shared memory object, mappings stay valid
+    static bool unlink(const char* name) { return shm_unlink(name) == 0; }
+
+    bool attached() const { return header != nullptr; }
+
+    // Bytes per node slot
+    static size_t node_size() { return sizeof(node_t); }
+
+    // Most slots a reference of type Ref can address
+    static size_t max_capacity() { return (static_cast<size_t>(std::numeric_limits<Ref>::max()) >> 2) - 1; }
+
+    // Number of node slots which were ever handed out
+    size_t used_slots() const { return header->next.load(); }
+
+    size_t capacity() const { return header->capacity; }
+
+    /**
+     * Choose what insert and erase of this process do after a lost CAS,
+     * see LockFreeBST::set_contention_wait. The default is None.
+     */
+    void set_contention_wait(ContentionWait wait) { contention_wait = wait; }
+
+    // Allocations which failed because every slot was in use, their inserts threw
+    size_t failed_allocations() const { return header->failed.load(); }
+
+    /**
+     * @return true if inserted; false if the key exists
+     * @throws std::bad_alloc if the key is not in the tree and all slots are
+     *         in use, like the trees whose nodes come from new; the tree is
+     *         unchanged and stays usable
+     */
+    virtual bool insert(const T& t);
+    virtual void erase(const T& t);
+    virtual bool find(const T& t);
+    virtual size_t size() { return header->size.load(); }
+
+    /**
+     * Free all keys of all processes. The tree must be quiescent in every
+     * process, and other processes must not hold retired nodes.
+     */
+    virtual void clear();
+    virtual shape_stats_t shape_stats();
+    virtual void set_N(size_t _N);
+    virtual void register_thread(size_t tid) { thread_id = tid; }
+    virtual const ReclaimStats* reclaim_stats() { return &rstats; }
+
+    // Validated like LockFreeBST::range_query, across all processes
+    virtual void range_query(const T& lo, const T& hi, std::vector<T>& out);
+    virtual bool nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result);
+    virtual size_t rank(const T& t);
+    virtual bool select(size_t k, T& result);
+    virtual size_t range_count(const T& lo, const T& hi);
+
+    /**
+     * Stops operations of all processes like gc() does and restructures the
+     * tree alone, unlike LockFreeBST::erase_range. Detached nodes have no
+     * readers left and go to the free list at once.
+     */
+    virtual size_t erase_range(const T& lo, const T& hi);
+    virtual void walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f);
+    // See LockFreeBST::split_keys
+    virtual void split_keys(size_t count, std::vector<T>& keys);
+};
+
+template<typename T, typename Ref>
+thread_local size_t SharedBST<T, Ref>::thread_id;
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::attach(const char* name, size_t capacity) {
+    BST_TRACE_SCOPE("attach");
+    detach();
+    size_t nodes_offset = (sizeof(header_t) + 63) / 64 * 64;
+    if (name == nullptr) {
+        if (capacity > max_capacity()) {
+            return false;
+        }
+        // Pages of slots which are never handed out stay unbacked
+        size_t length = nodes_offset + capacity * sizeof(node_t);
+        void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        base = static_cast<char*>(addr);
+        mapped = length;
+        header = reinterpret_cast<header_t*>(base);
+        nodes = reinterpret_cast<node_t*>(base + nodes_offset);
+        init(capacity);
+        return true;
+    }
+    bool created = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    if (created && capacity > max_capacity()) {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    size_t length = nodes_offset + capacity * sizeof(node_t);
+    if (created) {
+        if (ftruncate(fd, length) != 0) {
+            close(fd);
+            shm_unlink(name);
+            return false;
+        }
+    } else {
+        // The creator sizes the object right after creating it
+        struct stat st;
+        st.st_size = 0;
+        for (size_t waited = 0; fstat(fd, &st) == 0 && st.st_size == 0 && waited < ATTACH_WAIT_MS; waited++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (static_cast<size_t>(st.st_size) < nodes_offset) {
+            close(fd);
+            return false;
+        }
+        length = st.st_size;
+    }
+    void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        if (created) {
+            shm_unlink(name);
+        }
+        return false;
+    }
+    base = static_cast<char*>(addr);
+    mapped = length;
+    header = reinterpret_cast<header_t*>(base);
+    nodes = reinterpret_cast<node_t*>(base + nodes_offset);
+    if (created) {
+        init(capacity);
+        return true;
+    }
+    for (size_t waited = 0; header->ready.load() == 0 && waited < ATTACH_WAIT_MS; waited++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (header->ready.load() == 0 || memcmp(header->magic, "BSTSHM3", 8) != 0
+            || header->key_size != sizeof(T) || header->node_size != sizeof(node_t)
+            || header->nodes_offset != nodes_offset
+            || header->nodes_offset + header->capacity * sizeof(node_t) > mapped) {
+        munmap(base, mapped);
+        base = nullptr;
+        header = nullptr;
+        nodes = nullptr;
+        return false;
+    }
+    return true;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::init(size_t capacity) {
+    // The object is zero filled, so ready stays 0 until the end
+    new (&header->next) std::atomic<size_t>(0);
+    new (&header->failed) std::atomic<size_t>(0);
+    new (&header->free_head) std::atomic<Ref>(0);
+    new (&header->size) std::atomic<size_t>(0);
+    new (&header->useq) update_seq_t<>();
+    new (&header->rw_count) std::atomic<int>(0);
+    memcpy(header->magic, "BSTSHM3", 8);
+    header->key_size = sizeof(T);
+    header->node_size = sizeof(node_t);
+    header->capacity = capacity;
+    header->nodes_offset = (sizeof(header_t) + 63) / 64 * 64;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&header->mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+    header->R_root = allocate(INFINITY_2);
+    header->S_root = allocate(INFINITY_1);
+    node_t* R_root_n = get_addr(header->R_root);
+    R_root_n->left = header->S_root;
+    R_root_n->right = allocate(INFINITY_2);
+    get_addr(header->S_root)->right = allocate(INFINITY_1);
+    init_sentinel();
+    header->ready.store(1);
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::init_sentinel() {
+    get_addr(header->S_root)->left = allocate(INFINITY_0);
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::detach() {
+    if (header == nullptr) {
+        return;
+    }
+    flush();
+    munmap(base, mapped);
+    base = nullptr;
+    mapped = 0;
+    header = nullptr;
+    nodes = nullptr;
+}
+
+template<typename T, typename Ref>
+Ref SharedBST<T, Ref>::allocate(const T& key) {
+    Ref ref = header->free_head.load();
+    // Free list links are plain references in left
+    while (ref != 0 && !header->free_head.compare_exchange_weak(ref, nodes[(ref >> 2) - 1].left.load()));
+    if (ref == 0) {
+        size_t slot = header->next++;
+        if (slot >= header->capacity) {
+            header->next--;
+            header->failed++;
+            return 0;
+        }
+        ref = ref_of(slot);
+    }
+    // A pop which lost the slot may still read left, so it is only written atomically
+    node_t* node = get_addr(ref);
+    node->key = key;
+    node->left.store(0);
+    node->right.store(0);
+    return ref;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::free_node(Ref ref) {
+    node_t* node = get_addr(ref);
+    Ref head = header->free_head.load();
+    do {
+        node->left.store(head);
+    } while (!header->free_head.compare_exchange_weak(head, unmarked(ref)));
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::set_N(size_t _N) {
+    BST<T>::set_N(_N);
+    rlist.resize(_N);
+    rstats.resize(_N);
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::retire(Ref ref) {
+    rlist[thread_id].push_back(ref);
+    rstats.retire(thread_id);
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::gc() {
+    if (rlist[thread_id].size() > BST<T>::R) {
+        BST_TRACE_SCOPE("gc");
+        size_t pause_start = ReclaimStats::now();
+        stop_world();
+        for (Ref ref : rlist[thread_id]) {
+            free_node(ref);
+        }
+        size_t freed = rlist[thread_id].size();
+        rlist[thread_id].clear();
+        unlock();
+        rstats.pause(thread_id, freed, ReclaimStats::now() - pause_start);
+    }
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::flush() {
+    stop_world();
+    for (size_t tid = 0; tid < rlist.size(); tid++) {
+        for (Ref ref : rlist[tid]) {
+            free_node(ref);
+        }
+        rstats.free(tid, rlist[tid].size());
+        rlist[tid].clear();
+    }
+    unlock();
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::seek(const T& key, seekRecord_t* seekRecord) {
+    BST_TRACE_SCOPE("seek");
+    BST_STAT_INC(LF_Seek);
+    seekRecord->ancestor = header->R_root;
+    seekRecord->successor = header->S_root;
+    seekRecord->parent = header->S_root;
+    Ref parentField = get_addr(header->S_root)->left.load();
+    seekRecord->leaf = unmarked(parentField);
+    node_t* leaf = get_addr(seekRecord->leaf);
+    Ref currentField = key < leaf->key ? leaf->left.load() : leaf->right.load();
+    node_t* current = get_addr(currentField);
+    while (current != nullptr) {
+        // Check if the edge from the parent node is tagged
+        if (!is_tagged(parentField)) {
+            // Advance ancestor and successor
+            seekRecord->ancestor = seekRecord->parent;
+            seekRecord->successor = seekRecord->leaf;
+        }
+        // Advance parent and leaf
+        seekRecord->parent = seekRecord->leaf;
+        seekRecord->leaf = unmarked(currentField);
+        parentField = currentField;
+        currentField = key < current->key ? current->left.load() : current->right.load();
+        current = get_addr(currentField);
+    }
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::insert(const T& t) {
+    BST_TRACE_SCOPE("insert");
+    enter();
+    bool full = false;
+    bool result = insert_helper(t, full);
+    if (result) {
+        header->size++;
+    }
+    leave();
+    if (full) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::insert_helper(const T& t, bool& full) {
+    ContentionManager contention(contention_wait);
+    // Allocated once, a lost CAS reuses them for the next attempt
+    Ref new_leaf = 0;
+    Ref new_internal = 0;
+    while (true) {
+        seekRecord_t seekRecord;
+        seek(t, &seekRecord);
+        node_t* parent_n = get_addr(seekRecord.parent);
+        Ref leaf = seekRecord.leaf;
+        node_t* leaf_n = get_addr(leaf);
+        if (leaf_n->key == t) {
+            break;
+        }
+        if (new_leaf == 0) {
+            new_leaf = allocate(t);
+            new_internal = allocate(t);
+            if (new_leaf == 0 || new_internal == 0) {
+                full = true;
+                break;
+            }
+        }
+        node_t* internal_n = get_addr(new_internal);
+        if (t < leaf_n->key) {
+            internal_n->key = leaf_n->key;
+            internal_n->left = new_leaf;
+            internal_n->right = leaf;
+        } else {
+            internal_n->key = t;
+            internal_n->left = leaf;
+            internal_n->right = new_leaf;
+        }
+        std::atomic<Ref>* childAddrPtr = t < parent_n->key ? &parent_n->left : &parent_n->right;
+        Ref old_leaf = leaf;
+        header->useq.begin(thread_id);
+        bool result = childAddrPtr->compare_exchange_weak(old_leaf, new_internal);
+        header->useq.end(thread_id);
+        if (result) {
+            return true;
+        }
+        BST_STAT_INC(LF_Insert_CAS_Fail);
+        BST_TRACE_INSTANT("cas_fail");
+        // Help the conflicting erase
+        Ref childAddr = *childAddrPtr;
+        if (get_addr(childAddr) == leaf_n && (is_flagged(childAddr) || is_tagged(childAddr))) {
+            BST_STAT_INC(LF_Cleanup_Help);
+            cleanup(t, &seekRecord);
+        }
+        contention.fail();
+    }
+    // Never published, but only gc() may push to the free list
+    if (new_leaf != 0) {
+        retire(new_leaf);
+    }
+    if (new_internal != 0) {
+        retire(new_internal);
+    }
+    return false;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::erase(const T& key) {
+    BST_TRACE_SCOPE("erase");
+    enter();
+    bool result = erase_helper(key);
+    if (result) {
+        header->size--;
+    }
+    leave();
+    gc();
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::erase_helper(const T& key) {
+    ContentionManager contention(contention_wait);
+    Mode mode = Mode::INJECTION;
+    Ref leaf = 0;
+    while (true) {
+        seekRecord_t seekRecord;
+        seek(key, &seekRecord);
+        node_t* parent_n = get_addr(seekRecord.parent);
+        std::atomic<Ref>* childAddrPtr = key < parent_n->key ? &parent_n->left : &parent_n->right;
+        if (mode == Mode::INJECTION) {
+            leaf = seekRecord.leaf;
+            if (get_addr(leaf)->key != key) {
+                return false;
+            }
+            Ref old_leaf = leaf;
+            header->useq.begin(thread_id);
+            bool result = childAddrPtr->compare_exchange_weak(old_leaf, set_flag(leaf));
+            header->useq.end(thread_id);
+            if (result) {
+                mode = Mode::CLEANUP;
+                if (cleanup(key, &seekRecord)) {
+                    return true;
+                }
+            } else {
+                BST_STAT_INC(LF_Erase_CAS_Fail);
+                BST_TRACE_INSTANT("cas_fail");
+                Ref childAddr = *childAddrPtr;
+                if (get_addr(childAddr) == get_addr(leaf) && (is_flagged(childAddr) || is_tagged(childAddr))) {
+                    BST_STAT_INC(LF_Cleanup_Help);
+                    cleanup(key, &seekRecord);
+                }
+                contention.fail();
+            }
+        } else {
+            if (seekRecord.leaf != leaf) {
+                // Leaf flagged by this thread has been cleaned up and retired by a helper
+                return true;
+            }
+            BST_STAT_INC(LF_Erase_Retry);
+            if (cleanup(key, &seekRecord)) {
+                return true;
+            }
+            contention.fail();
+        }
+    }
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::cleanup(const T& key, const seekRecord_t* seekRecord) {
+    BST_TRACE_SCOPE("cleanup");
+    node_t* ancestor_n = get_addr(seekRecord->ancestor);
+    node_t* parent_n = get_addr(seekRecord->parent);
+    std::atomic<Ref>* successorAddrPtr = key < ancestor_n->key ? &ancestor_n->left : &ancestor_n->right;
+    std::atomic<Ref>* childAddrPtr;
+    std::atomic<Ref>* siblingAddrPtr;
+    if (key < parent_n->key) {
+        childAddrPtr = &parent_n->left;
+        siblingAddrPtr = &parent_n->right;
+    } else {
+        childAddrPtr = &parent_n->right;
+        siblingAddrPtr = &parent_n->left;
+    }
+    if (!is_flagged(*childAddrPtr)) {
+        // The leaf is not the one being erased, its sibling is
+        siblingAddrPtr = childAddrPtr;
+    }
+    // Tag the sibling edge so that it cannot change any more
+    Ref siblingAddr = siblingAddrPtr->fetch_or(static_cast<Ref>(tag_mask)) | static_cast<Ref>(tag_mask);
+    Ref successorExpect = seekRecord->successor;
+    Ref successorNew = clear_tag(siblingAddr);
+    // Reconnect the ancestor with the sibling, keeping its flag
+    bool result = successorAddrPtr->compare_exchange_weak(successorExpect, successorNew);
+    if (result) {
+        // Tagged edges and flagged leaves do not change any more
+        for (Ref node = seekRecord->successor; node != seekRecord->parent; ) {
+            node_t* node_n = get_addr(node);
+            bool left = key < node_n->key;
+            retire(unmarked((left ? node_n->right : node_n->left).load()));
+            retire(node);
+            node = unmarked((left ? node_n->left : node_n->right).load());
+        }
+        retire(unmarked((siblingAddrPtr == &parent_n->left ? parent_n->right : parent_n->left).load()));
+        retire(seekRecord->parent);
+    } else {
+        BST_STAT_INC(LF_Cleanup_CAS_Fail);
+        BST_TRACE_INSTANT("cas_fail");
+    }
+    return result;
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::find(const T& t) {
+    BST_TRACE_SCOPE("find");
+    enter();
+    seekRecord_t seekRecord;
+    seek(t, &seekRecord);
+    bool result = get_addr(seekRecord.leaf)->key == t;
+    leave();
+    return result;
+}
+
+template<typename T, typename Ref>
+template<typename F>
+void SharedBST<T, Ref>::snapshot_read(F read) {
+    enter();
+    for (int attempt = 0; attempt < RANGE_RETRIES; attempt++) {
+        size_t version;
+        if (header->useq.wait_stable(version)) {
+            read();
+            if (header->useq.validate(version)) {
+                leave();
+                return;
+            }
+        }
+        BST_STAT_INC(SR_Retry);
+    }
+    // Too many conflicts, stop new operations and wait for running ones
+    leave();
+    stop_world();
+    read();
+    unlock();
+}
+
+template<typename T, typename Ref>
+template<typename F>
+void SharedBST<T, Ref>::walk(const T* lo, const T* hi, F visit) {
+    // Edges still to be visited, the top of the stack is the leftmost one
+    std::vector<Ref> stack;
+    stack.push_back(get_addr(header->S_root)->left.load());
+    while (!stack.empty()) {
+        Ref edge = stack.back();
+        stack.pop_back();
+        node_t* node = get_addr(edge);
+        if (node == nullptr) {
+            continue;
+        }
+        Ref left = node->left.load();
+        Ref right = node->right.load();
+        if (get_addr(left) == nullptr) {
+            // Leaf, skip it if it is erased or if it is the sentinel
+            if (!is_flagged(edge) && node->key < INFINITY_0
+                && (lo == nullptr || !(node->key < *lo)) && (hi == nullptr || node->key < *hi)) {
+                if (!visit(node->key)) {
+                    return;
+                }
+            }
+            continue;
+        }
+        if (hi == nullptr || node->key < *hi) {
+            stack.push_back(right);
+        }
+        if (lo == nullptr || *lo < node->key) {
+            stack.push_back(left);
+        }
+    }
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::nearest_helper(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    // Edges still to be visited, the top of the stack is the closest one
+    std::vector<Ref> stack;
+    stack.push_back(get_addr(header->S_root)->left.load());
+    while (!stack.empty()) {
+        Ref edge = stack.back();
+        stack.pop_back();
+        node_t* node = get_addr(edge);
+        if (node == nullptr) {
+            continue;
+        }
+        Ref left = node->left.load();
+        Ref right = node->right.load();
+        if (get_addr(left) == nullptr) {
+            if (!is_flagged(edge) && node->key < INFINITY_0 &&
+                within_bound(node->key, t, bounded, inclusive, ascending)) {
+                result = node->key;
+                return true;
+            }
+            continue;
+        }
+        if (ascending) {
+            stack.push_back(right);
+            if (!bounded || t < node->key) {
+                stack.push_back(left);
+            }
+        } else {
+            stack.push_back(left);
+            if (!bounded || node->key < t || (inclusive && !(t < node->key))) {
+                stack.push_back(right);
+            }
+        }
+    }
+    return false;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::range_query(const T& lo, const T& hi, std::vector<T>& out) {
+    BST_TRACE_SCOPE("range_query");
+    snapshot_read([&]() {
+        out.clear();
+        walk(&lo, &hi, [&out](const T& key) {
+            out.push_back(key);
+            return true;
+        });
+    });
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::nearest(const T& t, bool bounded, bool inclusive, bool ascending, T& result) {
+    BST_TRACE_SCOPE("nearest");
+    bool found = false;
+    snapshot_read([&]() {
+        found = nearest_helper(t, bounded, inclusive, ascending, result);
+    });
+    return found;
+}
+
+template<typename T, typename Ref>
+size_t SharedBST<T, Ref>::rank(const T& t) {
+    BST_TRACE_SCOPE("rank");
+    size_t count = 0;
+    snapshot_read([&]() {
+        count = 0;
+        walk(nullptr, &t, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T, typename Ref>
+bool SharedBST<T, Ref>::select(size_t k, T& result) {
+    BST_TRACE_SCOPE("select");
+    bool found = false;
+    snapshot_read([&]() {
+        Ref left = k;
+        found = false;
+        walk(nullptr, nullptr, [&](const T& key) {
+            if (left == 0) {
+                result = key;
+                found = true;
+                return false;
+            }
+            left--;
+            return true;
+        });
+    });
+    return found;
+}
+
+template<typename T, typename Ref>
+size_t SharedBST<T, Ref>::range_count(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("range_count");
+    size_t count = 0;
+    snapshot_read([&]() {
+        count = 0;
+        walk(&lo, &hi, [&count](const T&) {
+            count++;
+            return true;
+        });
+    });
+    return count;
+}
+
+template<typename T, typename Ref>
+shape_stats_t SharedBST<T, Ref>::shape_stats() {
+    shape_stats_t stats;
+    std::vector<std::pair<const node_t*, size_t>> stack;
+    stack.push_back(std::make_pair(get_addr(get_addr(header->S_root)->left.load()), 0));
+    while (!stack.empty()) {
+        const node_t* node = stack.back().first;
+        size_t depth = stack.back().second;
+        stack.pop_back();
+        const node_t* left = get_addr(node->left.load());
+        const node_t* right = get_addr(node->right.load());
+        bool leaf = left == nullptr && right == nullptr;
+        if (leaf && node->key == INFINITY_0) {
+            // Sentinel leaf
+            continue;
+        }
+        stats.visit(depth, leaf, leaf);
+        if (left != nullptr) {
+            stack.push_back(std::make_pair(left, depth + 1));
+        }
+        if (right != nullptr) {
+            stack.push_back(std::make_pair(right, depth + 1));
+        }
+    }
+    for (const std::vector<Ref>& list : rlist) {
+        stats.retired_nodes += list.size();
+    }
+    return stats;
+}
+
+template<typename T, typename Ref>
+size_t SharedBST<T, Ref>::clear(Ref ref, size_t& keys) {
+    size_t freed = 0;
+    std::vector<Ref> stack;
+    stack.push_back(ref);
+    while (!stack.empty()) {
+        Ref edge = stack.back();
+        stack.pop_back();
+        node_t* node = get_addr(edge);
+        if (node == nullptr) {
+            continue;
+        }
+        Ref left = node->left.load();
+        Ref right = node->right.load();
+        if (get_addr(left) == nullptr && !is_flagged(edge)) {
+            keys++;
+        }
+        stack.push_back(left);
+        stack.push_back(right);
+        free_node(edge);
+        freed++;
+    }
+    return freed;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::clear() {
+    flush();
+    size_t keys = 0;
+    clear(get_addr(header->S_root)->left.load(), keys);
+    init_sentinel();
+    header->size = 0;
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::walk_range(const T* lo, const T* hi, const std::function<void(const T&)>& f) {
+    walk(lo, hi, [&f](const T& key) {
+        f(key);
+        return true;
+    });
+}
+
+template<typename T, typename Ref>
+void SharedBST<T, Ref>::split_keys(size_t count, std::vector<T>& keys) {
+    bool sampled = split_from_top(get_addr(get_addr(header->S_root)->left.load()), size(), count, keys,
+        [this](node_t* node, node_t*& left, node_t*& right, const T*& key, size_t& weight) {
+            left = get_addr(node->left.load());
+            right = get_addr(node->right.load());
+            key = node->key < INFINITY_0 ? &node->key : nullptr;
+            weight = left == nullptr && key != nullptr ? 1 : 0;
+        });
+    if (!sampled) {
+        BST<T>::split_keys(count, keys);
+    }
+}
+
+template<typename T, typename Ref>
+size_t SharedBST<T, Ref>::erase_range(const T& lo, const T& hi) {
+    BST_TRACE_SCOPE("erase_range");
+    if (!(lo < hi)) {
+        return 0;
+    }
+    size_t removed = 0;
+    size_t freed = 0;
+    size_t pause_start = ReclaimStats::now();
+    stop_world();
+    header->useq.begin(thread_id);
+    // The rightmost leaf below S_root->left is the sentinel, so the subtree never becomes empty
+    node_t* s_root = get_addr(header->S_root);
+    s_root->left.store(erase_range_helper(s_root->left.load(), nullptr, nullptr, lo, hi, removed, freed));
+    header->useq.end(thread_id);
+    header->size -= removed;
+    unlock();
+    rstats.retire(thread_id, freed);
+    rstats.pause(thread_id, freed, ReclaimStats::now() - pause_start);
+    return removed;
+}
+
+template<typename T, typename Ref>
+Ref SharedBST<T, Ref>::erase_range_helper(Ref edge, const T* sub_lo, const T* sub_hi,
+    const T& lo, const T& hi, size_t& removed, size_t& freed) {
+    struct frame_t {
+        Ref edge;
+        const T* sub_lo;
+        const T* sub_hi;
+        Ref halves[2]; // Replacements of the left and right edge of the node
+        size_t parent;
+        size_t side;
+        bool expanded;
+    };
+    Ref result = 0;
+    std::vector<frame_t> stack;
+    stack.push_back(frame_t{edge, sub_lo, sub_hi, {0, 0}, 0, 0, false});
+    while (!stack.empty()) {
+        frame_t& top = stack.back();
+        node_t* node = get_addr(top.edge);
+        Ref done;
+        if (top.expanded) {
+            // Both child frames were above this one, so they are finished
+            Ref new_left = top.halves[0];
+            Ref new_right = top.halves[1];
+            if (new_left != 0 && new_right != 0) {
+                node->left.store(clear_tag(new_left));
+                node->right.store(clear_tag(new_right));
+                done = top.edge;
+            } else {
+                free_node(top.edge);
+                freed++;
+                done = clear_tag(new_left != 0 ? new_left : new_right);
+            }
+        } else if (top.sub_lo != nullptr && !(*top.sub_lo < lo) && top.sub_hi != nullptr && !(hi < *top.sub_hi)) {
+            freed += clear(top.edge, removed);
+            done = 0;
+        } else if (get_addr(node->left.load()) == nullptr) {
+            // Leaf, the sentinel always stays
+            done = top.edge;
+            if (node->key < INFINITY_0 && !(node->key < lo) && node->key < hi) {
+                freed += clear(top.edge, removed);
+                done = 0;
+            }
+        } else {
+            // Left subtree holds keys smaller than node, right subtree keys not smaller than node
+            top.halves[0] = node->left.load();
+            top.halves[1] = node->right.load();
+            top.expanded = true;
+            size_t index = stack.size() - 1;
+            const T* node_lo = top.sub_lo;
+            const T* node_hi = top.sub_hi;
+            // top dangles once the stack grows, the left frame goes last so it runs first
+            if (node->key < hi) {
+                stack.push_back(frame_t{node->right.load(), &node->key, node_hi, {0, 0}, index, 1, false});
+            }
+            if (lo < node->key) {
+                stack.push_back(frame_t{node->left.load(), node_lo, &node->key, {0, 0}, index, 0, false});
+            }
+            continue;
+        }
+        size_t parent = top.parent;
+        size_t side = top.side;
+        stack.pop_back();
+        if (stack.empty()) {
+            result = done;
+        } else {
+            stack[parent].halves[side] = done;
+        }
+    }
+    return result;
+}
+
+/**
+ * SharedBST with 32-bit references in a private arena, for up to 2^30
+ * slots. Attach it with nullptr as the name.
+ */
+template<typename T>
+using CompactBST = SharedBST<T, uint32_t>;
+
+#endif
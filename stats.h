@@ -0,0 +1,152 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+#include <cstring>
+
+/**
+ * Internal events of the concurrent trees which are worth counting.
+ * Counting is compiled in only when BST_STATS is defined (make STATS=1).
+ */
+enum StatEvent {
+    FG_Erase=0,          // FineGrainedBST erase which found its key
+    FG_Rotation,         // FineGrainedBST rotation() call
+    FG_Restart_Back,     // find_helper restarted from node->back of an erased node
+    FG_Restart_Slipped,  // find_helper retried because the child slipped away
+    LF_Seek,             // LockFreeBST seek() call
+    LF_Insert_CAS_Fail,  // failed CAS in insert_helper
+    LF_Erase_CAS_Fail,   // failed flag CAS in erase_helper
+    LF_Erase_Retry,      // erase_helper re-seek after its own cleanup failed
+    LF_Cleanup_Help,     // cleanup() called to help another erase
+    LF_Cleanup_CAS_Fail, // failed CAS in cleanup()
+    LF_Pop_Retry,        // pop_min/pop_max lost the extreme leaf to another thread
+    LF_Backoff,          // pause after a lost CAS, see ContentionManager
+    LF_Yield,            // yield after a lost CAS, see ContentionManager
+    LF_Local_Restart,    // retry seek which started at the last unmarked ancestor
+    EL_Eliminated,       // insert/erase pair cancelled in EliminationBST
+    EL_Timeout,          // EliminationBST offer withdrawn without a partner
+    CG_Optimistic_Retry, // CoarseGrainedBST optimistic find which saw a removal and retried
+    CG_Read_Fallback,    // CoarseGrainedBST optimistic find which gave up and took the lock
+    EX_Chunk,            // chunk written by export_snapshot
+    EX_Corrected,        // key corrected by a journal record, see UpdateJournal
+    SR_Retry,            // snapshot read whose validation failed or which found no gap between updates
+    SR_Collect,          // snapshot read which fell back to SnapshotExport::collect
+    Stat_Event_Count
+};
+
+#ifdef BST_STATS
+
+/**
+ * Per-thread event counters. Each thread increments its own cache line
+ * without synchronization, and slots are owned by the registry so that
+ * they survive thread exit. Readers must only aggregate after worker
+ * threads are joined.
+ */
+class EventStats {
+    struct slot_t {
+        size_t counts[Stat_Event_Count];
+        char pad[64]; // Keep slots of different threads on different cache lines
+        slot_t() {
+            memset(counts, 0, sizeof(counts));
+        }
+    };
+
+    static std::mutex& registry_mtx() {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    static std::vector<slot_t*>& registry() {
+        static std::vector<slot_t*> slots;
+        return slots;
+    }
+
+    static slot_t* local_slot() {
+        static thread_local slot_t* slot = nullptr;
+        if (slot == nullptr) {
+            slot = new slot_t();
+            std::lock_guard<std::mutex> lock(registry_mtx());
+            registry().push_back(slot);
+        }
+        return slot;
+    }
+
+public:
+    static void inc(StatEvent event) {
+        local_slot()->counts[event]++;
+    }
+
+    /**
+     * Zero counters of all threads
+     */
+    static void reset() {
+        std::lock_guard<std::mutex> lock(registry_mtx());
+        for (slot_t* slot : registry()) {
+            memset(slot->counts, 0, sizeof(slot->counts));
+        }
+    }
+
+    /**
+     * Sum the counters of all threads
+     */
+    static std::vector<size_t> totals() {
+        std::vector<size_t> sum(Stat_Event_Count, 0);
+        std::lock_guard<std::mutex> lock(registry_mtx());
+        for (slot_t* slot : registry()) {
+            for (int i = 0; i < Stat_Event_Count; i++) {
+                sum[i] += slot->counts[i];
+            }
+        }
+        return sum;
+    }
+
+    static const char* name(StatEvent event) {
+        static const char* names[Stat_Event_Count] = {
+            "fg_erase", "fg_rotation", "fg_restart_back", "fg_restart_slipped",
+            "lf_seek", "lf_insert_cas_fail", "lf_erase_cas_fail", "lf_erase_retry",
+            "lf_cleanup_help", "lf_cleanup_cas_fail", "lf_pop_retry",
+            "lf_backoff", "lf_yield", "lf_local_restart",
+            "el_eliminated", "el_timeout",
+            "cg_optimistic_retry", "cg_read_fallback",
+            "ex_chunk", "ex_corrected",
+            "sr_retry", "sr_collect"
+        };
+        return names[event];
+    }
+
+    /**
+     * Print non-zero counters with their rate per operation.
+     *
+     * @param ops number of operations performed while counting
+     */
+    static void dump(size_t ops) {
+        std::vector<size_t> sum = totals();
+        printf("stats:");
+        for (int i = 0; i < Stat_Event_Count; i++) {
+            if (sum[i] == 0) {
+                continue;
+            }
+            printf(" %s=%lu", name(static_cast<StatEvent>(i)), sum[i]);
+            if (ops > 0) {
+                printf("(%f/op)", static_cast<double>(sum[i]) / static_cast<double>(ops));
+            }
+        }
+        printf("\n");
+    }
+};
+
+#define BST_STAT_INC(event) EventStats::inc(event)
+#define BST_STAT_RESET() EventStats::reset()
+#define BST_STAT_DUMP(ops) EventStats::dump(ops)
+
+#else
+
+#define BST_STAT_INC(event) do {} while (0)
+#define BST_STAT_RESET() do {} while (0)
+#define BST_STAT_DUMP(ops) do {} while (0)
+
+#endif
+
+#endif
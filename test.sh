@@ -19,3 +19,20 @@ do
         done
     done
 done
+
+# Contention managers of LockFree on the write heavy patterns. The default stays None with root
+# restarts, the original algorithm, until this sweep on a multi-core host shows a setting that wins
+for PATTERN in 3 4
+do
+    for THREAD_NUM in 8 32 128 256
+    do
+        for WAIT in 0 1 2
+        do
+            for RESTART in 0 1
+            do
+                echo "Pattern: "$PATTERN", Thread_num: "$THREAD_NUM", Wait: "$WAIT", Restart: "$RESTART >> contention_result.txt
+                ./main -p $PATTERN -n $THREAD_NUM -d 25000 -a 2 -m $WAIT -l $RESTART >> contention_result.txt
+            done
+        done
+    done
+done
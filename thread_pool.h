@@ -0,0 +1,154 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * Fixed set of worker threads for fork-join recursion. A thread which
+ * waits in invoke() runs queued tasks itself instead of blocking, so
+ * nested invoke() calls from inside tasks never deadlock, and a pool of
+ * size 1 runs everything on the calling thread.
+ */
+class ThreadPool {
+public:
+    /**
+     * @param threads number of threads working on a task, including the
+     *        calling thread, so threads - 1 workers are started
+     */
+    explicit ThreadPool(size_t threads): stopping(false) {
+        for (size_t i = 1; i < threads; i++) {
+            workers.push_back(std::thread([this]() {
+                worker_loop();
+            }));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool& other)=delete;
+    ThreadPool& operator=(const ThreadPool& other)=delete;
+
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    /**
+     * Run a and b, possibly in parallel, and return once both finished.
+     * a is offered to the workers, b runs on the calling thread.
+     */
+    template<typename A, typename B>
+    void invoke(A a, B b) {
+        if (workers.empty()) {
+            a();
+            b();
+            return;
+        }
+        task_t task(a);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(&task);
+        }
+        cv.notify_one();
+        b();
+        // Help with queued tasks, most likely with a itself, until a is done
+        while (!task.done.load()) {
+            if (!run_one()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * Call f(i) for every i in [0, tasks). Threads of the pool take the
+     * next index from a shared counter, so uneven tasks balance out.
+     */
+    template<typename F>
+    void run(size_t tasks, F f) {
+        std::atomic<size_t> next(0);
+        std::function<void()> loop = [&]() {
+            size_t i;
+            while ((i = next++) < tasks) {
+                f(i);
+            }
+        };
+        spread(size(), loop);
+    }
+
+private:
+    struct task_t {
+        std::function<void()> fn;
+        std::atomic<bool> done;
+        task_t(const std::function<void()>& _fn): fn(_fn), done(false) {}
+    };
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<task_t*> tasks; // LIFO, the newest task is the smallest one
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    /**
+     * Run the newest queued task
+     *
+     * @return true if a task was run; false if the queue is empty
+     */
+    bool run_one() {
+        task_t* task;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (tasks.empty()) {
+                return false;
+            }
+            task = tasks.back();
+            tasks.pop_back();
+        }
+        task->fn();
+        // The owner may free the task as soon as done is set
+        task->done.store(true);
+        return true;
+    }
+
+    // Run loop on the given number of threads
+    void spread(size_t threads, const std::function<void()>& loop) {
+        if (threads <= 1) {
+            loop();
+            return;
+        }
+        invoke([&]() {
+            spread(threads / 2, loop);
+        }, [&]() {
+            spread(threads - threads / 2, loop);
+        });
+    }
+
+    void worker_loop() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this]() {
+                    return stopping || !tasks.empty();
+                });
+                if (stopping && tasks.empty()) {
+                    return;
+                }
+            }
+            run_one();
+        }
+    }
+};
+
+#endif
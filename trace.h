@@ -0,0 +1,187 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Event tracing in Chrome trace / Perfetto JSON format.
+ * Tracing is compiled in only when BST_TRACE is defined (make TRACE=1).
+ * Otherwise all macros expand to nothing.
+ */
+#ifdef BST_TRACE
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Per-thread ring buffers of trace events. Only the owning thread writes
+ * to a buffer, so recording needs no lock and no atomic read-modify-write.
+ * Once a buffer is full the oldest events are overwritten. Buffers are
+ * owned by the registry and outlive their threads, and they must only be
+ * flushed after all traced threads are joined.
+ *
+ * A buffer takes CAPACITY * sizeof(event_t), 2 MB on 64-bit. When a
+ * thread exits its buffer is handed to the next thread which starts
+ * tracing, so runs which start new threads per phase only pay for the
+ * most threads alive at once. Such threads share the tid of the buffer
+ * in the trace.
+ */
+class Tracer {
+public:
+    static const size_t CAPACITY = 1 << 16; // Events kept per thread, power of 2
+
+    struct event_t {
+        const char* name; // Static string naming the operation or phase
+        size_t ts;        // Begin timestamp in ns
+        size_t dur;       // Duration in ns, ignored for instant events
+        bool instant;
+    };
+
+    static size_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static void record(const char* name, size_t ts, size_t dur, bool instant) {
+        buffer_t* buffer = local_buffer();
+        event_t& event = buffer->events[buffer->head & (CAPACITY - 1)];
+        event.name = name;
+        event.ts = ts;
+        event.dur = dur;
+        event.instant = instant;
+        buffer->head++;
+    }
+
+    static void instant(const char* name) {
+        record(name, now(), 0, true);
+    }
+
+    /**
+     * Write events of all threads to the given file
+     *
+     * @param path output file path
+     * @return true if the file is written; false otherwise
+     */
+    static bool flush(const char* path) {
+        FILE* file = fopen(path, "w");
+        if (file == nullptr) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(registry_mtx());
+        size_t base = registry().empty() ? 0 : SIZE_MAX;
+        for (buffer_t* buffer : registry()) {
+            for (size_t i = first(buffer); i < buffer->head; i++) {
+                base = std::min(base, buffer->events[i & (CAPACITY - 1)].ts);
+            }
+        }
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool comma = false;
+        for (size_t tid = 0; tid < registry().size(); tid++) {
+            buffer_t* buffer = registry()[tid];
+            for (size_t i = first(buffer); i < buffer->head; i++) {
+                const event_t& event = buffer->events[i & (CAPACITY - 1)];
+                fprintf(file, "%s{\"name\":\"%s\",\"pid\":0,\"tid\":%lu,\"ts\":%.3f,",
+                    comma ? ",\n" : "", event.name, tid, static_cast<double>(event.ts - base) / 1e3);
+                if (event.instant) {
+                    fprintf(file, "\"ph\":\"i\",\"s\":\"t\"}");
+                } else {
+                    fprintf(file, "\"ph\":\"X\",\"dur\":%.3f}", static_cast<double>(event.dur) / 1e3);
+                }
+                comma = true;
+            }
+        }
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return true;
+    }
+
+private:
+    struct buffer_t {
+        event_t events[CAPACITY];
+        size_t head; // Number of events ever recorded
+        buffer_t(): head(0) {}
+    };
+
+    static size_t first(const buffer_t* buffer) {
+        return buffer->head > CAPACITY ? buffer->head - CAPACITY : 0;
+    }
+
+    static std::mutex& registry_mtx() {
+        static std::mutex mtx;
+        return mtx;
+    }
+
+    static std::vector<buffer_t*>& registry() {
+        static std::vector<buffer_t*> buffers;
+        return buffers;
+    }
+
+    // Buffers of exited threads, guarded by registry_mtx
+    static std::vector<buffer_t*>& spare() {
+        static std::vector<buffer_t*> buffers;
+        return buffers;
+    }
+
+    // Hands the buffer of a thread back to spare() when the thread exits
+    struct owner_t {
+        buffer_t* buffer;
+        owner_t(): buffer(nullptr) {}
+        ~owner_t() {
+            std::lock_guard<std::mutex> lock(registry_mtx());
+            spare().push_back(buffer);
+        }
+    };
+
+    static buffer_t* acquire() {
+        static thread_local owner_t owner;
+        std::lock_guard<std::mutex> lock(registry_mtx());
+        if (spare().empty()) {
+            owner.buffer = new buffer_t();
+            registry().push_back(owner.buffer);
+        } else {
+            owner.buffer = spare().back();
+            spare().pop_back();
+        }
+        return owner.buffer;
+    }
+
+    static buffer_t* local_buffer() {
+        // Checked on every event, the owner is only touched once per thread
+        static thread_local buffer_t* buffer = nullptr;
+        if (buffer == nullptr) {
+            buffer = acquire();
+        }
+        return buffer;
+    }
+};
+
+/**
+ * Records a complete (begin + duration) event when going out of scope
+ */
+class TraceScope {
+    const char* name;
+    size_t start;
+public:
+    TraceScope(const char* _name): name(_name), start(Tracer::now()) {}
+    ~TraceScope() {
+        Tracer::record(name, start, Tracer::now() - start, false);
+    }
+};
+
+#define BST_TRACE_CONCAT_(a, b) a##b
+#define BST_TRACE_CONCAT(a, b) BST_TRACE_CONCAT_(a, b)
+#define BST_TRACE_SCOPE(name) TraceScope BST_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define BST_TRACE_INSTANT(name) Tracer::instant(name)
+#define BST_TRACE_FLUSH(path) Tracer::flush(path)
+
+#else
+
+#define BST_TRACE_SCOPE(name) do {} while (0)
+#define BST_TRACE_INSTANT(name) do {} while (0)
+#define BST_TRACE_FLUSH(path) do {} while (0)
+
+#endif
+
+#endif
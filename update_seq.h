@@ -0,0 +1,169 @@
+#ifndef UPDATE_SEQ_H
+#define UPDATE_SEQ_H
+
+#include <atomic>
+#include <thread>
+
+/**
+ * Counts started and finished updates of the key set. A reader which saw
+ * no update in flight, and which sees the same started count after it has
+ * collected keys, knows that the keys form a snapshot of the tree.
+ *
+ * The counts are striped over SLOTS cache lines by thread id, so updates
+ * only touch the line of their own thread and never a line shared by all
+ * writers. Readers sum the slots: finished is summed before started, and
+ * since both only grow, equal sums mean that at some moment between the
+ * two passes no update was in flight. This holds even when threads share
+ * a slot.
+ *
+ * While a journal of updates is open (see SnapshotExport), begin() also
+ * hands out tickets which order the updates after the journal's version.
+ * A journal opens under a short gate, which holds back updates that have
+ * not started yet until the ones in flight have ended.
+ */
+template<size_t SLOTS = 64>
+struct update_seq_t {
+    struct slot_t {
+        std::atomic<size_t> started;
+        std::atomic<size_t> finished;
+        char pad[64 - 2 * sizeof(std::atomic<size_t>)]; // One cache line per slot
+    };
+
+    slot_t slots[SLOTS];
+    std::atomic<size_t> gates;    // Journals being opened, updates wait while it is not 0
+    std::atomic<size_t> journals; // Open journals, updates take tickets while it is not 0
+    std::atomic<size_t> tickets;  // Next ticket, 0 stands for no ticket
+
+    update_seq_t(): gates(0), journals(0), tickets(1) {
+        for (size_t i = 0; i < SLOTS; i++) {
+            slots[i].started.store(0);
+            slots[i].finished.store(0);
+        }
+    }
+
+    /**
+     * Called by updates right before their linearization point.
+     *
+     * @param tid thread id of the caller, which picks its slot
+     * @return the update's ticket if a journal is open; 0 otherwise
+     */
+    size_t begin(size_t tid) {
+        slot_t& slot = slots[tid % SLOTS];
+        slot.started++;
+        while (gates.load() != 0) {
+            // A journal is opening, step back until it is open
+            slot.finished++;
+            while (gates.load() != 0) {
+                std::this_thread::yield();
+            }
+            slot.started++;
+        }
+        return journals.load() != 0 ? tickets++ : 0;
+    }
+
+    // Called by updates right after their linearization point
+    void end(size_t tid) { slots[tid % SLOTS].finished++; }
+
+    /**
+     * @param version set to the version to be validated later
+     * @return true if no update was in flight; false otherwise
+     */
+    bool stable(size_t& version) const {
+        size_t done = 0;
+        for (size_t i = 0; i < SLOTS; i++) {
+            done += slots[i].finished.load();
+        }
+        version = 0;
+        for (size_t i = 0; i < SLOTS; i++) {
+            version += slots[i].started.load();
+        }
+        return version == done;
+    }
+
+    // Check that no update has started since stable() returned version
+    bool validate(size_t version) const {
+        size_t started = 0;
+        for (size_t i = 0; i < SLOTS; i++) {
+            started += slots[i].started.load();
+        }
+        return started == version;
+    }
+
+    /**
+     * Wait until no update is in flight. Updates call begin() and end() a
+     * few instructions apart, so this spins briefly and then yields, but
+     * a steady stream of updates may never leave a gap. It gives up after
+     * STABLE_YIELDS yields, which callers count as a failed attempt.
+     *
+     * @param version set to the version to be validated later
+     * @return true if no update was in flight; false if it gave up
+     */
+    bool wait_stable(size_t& version) const {
+        for (size_t spins = 0; !stable(version); spins++) {
+            if (spins >= STABLE_SPINS + STABLE_YIELDS) {
+                return false;
+            }
+            if (spins >= STABLE_SPINS) {
+                std::this_thread::yield();
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Open a journal: call open(floor) at a moment when no update is in
+     * flight. Updates from then on take tickets >= floor.
+     */
+    template<typename F>
+    void open_journal(F open) {
+        gated([&]() {
+            journals++;
+            open(tickets.load());
+        });
+    }
+
+    /**
+     * Wait until every update which linearized before the call has ended,
+     * without waiting for a gap in a steady stream of updates.
+     */
+    void quiesce() {
+        gated([]() {});
+    }
+
+    void close_journal() { journals--; }
+
+    /**
+     * Call f at a moment when no update is in flight, and hold back new
+     * updates until it returns. Updates which start afterwards see what f
+     * did, so f can swap a structure they work on.
+     */
+    template<typename F>
+    void exclusive(F f) {
+        gated(f);
+    }
+
+    static const size_t STABLE_SPINS = 64;
+    static const size_t STABLE_YIELDS = 64;
+
+private:
+    /**
+     * Hold back updates which have not started yet, wait for the ones in
+     * flight, and call f at that moment. The gate only lasts as long as
+     * the updates which were in flight, so it does not block updates for
+     * long, unlike a wait under the gc lock for all running operations.
+     */
+    template<typename F>
+    void gated(F f) {
+        gates++;
+        size_t version;
+        for (size_t spins = 0; !stable(version); spins++) {
+            if (spins >= STABLE_SPINS) {
+                std::this_thread::yield();
+            }
+        }
+        f();
+        gates--;
+    }
+};
+
+#endif